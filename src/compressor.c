@@ -0,0 +1,147 @@
+#include "compressor.h"
+#include "log.h"
+
+static void destroy_compressor(compressor_t *compressor)
+{
+    ZSTD_freeCCtx(compressor->__context);
+    buffer_destroy(&compressor->__output);
+    free(compressor);
+}
+
+static compressor_t *create_compressor(const int level)
+{
+    compressor_t *compressor = malloc(sizeof(compressor_t));
+
+    if (NULL == compressor) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(compressor_t));
+        return NULL;
+    }
+
+    if (buffer_init(&compressor->__output, ZSTD_CStreamOutSize()) < 0) {
+        free(compressor);
+        return NULL;
+    }
+
+    compressor->__context = ZSTD_createCCtx();
+
+    if (NULL == compressor->__context) {
+        PRINT_STDERR("%s", "error in ZSTD_createCCtx");
+        buffer_destroy(&compressor->__output);
+        free(compressor);
+        return NULL;
+    }
+
+    const size_t result = ZSTD_CCtx_setParameter(compressor->__context,
+        ZSTD_c_compressionLevel, level);
+
+    if (ZSTD_isError(result)) {
+        PRINT_STDERR("error in ZSTD_CCtx_setParameter: %s",
+            ZSTD_getErrorName(result));
+        destroy_compressor(compressor);
+        return NULL;
+    }
+
+    return compressor;
+}
+
+static int reserve_output(buffer_t *output, const size_t size)
+{
+    const size_t capacity = buffer_end(output) - buffer_begin(output);
+
+    if (buffer_space(output) >= size) {
+        return 0;
+    }
+
+    return buffer_resize(output, capacity - buffer_space(output) + size);
+}
+
+int compressor_pool_init(compressor_pool_t *pool, const int level)
+{
+    if (level < ZSTD_minCLevel() || level > ZSTD_maxCLevel()) {
+        PRINT_STDERR("invalid compression level: %d", level);
+        return -1;
+    }
+
+    pool->__level = level;
+    SLIST_INIT(&pool->__free);
+
+    return 0;
+}
+
+void compressor_pool_destroy(compressor_pool_t *pool)
+{
+    while (!SLIST_EMPTY(&pool->__free)) {
+        compressor_t *compressor = SLIST_FIRST(&pool->__free);
+
+        SLIST_REMOVE_HEAD(&pool->__free, __entry);
+        destroy_compressor(compressor);
+    }
+}
+
+compressor_t *compressor_pool_acquire(compressor_pool_t *pool)
+{
+    if (SLIST_EMPTY(&pool->__free)) {
+        return create_compressor(pool->__level);
+    }
+
+    compressor_t *compressor = SLIST_FIRST(&pool->__free);
+
+    SLIST_REMOVE_HEAD(&pool->__free, __entry);
+
+    return compressor;
+}
+
+void compressor_pool_release(compressor_pool_t *pool, compressor_t *compressor)
+{
+    ZSTD_CCtx_reset(compressor->__context, ZSTD_reset_session_only);
+    buffer_reset(&compressor->__output);
+    SLIST_INSERT_HEAD(&pool->__free, compressor, __entry);
+}
+
+int compressor_compress(compressor_t *compressor, const char *value,
+    const size_t size, const int is_end)
+{
+    buffer_t *output = &compressor->__output;
+    ZSTD_inBuffer input = {value, size, 0};
+    const ZSTD_EndDirective directive = is_end ? ZSTD_e_end : ZSTD_e_continue;
+    size_t left = 0;
+
+    buffer_reset(output);
+
+    if (reserve_output(output,
+            ZSTD_compressBound(size) + ZSTD_CStreamOutSize()) < 0) {
+        return -1;
+    }
+
+    do {
+        if (reserve_output(output, ZSTD_CStreamOutSize()) < 0) {
+            return -1;
+        }
+
+        ZSTD_outBuffer chunk = {buffer_write_begin(output),
+            buffer_space(output), 0};
+
+        left = ZSTD_compressStream2(compressor->__context, &chunk, &input,
+            directive);
+
+        if (ZSTD_isError(left)) {
+            PRINT_STDERR("error in ZSTD_compressStream2: %s",
+                ZSTD_getErrorName(left));
+            return -1;
+        }
+
+        buffer_shift_write(output, chunk.pos);
+    } while (input.pos < input.size || (is_end && left > 0));
+
+    return 0;
+}
+
+const char *compressor_data(const compressor_t *compressor)
+{
+    return buffer_read_begin(&compressor->__output);
+}
+
+size_t compressor_size(const compressor_t *compressor)
+{
+    return buffer_left(&compressor->__output);
+}
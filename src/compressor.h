@@ -0,0 +1,33 @@
+#ifndef SMTP_SERVER_COMPRESSOR_H
+#define SMTP_SERVER_COMPRESSOR_H
+
+#include <bsd/sys/queue.h>
+#include <zstd.h>
+
+#include "buffer.h"
+
+#define COMPRESSOR_SUFFIX ".zst"
+
+typedef struct compressor {
+    ZSTD_CCtx *__context;
+    buffer_t __output;
+    SLIST_ENTRY(compressor) __entry;
+} compressor_t;
+
+typedef SLIST_HEAD(compressor_list, compressor) compressor_list_t;
+
+typedef struct compressor_pool {
+    int __level;
+    compressor_list_t __free;
+} compressor_pool_t;
+
+int compressor_pool_init(compressor_pool_t *pool, const int level);
+void compressor_pool_destroy(compressor_pool_t *pool);
+compressor_t *compressor_pool_acquire(compressor_pool_t *pool);
+void compressor_pool_release(compressor_pool_t *pool, compressor_t *compressor);
+int compressor_compress(compressor_t *compressor, const char *value,
+    const size_t size, const int is_end);
+const char *compressor_data(const compressor_t *compressor);
+size_t compressor_size(const compressor_t *compressor);
+
+#endif
@@ -6,7 +6,7 @@
 #include "transaction.h"
 
 int context_init(context_t *context, const int sock, const settings_t *settings,
-    log_t *log)
+    log_t *log, spool_t *spool)
 {
     assert(NULL != context);
 
@@ -16,7 +16,7 @@ int context_init(context_t *context, const int sock, const settings_t *settings,
 
     TAILQ_INIT(&context->out_message_queue);
 
-    if (transaction_init(&context->transaction, settings, log, sock) < 0) {
+    if (transaction_init(&context->transaction, settings, log, spool, sock) < 0) {
         buffer_destroy(&context->in_message);
         return -1;
     }
@@ -39,6 +39,9 @@ int context_init(context_t *context, const int sock, const settings_t *settings,
     context->state = SMTP_SERVER_ST_INIT;
     context->socket = sock;
     context->is_wait_transition = 0;
+    context->chunk_left = 0;
+    context->is_last_chunk = 0;
+    context->is_closing = 0;
     context->log = log;
     context->last_action_time = context->init_time;
 
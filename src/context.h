@@ -21,6 +21,9 @@ typedef struct context {
     buffer_tailq_t out_message_queue;
     int socket;
     int is_wait_transition;
+    size_t chunk_left;
+    int is_last_chunk;
+    int is_closing;
     char command[COMMAND_SIZE];
     char uuid[UUID_STRING_SIZE];
     transaction_t transaction;
@@ -29,7 +32,7 @@ typedef struct context {
 } context_t;
 
 int context_init(context_t *context, const int sock, const settings_t *settings,
-    log_t *log);
+    log_t *log, spool_t *spool);
 void context_destroy(context_t *context);
 
 #endif
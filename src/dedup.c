@@ -0,0 +1,336 @@
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "dedup.h"
+#include "log.h"
+#include "maildir.h"
+
+#define STORE_MODE (S_IRUSR | S_IWUSR)
+
+static int dedup_entry_cmp(dedup_entry_t *first, dedup_entry_t *second)
+{
+    if (first->hash != second->hash) {
+        return first->hash < second->hash ? -1 : 1;
+    }
+
+    if (first->size != second->size) {
+        return first->size < second->size ? -1 : 1;
+    }
+
+    if (first->residue != second->residue) {
+        return first->residue < second->residue ? -1 : 1;
+    }
+
+    return 0;
+}
+
+RB_GENERATE_STATIC(dedup_tree, dedup_entry, __tree_entry, dedup_entry_cmp)
+
+static void close_fd(const int fd)
+{
+    if (fd >= 0 && close(fd) < 0) {
+        CALL_ERR("close");
+    }
+}
+
+static void destroy_entry(dedup_entry_t *entry)
+{
+    close_fd(entry->fd);
+    free(entry);
+}
+
+static void evict_entries(dedup_index_t *index)
+{
+    while (index->__size > index->__capacity) {
+        dedup_entry_t *entry = TAILQ_LAST(&index->__lru, dedup_lru);
+
+        RB_REMOVE(dedup_tree, &index->__tree, entry);
+        TAILQ_REMOVE(&index->__lru, entry, __lru_entry);
+        --index->__size;
+        destroy_entry(entry);
+    }
+}
+
+static int is_unsupported(const int error)
+{
+    return EOPNOTSUPP == error || ENOTTY == error || ENOSYS == error;
+}
+
+static void handle_error(dedup_index_t *index, const char *function)
+{
+    if (is_unsupported(errno)) {
+        index->__is_supported = 0;
+        return;
+    }
+
+    if (EXDEV != errno) {
+        CALL_ERR_ARGS(function, "%s", index->__dir);
+    }
+}
+
+static off_t dedupe_range(dedup_index_t *index, const int src_fd,
+    const off_t src_offset, const int dst_fd, const off_t dst_offset,
+    const off_t length)
+{
+    const size_t size = sizeof(struct file_dedupe_range)
+        + sizeof(struct file_dedupe_range_info);
+    struct file_dedupe_range *range = calloc(1, size);
+
+    if (NULL == range) {
+        CALL_ERR_ARGS("calloc", "%lu", size);
+        return -1;
+    }
+
+    off_t done = 0;
+
+    while (done < length) {
+        range->src_offset = src_offset + done;
+        range->src_length = length - done;
+        range->dest_count = 1;
+        range->info[0].dest_fd = dst_fd;
+        range->info[0].dest_offset = dst_offset + done;
+
+        if (ioctl(src_fd, FIDEDUPERANGE, range) < 0) {
+            handle_error(index, "ioctl(FIDEDUPERANGE)");
+            break;
+        }
+
+        if (range->info[0].status < 0) {
+            errno = -range->info[0].status;
+            handle_error(index, "ioctl(FIDEDUPERANGE)");
+            break;
+        }
+
+        if (FILE_DEDUPE_RANGE_DIFFERS == range->info[0].status
+                || 0 == range->info[0].bytes_deduped) {
+            break;
+        }
+
+        done += range->info[0].bytes_deduped;
+    }
+
+    free(range);
+
+    return done;
+}
+
+static int open_source(const int fd)
+{
+    char fd_path[PATH_SIZE];
+
+    if (snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd) < 0) {
+        CALL_ERR("snprintf");
+        return -1;
+    }
+
+    const int source_fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+
+    if (source_fd < 0) {
+        CALL_ERR_ARGS("open", "%s", fd_path);
+    }
+
+    return source_fd;
+}
+
+static int create_store(dedup_index_t *index, const int fd, const off_t start)
+{
+    const int store_fd = openat(index->__dir_fd, ".",
+        O_TMPFILE | O_RDWR | O_CLOEXEC, STORE_MODE);
+
+    if (store_fd < 0) {
+        handle_error(index, "openat");
+        return -1;
+    }
+
+    const int source_fd = open_source(fd);
+
+    if (source_fd < 0) {
+        close_fd(store_fd);
+        return -1;
+    }
+
+    const struct file_clone_range range = {
+        .src_fd = source_fd,
+        .src_offset = start,
+        .src_length = 0,
+        .dest_offset = 0
+    };
+
+    const int result = ioctl(store_fd, FICLONERANGE, &range);
+
+    if (result < 0) {
+        handle_error(index, "ioctl(FICLONERANGE)");
+    }
+
+    close_fd(source_fd);
+
+    if (result < 0) {
+        close_fd(store_fd);
+        return -1;
+    }
+
+    return store_fd;
+}
+
+static void insert_entry(dedup_index_t *index, const dedup_entry_t *key,
+    const int fd)
+{
+    dedup_entry_t *entry = malloc(sizeof(dedup_entry_t));
+
+    if (NULL == entry) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(dedup_entry_t));
+        close_fd(fd);
+        return;
+    }
+
+    entry->hash = key->hash;
+    entry->size = key->size;
+    entry->residue = key->residue;
+    entry->fd = fd;
+
+    pthread_mutex_lock(&index->__mutex);
+
+    if (NULL != RB_INSERT(dedup_tree, &index->__tree, entry)) {
+        destroy_entry(entry);
+    } else {
+        TAILQ_INSERT_HEAD(&index->__lru, entry, __lru_entry);
+        ++index->__size;
+        evict_entries(index);
+    }
+
+    pthread_mutex_unlock(&index->__mutex);
+}
+
+static int find_store(dedup_index_t *index, const dedup_entry_t *key)
+{
+    pthread_mutex_lock(&index->__mutex);
+
+    dedup_entry_t *entry = RB_FIND(dedup_tree, &index->__tree,
+        (dedup_entry_t *) key);
+    int fd = -2;
+
+    if (NULL != entry) {
+        TAILQ_REMOVE(&index->__lru, entry, __lru_entry);
+        TAILQ_INSERT_HEAD(&index->__lru, entry, __lru_entry);
+        fd = dup(entry->fd);
+
+        if (fd < 0) {
+            CALL_ERR("dup");
+        }
+    }
+
+    pthread_mutex_unlock(&index->__mutex);
+
+    return fd;
+}
+
+int dedup_index_init(dedup_index_t *index, const char *dir,
+    const size_t capacity)
+{
+    index->__dir = dir;
+    index->__capacity = capacity;
+    index->__size = 0;
+    index->__is_supported = 1;
+    RB_INIT(&index->__tree);
+    TAILQ_INIT(&index->__lru);
+
+    if (maildir_make_path(dir, S_IRWXU | S_IRWXG | S_IRWXO) < 0
+            && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", dir);
+        return -1;
+    }
+
+    index->__dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (index->__dir_fd < 0) {
+        CALL_ERR_ARGS("open", "%s", dir);
+        return -1;
+    }
+
+    if (pthread_mutex_init(&index->__mutex, NULL) != 0) {
+        PRINT_STDERR("%s", "error in pthread_mutex_init");
+        close_fd(index->__dir_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void dedup_index_destroy(dedup_index_t *index)
+{
+    dedup_entry_t *entry, *temp;
+
+    TAILQ_FOREACH_SAFE(entry, &index->__lru, __lru_entry, temp) {
+        RB_REMOVE(dedup_tree, &index->__tree, entry);
+        TAILQ_REMOVE(&index->__lru, entry, __lru_entry);
+        destroy_entry(entry);
+    }
+
+    index->__size = 0;
+    close_fd(index->__dir_fd);
+    pthread_mutex_destroy(&index->__mutex);
+}
+
+int dedup_index_is_supported(dedup_index_t *index)
+{
+    pthread_mutex_lock(&index->__mutex);
+    const int is_supported = index->__is_supported;
+    pthread_mutex_unlock(&index->__mutex);
+
+    return is_supported;
+}
+
+off_t dedup_index_share(dedup_index_t *index, const int fd, const off_t offset,
+    const uint64_t hash)
+{
+    if (!index->__is_supported) {
+        return 0;
+    }
+
+    struct stat stat_buf;
+
+    if (fstat(fd, &stat_buf) < 0) {
+        CALL_ERR("fstat");
+        return -1;
+    }
+
+    const off_t block_size = stat_buf.st_blksize;
+    const off_t residue = offset % block_size;
+    const off_t start = offset - residue;
+    const off_t shared_start = 0 == residue ? offset : start + block_size;
+
+    if (shared_start >= stat_buf.st_size) {
+        return 0;
+    }
+
+    const dedup_entry_t key = {
+        .hash = hash,
+        .size = stat_buf.st_size - offset,
+        .residue = residue
+    };
+    const int store_fd = find_store(index, &key);
+
+    if (store_fd >= 0) {
+        const off_t shared = dedupe_range(index, store_fd, shared_start - start,
+            fd, shared_start, stat_buf.st_size - shared_start);
+
+        close_fd(store_fd);
+
+        return shared;
+    }
+
+    if (-1 == store_fd) {
+        return -1;
+    }
+
+    const int new_store_fd = create_store(index, fd, start);
+
+    if (new_store_fd >= 0) {
+        insert_entry(index, &key, new_store_fd);
+    }
+
+    return 0;
+}
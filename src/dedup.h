@@ -0,0 +1,40 @@
+#ifndef SMTP_SERVER_DEDUP_H
+#define SMTP_SERVER_DEDUP_H
+
+#include <bsd/sys/queue.h>
+#include <bsd/sys/tree.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct dedup_entry {
+    uint64_t hash;
+    off_t size;
+    off_t residue;
+    int fd;
+    RB_ENTRY(dedup_entry) __tree_entry;
+    TAILQ_ENTRY(dedup_entry) __lru_entry;
+} dedup_entry_t;
+
+typedef RB_HEAD(dedup_tree, dedup_entry) dedup_tree_t;
+typedef TAILQ_HEAD(dedup_lru, dedup_entry) dedup_lru_t;
+
+typedef struct dedup_index {
+    const char *__dir;
+    int __dir_fd;
+    size_t __capacity;
+    size_t __size;
+    int __is_supported;
+    dedup_tree_t __tree;
+    dedup_lru_t __lru;
+    pthread_mutex_t __mutex;
+} dedup_index_t;
+
+int dedup_index_init(dedup_index_t *index, const char *dir,
+    const size_t capacity);
+void dedup_index_destroy(dedup_index_t *index);
+int dedup_index_is_supported(dedup_index_t *index);
+off_t dedup_index_share(dedup_index_t *index, const int fd, const off_t offset,
+    const uint64_t hash);
+
+#endif
@@ -0,0 +1,247 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "delivery_index.h"
+#include "maildir.h"
+
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define DIR_MODE (S_IRWXU | S_IRWXG | S_IRWXO)
+#define PENDING_CAPACITY_MIN 16
+
+static int write_records(delivery_index_t *index,
+    const delivery_record_t *records, const size_t count)
+{
+    const size_t size = count * sizeof(delivery_record_t);
+    const ssize_t written = pwrite(index->__fd, records, size, index->__size);
+
+    if (written < 0) {
+        CALL_ERR_ARGS("pwrite", "%s", index->__path);
+        return -1;
+    }
+
+    if (written != size) {
+        PRINT_STDERR("written %ld of %lu bytes: %s", written, size,
+            index->__path);
+        return -1;
+    }
+
+    index->__size += written;
+
+    return 0;
+}
+
+static void close_file(delivery_index_t *index)
+{
+    if (index->__fd < 0) {
+        return;
+    }
+
+    const delivery_record_t end = {.magic = DELIVERY_RECORD_END_MAGIC};
+
+    write_records(index, &end, 1);
+
+    if (close(index->__fd) < 0) {
+        CALL_ERR_ARGS("close", "%s", index->__path);
+    }
+
+    index->__fd = -1;
+}
+
+static int open_file(delivery_index_t *index)
+{
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    const int length = snprintf(index->__path, sizeof(index->__path),
+        "%s/%010ld.%06ld-%d", index->__dir, current_time.tv_sec,
+        current_time.tv_usec, getpid());
+
+    if (length < 0 || length >= sizeof(index->__path)) {
+        PRINT_STDERR("path too long: %s", index->__dir);
+        return -1;
+    }
+
+    index->__fd = open(index->__path,
+        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, FILE_MODE);
+
+    if (index->__fd < 0) {
+        CALL_ERR_ARGS("open", "%s", index->__path);
+        return -1;
+    }
+
+    if (flock(index->__fd, LOCK_EX | LOCK_NB) < 0) {
+        CALL_ERR_ARGS("flock", "%s", index->__path);
+        close(index->__fd);
+        index->__fd = -1;
+        return -1;
+    }
+
+    index->__size = 0;
+
+    return 0;
+}
+
+static size_t batch_count(const delivery_index_t *index, const size_t count)
+{
+    const off_t free_count = (index->__max_size - index->__size)
+        / (off_t) sizeof(delivery_record_t) - 1;
+
+    return free_count < 1 ? 1 : MIN((size_t) free_count, count);
+}
+
+static void write_pending(delivery_index_t *index,
+    const delivery_record_t *records, const size_t count)
+{
+    size_t written = 0;
+
+    while (written < count) {
+        if (index->__fd >= 0 && index->__size > 0 && index->__size
+                + 2 * (off_t) sizeof(delivery_record_t) > index->__max_size) {
+            close_file(index);
+        }
+
+        if (index->__fd < 0 && open_file(index) < 0) {
+            return;
+        }
+
+        const size_t batch = batch_count(index, count - written);
+
+        if (write_records(index, records + written, batch) < 0) {
+            return;
+        }
+
+        written += batch;
+    }
+}
+
+static size_t take_pending(delivery_index_t *index)
+{
+    pthread_mutex_lock(&index->__mutex);
+
+    delivery_record_t *records = index->__pending;
+    const size_t capacity = index->__pending_capacity;
+    const size_t count = index->__pending_count;
+
+    index->__pending = index->__writing;
+    index->__pending_capacity = index->__writing_capacity;
+    index->__pending_count = 0;
+    index->__writing = records;
+    index->__writing_capacity = capacity;
+
+    if (0 == count) {
+        index->__is_write_pending = 0;
+    }
+
+    pthread_mutex_unlock(&index->__mutex);
+
+    return count;
+}
+
+static void run_write(helper_job_t *job)
+{
+    delivery_index_t *index = (delivery_index_t *) ((char *) job
+        - offsetof(delivery_index_t, __write_job));
+    size_t count;
+
+    while ((count = take_pending(index)) > 0) {
+        write_pending(index, index->__writing, count);
+    }
+}
+
+static int push_pending(delivery_index_t *index,
+    const delivery_record_t *record)
+{
+    if (index->__pending_count == index->__pending_capacity) {
+        const size_t capacity = 0 == index->__pending_capacity
+            ? PENDING_CAPACITY_MIN : 2 * index->__pending_capacity;
+        delivery_record_t *pending = realloc(index->__pending,
+            capacity * sizeof(delivery_record_t));
+
+        if (NULL == pending) {
+            CALL_ERR_ARGS("realloc", "%lu", capacity * sizeof(delivery_record_t));
+            return -1;
+        }
+
+        index->__pending = pending;
+        index->__pending_capacity = capacity;
+    }
+
+    index->__pending[index->__pending_count++] = *record;
+
+    return 0;
+}
+
+int delivery_index_init(delivery_index_t *index, const char *dir,
+    const off_t max_size)
+{
+    index->__dir = dir;
+    index->__fd = -1;
+    index->__size = 0;
+    index->__max_size = max_size;
+    index->__pending = NULL;
+    index->__pending_count = 0;
+    index->__pending_capacity = 0;
+    index->__writing = NULL;
+    index->__writing_capacity = 0;
+    index->__is_write_pending = 0;
+    index->__write_job.run = run_write;
+    index->__write_job.signum = 0;
+    index->__write_job.__is_pending = 0;
+
+    if (maildir_make_path(dir, DIR_MODE) < 0 && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", dir);
+        return -1;
+    }
+
+    if (open_file(index) < 0) {
+        return -1;
+    }
+
+    if (helper_pool_init(&index->__pool, 1) < 0) {
+        close_file(index);
+        return -1;
+    }
+
+    pthread_mutex_init(&index->__mutex, NULL);
+
+    return 0;
+}
+
+void delivery_index_destroy(delivery_index_t *index)
+{
+    helper_pool_destroy(&index->__pool);
+    run_write(&index->__write_job);
+    pthread_mutex_destroy(&index->__mutex);
+    close_file(index);
+    free(index->__pending);
+    free(index->__writing);
+}
+
+int delivery_index_append(delivery_index_t *index,
+    const delivery_record_t *record)
+{
+    pthread_mutex_lock(&index->__mutex);
+
+    const int result = push_pending(index, record);
+    const int is_submitted = 0 == result && !index->__is_write_pending;
+
+    if (is_submitted) {
+        index->__is_write_pending = 1;
+    }
+
+    pthread_mutex_unlock(&index->__mutex);
+
+    if (is_submitted) {
+        helper_pool_submit(&index->__pool, &index->__write_job);
+    }
+
+    return result;
+}
@@ -0,0 +1,49 @@
+#ifndef SMTP_SERVER_DELIVERY_INDEX_H
+#define SMTP_SERVER_DELIVERY_INDEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "helper_pool.h"
+#include "log.h"
+
+#define DELIVERY_RECORD_MAGIC 0x31584944
+#define DELIVERY_RECORD_END_MAGIC 0x444e4544
+#define DELIVERY_RECORD_SENDER_SIZE 480
+
+typedef struct delivery_record {
+    uint32_t magic;
+    uint32_t recipients_count;
+    int64_t time_sec;
+    int64_t time_usec;
+    uint64_t size;
+    char mailbox[PATH_SIZE];
+    char filename[PATH_SIZE];
+    char sender[DELIVERY_RECORD_SENDER_SIZE];
+} delivery_record_t;
+
+typedef struct delivery_index {
+    const char *__dir;
+    char __path[PATH_SIZE];
+    int __fd;
+    off_t __size;
+    off_t __max_size;
+    delivery_record_t *__pending;
+    size_t __pending_count;
+    size_t __pending_capacity;
+    delivery_record_t *__writing;
+    size_t __writing_capacity;
+    int __is_write_pending;
+    pthread_mutex_t __mutex;
+    helper_pool_t __pool;
+    helper_job_t __write_job;
+} delivery_index_t;
+
+int delivery_index_init(delivery_index_t *index, const char *dir,
+    const off_t max_size);
+void delivery_index_destroy(delivery_index_t *index);
+int delivery_index_append(delivery_index_t *index,
+    const delivery_record_t *record);
+
+#endif
@@ -0,0 +1,124 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "delivery_reader.h"
+
+static void unmap_records(delivery_reader_t *reader)
+{
+    if (NULL != reader->__records && munmap((void *) reader->__records,
+            reader->__records_count * sizeof(delivery_record_t)) < 0) {
+        CALL_ERR("munmap");
+    }
+
+    reader->__records = NULL;
+    reader->__records_count = 0;
+}
+
+static int map_records(delivery_reader_t *reader)
+{
+    struct stat stat_buf;
+
+    if (fstat(reader->__fd, &stat_buf) < 0) {
+        CALL_ERR("fstat");
+        return -1;
+    }
+
+    const size_t count = stat_buf.st_size / sizeof(delivery_record_t);
+
+    if (count <= reader->__records_count) {
+        return 0;
+    }
+
+    const delivery_record_t *records = mmap(NULL,
+        count * sizeof(delivery_record_t), PROT_READ, MAP_SHARED,
+        reader->__fd, 0);
+
+    if (MAP_FAILED == records) {
+        CALL_ERR("mmap");
+        return -1;
+    }
+
+    unmap_records(reader);
+    reader->__records = records;
+    reader->__records_count = count;
+
+    return 0;
+}
+
+int delivery_reader_open(delivery_reader_t *reader, const char *path,
+    const size_t position)
+{
+    reader->__records = NULL;
+    reader->__records_count = 0;
+    reader->__position = position;
+    reader->__is_ended = 0;
+    reader->__fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (reader->__fd < 0) {
+        CALL_ERR_ARGS("open", "%s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+void delivery_reader_close(delivery_reader_t *reader)
+{
+    unmap_records(reader);
+
+    if (reader->__fd >= 0 && close(reader->__fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    reader->__fd = -1;
+}
+
+const delivery_record_t *delivery_reader_next(delivery_reader_t *reader)
+{
+    if (reader->__is_ended) {
+        return NULL;
+    }
+
+    if (reader->__position >= reader->__records_count
+            && map_records(reader) < 0) {
+        return NULL;
+    }
+
+    if (reader->__position >= reader->__records_count) {
+        return NULL;
+    }
+
+    const delivery_record_t *record = &reader->__records[reader->__position];
+
+    if (DELIVERY_RECORD_MAGIC != record->magic) {
+        reader->__is_ended = DELIVERY_RECORD_END_MAGIC == record->magic;
+        return NULL;
+    }
+
+    ++reader->__position;
+
+    return record;
+}
+
+size_t delivery_reader_position(const delivery_reader_t *reader)
+{
+    return reader->__position;
+}
+
+int delivery_reader_is_complete(delivery_reader_t *reader)
+{
+    if (reader->__is_ended) {
+        return 1;
+    }
+
+    if (flock(reader->__fd, LOCK_SH | LOCK_NB) < 0) {
+        return 0;
+    }
+
+    flock(reader->__fd, LOCK_UN);
+
+    return map_records(reader) == 0
+        && reader->__position >= reader->__records_count;
+}
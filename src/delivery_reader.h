@@ -0,0 +1,21 @@
+#ifndef SMTP_SERVER_DELIVERY_READER_H
+#define SMTP_SERVER_DELIVERY_READER_H
+
+#include "delivery_index.h"
+
+typedef struct delivery_reader {
+    int __fd;
+    const delivery_record_t *__records;
+    size_t __records_count;
+    size_t __position;
+    int __is_ended;
+} delivery_reader_t;
+
+int delivery_reader_open(delivery_reader_t *reader, const char *path,
+    const size_t position);
+void delivery_reader_close(delivery_reader_t *reader);
+const delivery_record_t *delivery_reader_next(delivery_reader_t *reader);
+size_t delivery_reader_position(const delivery_reader_t *reader);
+int delivery_reader_is_complete(delivery_reader_t *reader);
+
+#endif
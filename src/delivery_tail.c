@@ -0,0 +1,49 @@
+#include <stdio.h>
+
+#include "delivery_reader.h"
+
+#define POLL_INTERVAL 100000
+
+static void print_record(const delivery_record_t *record)
+{
+    printf("%ld.%06ld\t%.*s\t%.*s\t%lu\t%.*s\t%u\n", record->time_sec,
+        record->time_usec, PATH_SIZE, record->mailbox, PATH_SIZE,
+        record->filename, record->size, DELIVERY_RECORD_SENDER_SIZE,
+        record->sender, record->recipients_count);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        PRINT_STDERR("Usage: %s <index file> [position]\n", argv[0]);
+        return 1;
+    }
+
+    delivery_reader_t reader;
+    const size_t position = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+    if (delivery_reader_open(&reader, argv[1], position) < 0) {
+        return 1;
+    }
+
+    while (1) {
+        const delivery_record_t *record;
+
+        while (NULL != (record = delivery_reader_next(&reader))) {
+            print_record(record);
+        }
+
+        fflush(stdout);
+
+        if (delivery_reader_is_complete(&reader)) {
+            break;
+        }
+
+        usleep(POLL_INTERVAL);
+    }
+
+    fprintf(stderr, "position: %lu\n", delivery_reader_position(&reader));
+    delivery_reader_close(&reader);
+
+    return 0;
+}
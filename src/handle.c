@@ -1,3 +1,8 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
 #include "log.h"
 #include "handle.h"
 #include "protocol.h"
@@ -37,7 +42,23 @@ transition_result_t handle_ehlo(context_t *context)
         return TRANSITION_ERROR;
     }
 
-    if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue, "250 Ok" CRLF) < 0) {
+    if (strncmp(context->command, EHLO, strlen(EHLO)) != 0) {
+        if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue, "250 Ok" CRLF) < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        return TRANSITION_SUCCEED;
+    }
+
+    char reply[64];
+
+    if (snprintf(reply, sizeof(reply), "250-Ok" CRLF "250-CHUNKING" CRLF "250 SIZE %d" CRLF,
+            context->settings->max_message_size) < 0) {
+        CALL_ERR("snprintf");
+        return TRANSITION_ERROR;
+    }
+
+    if (buffer_tailq_push_back_string(&context->out_message_queue, reply) < 0) {
         return TRANSITION_ERROR;
     }
 
@@ -80,6 +101,29 @@ transition_result_t handle_vrfy(context_t *context)
     return TRANSITION_SUCCEED;
 }
 
+static size_t to_size(const char *value, const size_t length)
+{
+    size_t size = 0;
+
+    for (const char *digit = value; digit < value + length; ++digit) {
+        if (size > (SIZE_MAX - (*digit - '0')) / 10) {
+            return SIZE_MAX;
+        }
+
+        size = size * 10 + (*digit - '0');
+    }
+
+    return size;
+}
+
+static size_t parse_declared_size(buffer_t *in_buf)
+{
+    size_t length;
+    const char *value = parse_mail_size(in_buf, &length);
+
+    return NULL == value ? 0 : to_size(value, length);
+}
+
 transition_result_t handle_mail(context_t *context)
 {
     buffer_t *in_buf = &context->in_message;
@@ -99,10 +143,33 @@ transition_result_t handle_mail(context_t *context)
         return TRANSITION_FAILED;
     }
 
+    const size_t declared_size = parse_declared_size(in_buf);
+    const int max_size = context->settings->max_message_size;
+
+    if (max_size > 0 && declared_size > (size_t) max_size) {
+        if (buffer_shift_read_after(&context->in_message, CRLF, sizeof(CRLF) - 1) < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+                "552 Message size exceeds fixed maximum message size" CRLF) < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        log_write(context->log, "[%s] reject declared message size: %lu",
+            context->uuid, declared_size);
+
+        return TRANSITION_FAILED;
+    }
+
     if (transaction_begin(&context->transaction) < 0) {
         return TRANSITION_ERROR;
     }
 
+    if (transaction_set_declared_size(&context->transaction, declared_size) < 0) {
+        return TRANSITION_ERROR;
+    }
+
     if (transaction_set_reverse_path(&context->transaction, reverse_path,
             reverse_path_length) < 0) {
         CALL_ERR("transaction_set_reverse_path");
@@ -145,6 +212,30 @@ transition_result_t handle_rcpt(context_t *context)
         return TRANSITION_FAILED;
     }
 
+    const quota_status_t quota_status = transaction_check_quota(
+        &context->transaction, forward_path, forward_path_length);
+
+    if (QUOTA_WITHIN != quota_status) {
+        log_write(context->log, "[%s] reject recipient over quota: %.*s",
+            context->uuid, (int) forward_path_length, forward_path);
+
+        if (buffer_shift_read_after(&context->in_message, CRLF, sizeof(CRLF) - 1) < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        const int result = QUOTA_FULL == quota_status
+            ? BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+                "452 Mailbox quota exceeded" CRLF)
+            : BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+                "552 Message size exceeds mailbox quota" CRLF);
+
+        if (result < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        return TRANSITION_FAILED;
+    }
+
     if (transaction_add_forward_path(&context->transaction, forward_path,
             forward_path_length) < 0) {
         CALL_ERR("transaction_add_forward_path");
@@ -166,22 +257,27 @@ transition_result_t handle_rcpt(context_t *context)
     return TRANSITION_SUCCEED;
 }
 
+static transition_result_t wait_data_begin(context_t *context)
+{
+    switch (transaction_add_data_status(&context->transaction)) {
+        case TRANSACTION_DONE:
+            context->is_wait_transition = 0;
+            if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+                    "354 Start mail input; end with <CRLF>.<CRLF>" CRLF) < 0) {
+                return TRANSITION_ERROR;
+            }
+            return TRANSITION_SUCCEED;
+        case TRANSACTION_WAIT:
+            return TRANSITION_WAIT;
+        default:
+            return TRANSITION_ERROR;
+    }
+}
+
 transition_result_t handle_data_begin(context_t *context)
 {
     if (context->is_wait_transition) {
-        switch (transaction_add_data_status(&context->transaction)) {
-            case TRANSACTION_DONE:
-                context->is_wait_transition = 0;
-                if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
-                        "354 Start mail input; end with <CRLF>.<CRLF>" CRLF) < 0) {
-                    return TRANSITION_ERROR;
-                }
-                return TRANSITION_SUCCEED;
-            case TRANSACTION_WAIT:
-                return TRANSITION_WAIT;
-            default:
-                return TRANSITION_ERROR;
-        }
+        return wait_data_begin(context);
     }
 
     if (buffer_shift_read_after(&context->in_message, CRLF, sizeof(CRLF) - 1) < 0) {
@@ -198,7 +294,23 @@ transition_result_t handle_data_begin(context_t *context)
 
     context->is_wait_transition = 1;
 
-    return TRANSITION_WAIT;
+    return wait_data_begin(context);
+}
+
+static transition_result_t wait_data(context_t *context)
+{
+    switch (transaction_add_data_status(&context->transaction)) {
+        case TRANSACTION_DONE:
+            if (buffer_space(&context->in_message) == 0) {
+                buffer_drop_read(&context->in_message);
+            }
+            context->is_wait_transition = 0;
+            return TRANSITION_SUCCEED;
+        case TRANSACTION_WAIT:
+            return TRANSITION_WAIT;
+        default:
+            return TRANSITION_ERROR;
+    }
 }
 
 transition_result_t handle_data(context_t *context)
@@ -206,18 +318,7 @@ transition_result_t handle_data(context_t *context)
     buffer_t *in_buf = &context->in_message;
 
     if (context->is_wait_transition) {
-        switch (transaction_add_data_status(&context->transaction)) {
-            case TRANSACTION_DONE:
-                if (buffer_space(&context->in_message) == 0) {
-                    buffer_drop_read(&context->in_message);
-                }
-                context->is_wait_transition = 0;
-                return TRANSITION_SUCCEED;
-            case TRANSACTION_WAIT:
-                return TRANSITION_WAIT;
-            default:
-                return TRANSITION_ERROR;
-        }
+        return wait_data(context);
     }
 
     const char *begin = buffer_find(in_buf, CRLF, sizeof(CRLF) - 1);
@@ -228,20 +329,63 @@ transition_result_t handle_data(context_t *context)
 
     const char *data = buffer_read_begin(in_buf);
     const size_t data_size = begin - data + sizeof(CRLF) - 1;
+    const ssize_t added = transaction_add_data(&context->transaction, data, data_size);
 
-    if (transaction_add_data(&context->transaction, data, data_size) != data_size) {
+    if (added < 0) {
         return TRANSITION_ERROR;
     }
 
-    buffer_shift_read(in_buf, data_size);
+    buffer_shift_read(in_buf, added);
 
     context->is_wait_transition = 1;
 
-    return TRANSITION_WAIT;
+    return wait_data(context);
 }
 
-transition_result_t handle_data_end(context_t *context)
+static transition_result_t reject_oversized_data(context_t *context)
+{
+    transaction_rollback(&context->transaction);
+    context->is_wait_transition = 0;
+
+    if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+            "552 Message size exceeds fixed maximum message size" CRLF) < 0) {
+        return TRANSITION_ERROR;
+    }
+
+    log_write(context->log, "[%s] rollback transaction, message size exceeds: %d",
+        context->uuid, context->settings->max_message_size);
+
+    return TRANSITION_SUCCEED;
+}
+
+static transition_result_t reject_failed_delivery(context_t *context)
 {
+    if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+            "451 Requested action aborted: local error in processing" CRLF) < 0) {
+        return TRANSITION_ERROR;
+    }
+
+    log_write(context->log, "[%s] rollback transaction, delivered: %lu, failed: %lu",
+        context->uuid, transaction_delivered_count(&context->transaction),
+        transaction_failed_count(&context->transaction));
+
+    const recipient_t *recipient = NULL;
+
+    while (NULL != (recipient = transaction_next_failed_recipient(
+            &context->transaction, recipient))) {
+        log_write(context->log, "[%s] delivery failed, recipient: %s",
+            context->uuid, recipient->address);
+    }
+
+    return TRANSITION_SUCCEED;
+}
+
+static transition_result_t commit_data(context_t *context)
+{
+    if (transaction_is_oversized(&context->transaction)) {
+        return reject_oversized_data(context);
+    }
+
     switch (transaction_commit(&context->transaction)) {
         case TRANSACTION_DONE:
             break;
@@ -254,24 +398,138 @@ transition_result_t handle_data_end(context_t *context)
 
     context->is_wait_transition = 0;
 
-    if (buffer_shift_read_after(&context->in_message, CRLF, sizeof(CRLF) - 1) < 0) {
+    if (transaction_failed_count(&context->transaction) > 0) {
+        return reject_failed_delivery(context);
+    }
+
+    if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue, "250 Ok" CRLF) < 0) {
         return TRANSITION_ERROR;
     }
 
-    if (buffer_space(&context->in_message) == 0) {
-        buffer_drop_read(&context->in_message);
+    log_write(context->log, "[%s] commit transaction, file saved: %s, write path: %s, delivered: %lu, failed: %lu, links: %lu, reflinks: %lu, copies: %lu, deduplicated: %ld",
+        context->uuid, context->transaction.__data_filename,
+        transaction_write_path(&context->transaction),
+        transaction_delivered_count(&context->transaction),
+        transaction_failed_count(&context->transaction),
+        transaction_clone_count(&context->transaction, MAILDIR_CLONE_LINK),
+        transaction_clone_count(&context->transaction, MAILDIR_CLONE_REFLINK),
+        transaction_clone_count(&context->transaction, MAILDIR_CLONE_COPY),
+        (long) transaction_deduplicated_size(&context->transaction));
+
+    return TRANSITION_SUCCEED;
+}
+
+transition_result_t handle_data_end(context_t *context)
+{
+    if (!context->is_wait_transition) {
+        if (buffer_shift_read_after(&context->in_message, CRLF, sizeof(CRLF) - 1) < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        if (buffer_space(&context->in_message) == 0) {
+            buffer_drop_read(&context->in_message);
+        }
+    }
+
+    return commit_data(context);
+}
+
+static transition_result_t wait_chunk_data(context_t *context)
+{
+    switch (transaction_add_data_status(&context->transaction)) {
+        case TRANSACTION_DONE:
+            if (buffer_space(&context->in_message) == 0) {
+                buffer_drop_read(&context->in_message);
+            }
+            return TRANSITION_SUCCEED;
+        case TRANSACTION_WAIT:
+            return TRANSITION_WAIT;
+        default:
+            return TRANSITION_ERROR;
     }
+}
+
+static transition_result_t receive_chunk(context_t *context)
+{
+    buffer_t *in_buf = &context->in_message;
+    transition_result_t result;
+
+    while (TRANSITION_SUCCEED == (result = wait_chunk_data(context))
+            && context->chunk_left > 0) {
+        if (buffer_left(in_buf) == 0) {
+            return TRANSITION_WAIT;
+        }
+
+        const ssize_t added = transaction_add_data(&context->transaction,
+            buffer_read_begin(in_buf), MIN(buffer_left(in_buf), context->chunk_left));
+
+        if (added < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        buffer_shift_read(in_buf, added);
+        context->chunk_left -= added;
+    }
+
+    if (TRANSITION_SUCCEED != result) {
+        return result;
+    }
+
+    if (context->is_last_chunk) {
+        return commit_data(context);
+    }
+
+    context->is_wait_transition = 0;
 
     if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue, "250 Ok" CRLF) < 0) {
         return TRANSITION_ERROR;
     }
 
-    log_write(context->log, "[%s] commit transaction, file saved: %s",
-        context->uuid, context->transaction.__data_filename);
-
     return TRANSITION_SUCCEED;
 }
 
+transition_result_t handle_bdat(context_t *context)
+{
+    if (context->is_wait_transition) {
+        return receive_chunk(context);
+    }
+
+    buffer_t *in_buf = &context->in_message;
+    size_t size_length;
+    const char *size = parse_bdat(in_buf, &size_length);
+
+    if (buffer_shift_read_after(in_buf, CRLF, sizeof(CRLF) - 1) < 0) {
+        return TRANSITION_ERROR;
+    }
+
+    if (NULL == size) {
+        if (BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+                "501 Syntax error in parameters or arguments" CRLF) < 0) {
+            return TRANSITION_ERROR;
+        }
+
+        return TRANSITION_FAILED;
+    }
+
+    if (SMTP_SERVER_ST_WAIT_RCPT_OR_DATA == context->state
+            && transaction_add_header(&context->transaction) < 0) {
+        return TRANSITION_ERROR;
+    }
+
+    context->chunk_left = to_size(size, size_length);
+
+    if (context->settings->max_message_size > 0
+            && context->chunk_left > (size_t) context->settings->max_message_size) {
+        context->chunk_left = 0;
+        context->is_closing = 1;
+        return reject_oversized_data(context);
+    }
+
+    context->is_wait_transition = 1;
+
+    return receive_chunk(context);
+}
+
 transition_result_t handle_quit(context_t *context)
 {
     if (buffer_shift_read_after(&context->in_message, CRLF, sizeof(CRLF) - 1) < 0) {
@@ -13,6 +13,7 @@ transition_result_t handle_rcpt(context_t *context);
 transition_result_t handle_data_begin(context_t *context);
 transition_result_t handle_data(context_t *context);
 transition_result_t handle_data_end(context_t *context);
+transition_result_t handle_bdat(context_t *context);
 transition_result_t handle_quit(context_t *context);
 transition_result_t handle_invalid(context_t *context);
 
@@ -0,0 +1,181 @@
+#include "helper_pool.h"
+#include "log.h"
+
+static void *serve_jobs(void *arg)
+{
+    helper_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->__mutex);
+
+    while (1) {
+        while (!pool->__is_stopped && TAILQ_EMPTY(&pool->__jobs)) {
+            pthread_cond_wait(&pool->__job_added, &pool->__mutex);
+        }
+
+        if (pool->__is_stopped) {
+            break;
+        }
+
+        helper_job_t *job = TAILQ_FIRST(&pool->__jobs);
+        TAILQ_REMOVE(&pool->__jobs, job, __entry);
+
+        pthread_mutex_unlock(&pool->__mutex);
+
+        job->run(job);
+
+        const int signum = job->signum;
+        const union sigval value = job->value;
+
+        pthread_mutex_lock(&pool->__mutex);
+
+        job->__is_pending = 0;
+        pthread_cond_broadcast(&pool->__job_done);
+
+        if (signum > 0) {
+            pthread_mutex_unlock(&pool->__mutex);
+
+            if (sigqueue(getpid(), signum, value) < 0) {
+                CALL_ERR("sigqueue");
+            }
+
+            pthread_mutex_lock(&pool->__mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->__mutex);
+
+    return NULL;
+}
+
+static int create_threads(helper_pool_t *pool)
+{
+    sigset_t mask;
+    sigset_t old_mask;
+
+    sigfillset(&mask);
+
+    if (pthread_sigmask(SIG_BLOCK, &mask, &old_mask) != 0) {
+        PRINT_STDERR("%s", "error in pthread_sigmask");
+        return -1;
+    }
+
+    int result = 0;
+
+    while (pool->__threads_count < pool->__threads_count_max) {
+        pthread_t *thread = &pool->__threads[pool->__threads_count];
+
+        if (pthread_create(thread, NULL, serve_jobs, pool) != 0) {
+            PRINT_STDERR("%s", "error in pthread_create");
+            result = -1;
+            break;
+        }
+
+        ++pool->__threads_count;
+    }
+
+    if (pthread_sigmask(SIG_SETMASK, &old_mask, NULL) != 0) {
+        PRINT_STDERR("%s", "error in pthread_sigmask");
+        result = -1;
+    }
+
+    return result;
+}
+
+int helper_pool_init(helper_pool_t *pool, const size_t threads_count)
+{
+    pool->__threads = NULL;
+    pool->__threads_count = 0;
+    pool->__threads_count_max = threads_count;
+    pool->__is_stopped = 0;
+    TAILQ_INIT(&pool->__jobs);
+    pthread_mutex_init(&pool->__mutex, NULL);
+    pthread_cond_init(&pool->__job_added, NULL);
+    pthread_cond_init(&pool->__job_done, NULL);
+
+    if (0 == threads_count) {
+        return 0;
+    }
+
+    pool->__threads = malloc(threads_count * sizeof(pthread_t));
+
+    if (NULL == pool->__threads) {
+        CALL_ERR_ARGS("malloc", "%lu", threads_count * sizeof(pthread_t));
+        helper_pool_destroy(pool);
+        return -1;
+    }
+
+    if (create_threads(pool) < 0) {
+        helper_pool_destroy(pool);
+        return -1;
+    }
+
+    return 0;
+}
+
+void helper_pool_destroy(helper_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->__mutex);
+    pool->__is_stopped = 1;
+    pthread_cond_broadcast(&pool->__job_added);
+    pthread_mutex_unlock(&pool->__mutex);
+
+    for (size_t i = 0; i < pool->__threads_count; ++i) {
+        pthread_join(pool->__threads[i], NULL);
+    }
+
+    free(pool->__threads);
+    pool->__threads = NULL;
+    pool->__threads_count = 0;
+
+    pthread_cond_destroy(&pool->__job_done);
+    pthread_cond_destroy(&pool->__job_added);
+    pthread_mutex_destroy(&pool->__mutex);
+}
+
+int helper_pool_is_enabled(const helper_pool_t *pool)
+{
+    return pool->__threads_count > 0;
+}
+
+void helper_pool_submit(helper_pool_t *pool, helper_job_t *job)
+{
+    if (!helper_pool_is_enabled(pool)) {
+        job->__is_pending = 0;
+        job->run(job);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->__mutex);
+    job->__is_pending = 1;
+    TAILQ_INSERT_TAIL(&pool->__jobs, job, __entry);
+    pthread_cond_signal(&pool->__job_added);
+    pthread_mutex_unlock(&pool->__mutex);
+}
+
+int helper_pool_is_pending(helper_pool_t *pool, helper_job_t *job)
+{
+    if (!helper_pool_is_enabled(pool)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->__mutex);
+    const int is_pending = job->__is_pending;
+    pthread_mutex_unlock(&pool->__mutex);
+
+    return is_pending;
+}
+
+void helper_pool_wait(helper_pool_t *pool, helper_job_t *job)
+{
+    if (!helper_pool_is_enabled(pool)) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->__mutex);
+
+    while (job->__is_pending) {
+        pthread_cond_wait(&pool->__job_done, &pool->__mutex);
+    }
+
+    pthread_mutex_unlock(&pool->__mutex);
+}
@@ -0,0 +1,36 @@
+#ifndef SMTP_SERVER_HELPER_POOL_H
+#define SMTP_SERVER_HELPER_POOL_H
+
+#include <bsd/sys/queue.h>
+#include <pthread.h>
+#include <signal.h>
+
+typedef struct helper_job {
+    void (*run)(struct helper_job *job);
+    int signum;
+    union sigval value;
+    int __is_pending;
+    TAILQ_ENTRY(helper_job) __entry;
+} helper_job_t;
+
+typedef TAILQ_HEAD(helper_job_queue, helper_job) helper_job_queue_t;
+
+typedef struct helper_pool {
+    pthread_t *__threads;
+    size_t __threads_count;
+    size_t __threads_count_max;
+    pthread_mutex_t __mutex;
+    pthread_cond_t __job_added;
+    pthread_cond_t __job_done;
+    helper_job_queue_t __jobs;
+    int __is_stopped;
+} helper_pool_t;
+
+int helper_pool_init(helper_pool_t *pool, const size_t threads_count);
+void helper_pool_destroy(helper_pool_t *pool);
+int helper_pool_is_enabled(const helper_pool_t *pool);
+void helper_pool_submit(helper_pool_t *pool, helper_job_t *job);
+int helper_pool_is_pending(helper_pool_t *pool, helper_job_t *job);
+void helper_pool_wait(helper_pool_t *pool, helper_job_t *job);
+
+#endif
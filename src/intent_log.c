@@ -0,0 +1,313 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "intent_log.h"
+#include "log.h"
+
+#define FILE_MODE (S_IRUSR | S_IWUSR)
+#define DIR_MODE (S_IRWXU | S_IRWXG | S_IRWXO)
+#define RECOVER_PATH_SIZE (2 * PATH_SIZE + 8)
+
+static void close_fd(int *fd)
+{
+    if (*fd >= 0 && close(*fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    *fd = -1;
+}
+
+static int is_log_entry(const struct dirent *entry)
+{
+    return '.' != entry->d_name[0];
+}
+
+static int format_file_path(char *path, const intent_slot_t *slot,
+    const char *sub_dir)
+{
+    const int length = snprintf(path, RECOVER_PATH_SIZE, "%.*s/%s/%.*s",
+        (int) strnlen(slot->maildir, PATH_SIZE), slot->maildir, sub_dir,
+        (int) strnlen(slot->filename, PATH_SIZE), slot->filename);
+
+    if (length < 0 || length >= RECOVER_PATH_SIZE) {
+        PRINT_STDERR("path too long: %.*s", PATH_SIZE, slot->maildir);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void recover_slot(const intent_slot_t *slot)
+{
+    char tmp_path[RECOVER_PATH_SIZE];
+
+    if (format_file_path(tmp_path, slot, "tmp") < 0) {
+        return;
+    }
+
+    if (unlink(tmp_path) < 0 && ENOENT != errno) {
+        CALL_ERR_ARGS("unlink", "%s", tmp_path);
+    }
+}
+
+static void recover_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        if (ENOENT != errno) {
+            CALL_ERR_ARGS("open", "%s", path);
+        }
+        return;
+    }
+
+    struct stat stat_buf;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &stat_buf) < 0) {
+        close_fd(&fd);
+        return;
+    }
+
+    const size_t count = stat_buf.st_size / sizeof(intent_slot_t);
+    const intent_slot_t *slots = 0 == count ? NULL : mmap(NULL,
+        count * sizeof(intent_slot_t), PROT_READ, MAP_SHARED, fd, 0);
+
+    if (MAP_FAILED == slots) {
+        CALL_ERR_ARGS("mmap", "%s", path);
+        close_fd(&fd);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (INTENT_WRITING == slots[i].state
+                || INTENT_COMMITTING == slots[i].state) {
+            recover_slot(&slots[i]);
+        }
+    }
+
+    if (NULL != slots && munmap((void *) slots,
+            count * sizeof(intent_slot_t)) < 0) {
+        CALL_ERR("munmap");
+    }
+
+    if (unlink(path) < 0 && ENOENT != errno) {
+        CALL_ERR_ARGS("unlink", "%s", path);
+    }
+
+    close_fd(&fd);
+}
+
+static void recover(const char *dir)
+{
+    struct dirent **entries;
+    const int count = scandir(dir, &entries, is_log_entry, alphasort);
+
+    if (count < 0) {
+        CALL_ERR_ARGS("scandir", "%s", dir);
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        char path[PATH_SIZE];
+        const int length = snprintf(path, sizeof(path), "%s/%s", dir,
+            entries[i]->d_name);
+
+        if (length >= 0 && length < sizeof(path)) {
+            recover_file(path);
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+}
+
+static int create_file(intent_log_t *intent_log, const char *dir)
+{
+    struct timeval current_time;
+    char hidden_path[PATH_SIZE];
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    const int length = snprintf(intent_log->__path, sizeof(intent_log->__path),
+        "%s/%010ld-%d", dir, current_time.tv_sec, getpid());
+    const int hidden_length = snprintf(hidden_path, sizeof(hidden_path),
+        "%s/.%010ld-%d", dir, current_time.tv_sec, getpid());
+
+    if (length < 0 || length >= sizeof(intent_log->__path)
+            || hidden_length < 0 || hidden_length >= sizeof(hidden_path)) {
+        PRINT_STDERR("path too long: %s", dir);
+        return -1;
+    }
+
+    intent_log->__fd = open(hidden_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+        FILE_MODE);
+
+    if (intent_log->__fd < 0) {
+        CALL_ERR_ARGS("open", "%s", hidden_path);
+        return -1;
+    }
+
+    const size_t size = intent_log->__slots_count * sizeof(intent_slot_t);
+
+    if (flock(intent_log->__fd, LOCK_EX | LOCK_NB) < 0) {
+        CALL_ERR_ARGS("flock", "%s", hidden_path);
+        close_fd(&intent_log->__fd);
+        unlink(hidden_path);
+        return -1;
+    }
+
+    if (ftruncate(intent_log->__fd, size) < 0) {
+        CALL_ERR_ARGS("ftruncate", "%s, %lu", hidden_path, size);
+        close_fd(&intent_log->__fd);
+        unlink(hidden_path);
+        return -1;
+    }
+
+    intent_log->__slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        intent_log->__fd, 0);
+
+    if (MAP_FAILED == intent_log->__slots) {
+        CALL_ERR_ARGS("mmap", "%s", hidden_path);
+        intent_log->__slots = NULL;
+        close_fd(&intent_log->__fd);
+        unlink(hidden_path);
+        return -1;
+    }
+
+    if (rename(hidden_path, intent_log->__path) < 0) {
+        CALL_ERR_ARGS("rename", "%s, %s", hidden_path, intent_log->__path);
+        munmap(intent_log->__slots, size);
+        intent_log->__slots = NULL;
+        close_fd(&intent_log->__fd);
+        unlink(hidden_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int intent_log_init(intent_log_t *intent_log, const char *dir,
+    const size_t slots_count)
+{
+    intent_log->__fd = -1;
+    intent_log->__slots = NULL;
+    intent_log->__slots_count = slots_count;
+    intent_log->__next_slot = 0;
+
+    if (maildir_make_path(dir, DIR_MODE) < 0 && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", dir);
+        return -1;
+    }
+
+    recover(dir);
+
+    if (0 == slots_count) {
+        return 0;
+    }
+
+    if (create_file(intent_log, dir) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_init(&intent_log->__mutex, NULL);
+
+    return 0;
+}
+
+void intent_log_destroy(intent_log_t *intent_log)
+{
+    if (NULL == intent_log->__slots) {
+        return;
+    }
+
+    int is_clean = 1;
+
+    for (size_t i = 0; i < intent_log->__slots_count; ++i) {
+        is_clean = is_clean && INTENT_FREE == intent_log->__slots[i].state;
+    }
+
+    if (munmap(intent_log->__slots,
+            intent_log->__slots_count * sizeof(intent_slot_t)) < 0) {
+        CALL_ERR("munmap");
+    }
+
+    intent_log->__slots = NULL;
+
+    if (is_clean && unlink(intent_log->__path) < 0) {
+        CALL_ERR_ARGS("unlink", "%s", intent_log->__path);
+    }
+
+    close_fd(&intent_log->__fd);
+    pthread_mutex_destroy(&intent_log->__mutex);
+}
+
+static int find_free_slot(intent_log_t *intent_log)
+{
+    for (size_t i = 0; i < intent_log->__slots_count; ++i) {
+        const size_t slot = (intent_log->__next_slot + i)
+            % intent_log->__slots_count;
+
+        if (INTENT_FREE == intent_log->__slots[slot].state) {
+            intent_log->__next_slot = slot + 1;
+            return slot;
+        }
+    }
+
+    PRINT_STDERR("intent log is full: %s", intent_log->__path);
+
+    return -1;
+}
+
+int intent_log_add(intent_log_t *intent_log, int *slot, const char *maildir,
+    const char *filename)
+{
+    if (NULL == intent_log->__slots) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&intent_log->__mutex);
+
+    if (*slot < 0) {
+        *slot = find_free_slot(intent_log);
+    }
+
+    if (*slot >= 0) {
+        intent_slot_t *entry = &intent_log->__slots[*slot];
+
+        entry->state = INTENT_FREE;
+        snprintf(entry->maildir, sizeof(entry->maildir), "%s", maildir);
+        snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+        entry->state = INTENT_WRITING;
+    }
+
+    pthread_mutex_unlock(&intent_log->__mutex);
+
+    return *slot < 0 ? -1 : 0;
+}
+
+void intent_log_mark(intent_log_t *intent_log, const int slot,
+    const intent_state_t state)
+{
+    if (slot < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&intent_log->__mutex);
+    intent_log->__slots[slot].state = state;
+    pthread_mutex_unlock(&intent_log->__mutex);
+}
+
+void intent_log_clear(intent_log_t *intent_log, int *slot)
+{
+    intent_log_mark(intent_log, *slot, INTENT_FREE);
+    *slot = -1;
+}
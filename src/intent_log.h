@@ -0,0 +1,41 @@
+#ifndef SMTP_SERVER_INTENT_LOG_H
+#define SMTP_SERVER_INTENT_LOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "maildir.h"
+
+#define INTENT_LOG_NAME_SIZE 64
+
+typedef enum intent_state {
+    INTENT_FREE,
+    INTENT_WRITING,
+    INTENT_COMMITTING
+} intent_state_t;
+
+typedef struct intent_slot {
+    uint32_t state;
+    char maildir[PATH_SIZE];
+    char filename[PATH_SIZE];
+} intent_slot_t;
+
+typedef struct intent_log {
+    char __path[PATH_SIZE];
+    int __fd;
+    intent_slot_t *__slots;
+    size_t __slots_count;
+    size_t __next_slot;
+    pthread_mutex_t __mutex;
+} intent_log_t;
+
+int intent_log_init(intent_log_t *intent_log, const char *dir,
+    const size_t slots_count);
+void intent_log_destroy(intent_log_t *intent_log);
+int intent_log_add(intent_log_t *intent_log, int *slot, const char *maildir,
+    const char *filename);
+void intent_log_mark(intent_log_t *intent_log, const int slot,
+    const intent_state_t state);
+void intent_log_clear(intent_log_t *intent_log, int *slot);
+
+#endif
@@ -0,0 +1,821 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "journal.h"
+#include "log.h"
+
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define DIR_MODE (S_IRWXU | S_IRWXG | S_IRWXO)
+#define FILE_NAME_SIZE (SEGMENT_NAME_SIZE + sizeof(JOURNAL_DONE_SUFFIX))
+
+static void close_fd(int *fd)
+{
+    if (*fd >= 0 && close(*fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    *fd = -1;
+}
+
+static int join_path(char *path, const char *dir, const char *name)
+{
+    const int length = snprintf(path, PATH_SIZE, "%s/%s", dir, name);
+
+    if (length < 0 || length >= PATH_SIZE) {
+        PRINT_STDERR("path too long: %s/%s", dir, name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int segment_file_name(char *file_name, const char *name,
+    const char *suffix)
+{
+    if (snprintf(file_name, FILE_NAME_SIZE, "%s%s", name, suffix) < 0) {
+        CALL_ERR("snprintf");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int is_sub_entry(const struct dirent *entry)
+{
+    return '.' != entry->d_name[0];
+}
+
+static int is_index_name(const struct dirent *entry)
+{
+    const size_t length = strlen(entry->d_name);
+    const size_t suffix_length = strlen(SEGMENT_INDEX_SUFFIX);
+
+    return length > suffix_length && length - suffix_length < SEGMENT_NAME_SIZE
+        && strcmp(entry->d_name + length - suffix_length,
+            SEGMENT_INDEX_SUFFIX) == 0;
+}
+
+static int lock_dir(const char *path)
+{
+    char lock_path[PATH_SIZE];
+
+    if (join_path(lock_path, path, JOURNAL_LOCK_NAME) < 0) {
+        return -1;
+    }
+
+    const int fd = open(lock_path, O_RDONLY | O_CREAT | O_CLOEXEC, FILE_MODE);
+
+    if (fd < 0) {
+        CALL_ERR_ARGS("open", "%s", lock_path);
+        return -1;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (EWOULDBLOCK != errno) {
+            CALL_ERR_ARGS("flock", "%s", lock_path);
+        }
+
+        if (close(fd) < 0) {
+            CALL_ERR("close");
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+static void remove_dir(const char *path)
+{
+    char lock_path[PATH_SIZE];
+
+    if (join_path(lock_path, path, JOURNAL_LOCK_NAME) < 0) {
+        return;
+    }
+
+    if (unlink(lock_path) < 0) {
+        CALL_ERR_ARGS("unlink", "%s", lock_path);
+        return;
+    }
+
+    if (rmdir(path) < 0) {
+        CALL_ERR_ARGS("rmdir", "%s", path);
+    }
+}
+
+static int place_address(journal_t *journal, const char *address)
+{
+    const settings_t *settings = journal->__settings;
+    maildir_cache_t *cache = &journal->__cache;
+
+    if (1 == settings->maildir_roots_count) {
+        return 0;
+    }
+
+    const int root = maildir_cache_find_root(cache, address);
+
+    if (root >= 0) {
+        return root;
+    }
+
+    const char *delim = strchr(address, '@');
+    int existing;
+
+    switch (settings->maildir_placement) {
+        case MAILDIR_PLACEMENT_DOMAIN:
+            return maildir_cache_hash_root(cache, NULL == delim ? "" : delim + 1);
+        case MAILDIR_PLACEMENT_MAILBOX:
+            return maildir_cache_hash_root(cache, address);
+        case MAILDIR_PLACEMENT_LEAST_LOADED:
+        default:
+            existing = maildir_cache_existing_root(cache, address);
+            return existing >= 0 ? existing : maildir_cache_hash_root(cache, address);
+    }
+}
+
+static int copy_message(const int src_fd, const int dst_fd, off_t offset,
+    size_t size)
+{
+    int is_copy_range = 1;
+
+    while (size > 0) {
+        const ssize_t copied = is_copy_range
+            ? copy_file_range(src_fd, &offset, dst_fd, NULL, size, 0)
+            : sendfile(dst_fd, src_fd, &offset, size);
+
+        if (copied < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            if (is_copy_range && (EXDEV == errno || EINVAL == errno
+                    || EOPNOTSUPP == errno || ENOSYS == errno)) {
+                is_copy_range = 0;
+                continue;
+            }
+
+            CALL_ERR(is_copy_range ? "copy_file_range" : "sendfile");
+            return -1;
+        }
+
+        if (0 == copied) {
+            PRINT_STDERR("unexpected end of journal segment at %ld", offset);
+            return -1;
+        }
+
+        size -= copied;
+    }
+
+    return 0;
+}
+
+static int publish_file(const maildir_t *maildir, const int fd,
+    const char *id, const int is_tmpfile)
+{
+    if (!is_tmpfile) {
+        return maildir_move_to_new(maildir, id);
+    }
+
+    if (maildir_link_to_new(maildir, fd, id) == 0 || EEXIST == errno) {
+        return 0;
+    }
+
+    return -1;
+}
+
+static int write_file(journal_t *journal, const maildir_t *maildir,
+    const int segment_fd, const segment_entry_header_t *header, const char *id)
+{
+    int is_tmpfile;
+    int fd = maildir_create_file(maildir, id, &is_tmpfile);
+
+    if (fd < 0 && EEXIST == errno && maildir_remove_file(maildir, id) == 0) {
+        fd = maildir_create_file(maildir, id, &is_tmpfile);
+    }
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    int result = copy_message(segment_fd, fd, header->offset, header->length);
+
+    if (0 == result && DURABILITY_NONE != journal->__settings->durability
+            && fdatasync(fd) < 0) {
+        CALL_ERR_ARGS("fdatasync", "%s", id);
+        result = -1;
+    }
+
+    if (0 == result) {
+        result = publish_file(maildir, fd, id, is_tmpfile);
+    }
+
+    if (result < 0 && !is_tmpfile) {
+        maildir_remove_file(maildir, id);
+    }
+
+    close_fd(&fd);
+
+    return result;
+}
+
+static void release_maildirs(journal_t *journal, maildir_t **maildirs,
+    const size_t count, const int is_failed)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (NULL == maildirs[i]) {
+            continue;
+        }
+
+        if (is_failed && maildir_is_stale(maildirs[i])) {
+            maildir_cache_invalidate(&journal->__cache, maildirs[i]);
+        }
+
+        maildir_cache_release(&journal->__cache, maildirs[i]);
+    }
+
+    free(maildirs);
+}
+
+static int deliver_entry(journal_t *journal, const int segment_fd,
+    const segment_entry_header_t *header, const char *id,
+    const char *recipients)
+{
+    maildir_t **maildirs = calloc(header->recipients_count, sizeof(maildir_t *));
+
+    if (NULL == maildirs) {
+        CALL_ERR_ARGS("calloc", "%u", header->recipients_count);
+        return -1;
+    }
+
+    const char *address = recipients;
+    int result = 0;
+
+    for (size_t i = 0; 0 == result && i < header->recipients_count; ++i) {
+        maildir_clone_method_t method;
+
+        maildirs[i] = maildir_cache_get(&journal->__cache, address,
+            place_address(journal, address));
+
+        if (NULL == maildirs[i]) {
+            result = -1;
+        } else if (0 == i) {
+            result = write_file(journal, maildirs[i], segment_fd, header, id);
+        } else if (maildir_clone_file(maildirs[0], maildirs[i], id,
+                DURABILITY_NONE != journal->__settings->durability, &method) < 0
+                && EEXIST != errno) {
+            result = -1;
+        }
+
+        address += strlen(address) + 1;
+    }
+
+    for (size_t i = 0; 0 == result && i < header->recipients_count
+            && DURABILITY_NONE != journal->__settings->durability; ++i) {
+        result = maildir_sync_new(maildirs[i], 0);
+    }
+
+    release_maildirs(journal, maildirs, header->recipients_count, result < 0);
+
+    return result;
+}
+
+static off_t read_done(const int fd)
+{
+    off_t offset = 0;
+
+    if (fd >= 0 && pread(fd, &offset, sizeof(offset), 0) != sizeof(offset)) {
+        offset = 0;
+    }
+
+    return offset;
+}
+
+static int write_done(const int dir_fd, int *fd, const char *name,
+    const off_t offset)
+{
+    if (*fd < 0) {
+        char file_name[FILE_NAME_SIZE];
+
+        if (segment_file_name(file_name, name, JOURNAL_DONE_SUFFIX) < 0) {
+            return -1;
+        }
+
+        *fd = openat(dir_fd, file_name, O_RDWR | O_CREAT | O_CLOEXEC, FILE_MODE);
+
+        if (*fd < 0) {
+            CALL_ERR_ARGS("openat", "%s", file_name);
+            return -1;
+        }
+    }
+
+    if (pwrite(*fd, &offset, sizeof(offset), 0) != sizeof(offset)) {
+        CALL_ERR_ARGS("pwrite", "%s%s", name, JOURNAL_DONE_SUFFIX);
+        return -1;
+    }
+
+    return 0;
+}
+
+static char *read_index(const int fd, const off_t offset, const size_t size)
+{
+    char *index = malloc(size);
+
+    if (NULL == index) {
+        CALL_ERR_ARGS("malloc", "%lu", size);
+        return NULL;
+    }
+
+    size_t total = 0;
+
+    while (total < size) {
+        const ssize_t result = pread(fd, index + total, size - total,
+            offset + total);
+
+        if (result < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if (result <= 0) {
+            CALL_ERR_ARGS("pread", "%d, %lu, %ld", fd, size - total,
+                offset + total);
+            free(index);
+            return NULL;
+        }
+
+        total += result;
+    }
+
+    return index;
+}
+
+static size_t count_strings(const char *data, const size_t size)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        count += '\0' == data[i];
+    }
+
+    return count;
+}
+
+static size_t entry_size(const char *entry, const size_t left)
+{
+    segment_entry_header_t header;
+
+    if (left < sizeof(header)) {
+        return 0;
+    }
+
+    memcpy(&header, entry, sizeof(header));
+
+    const size_t size = sizeof(header) + header.id_size + header.recipients_size;
+
+    if (SEGMENT_ENTRY_MAGIC != header.magic || 0 == header.id_size
+            || 0 == header.recipients_count || 0 == header.recipients_size
+            || size > left || '\0' != entry[sizeof(header) + header.id_size - 1]
+            || '\0' != entry[size - 1] || header.recipients_count
+                != count_strings(entry + size - header.recipients_size,
+                    header.recipients_size)) {
+        return 0;
+    }
+
+    return size;
+}
+
+static int is_poisoned(journal_t *journal, const char *name,
+    const off_t offset)
+{
+    if (strcmp(journal->__failed_name, name) != 0
+            || journal->__failed_offset != offset) {
+        snprintf(journal->__failed_name, sizeof(journal->__failed_name), "%s",
+            name);
+        journal->__failed_offset = offset;
+        journal->__failed_attempts = 0;
+    }
+
+    return ++journal->__failed_attempts >= journal->__settings->journal_retry_count;
+}
+
+static int open_quarantine(journal_t *journal)
+{
+    if (journal->__is_quarantine_open) {
+        return 0;
+    }
+
+    if (join_path(journal->__quarantine_path, journal->__settings->journal_dir,
+            JOURNAL_QUARANTINE_NAME) < 0) {
+        return -1;
+    }
+
+    if (segment_store_init(&journal->__quarantine, journal->__quarantine_path,
+            journal->__settings->segment_max_size, 0) < 0) {
+        return -1;
+    }
+
+    journal->__is_quarantine_open = 1;
+
+    return 0;
+}
+
+static int quarantine_entry(journal_t *journal, const int segment_fd,
+    const segment_entry_header_t *header, const char *id)
+{
+    if (open_quarantine(journal) < 0) {
+        return -1;
+    }
+
+    char *data = read_index(segment_fd, header->offset, header->length);
+
+    if (NULL == data) {
+        return -1;
+    }
+
+    int result = segment_store_append(&journal->__quarantine, id,
+        id + header->id_size, header->recipients_count,
+        header->recipients_size, data, header->length);
+
+    if (0 == result) {
+        result = segment_store_sync(&journal->__quarantine, 0);
+    }
+
+    free(data);
+
+    if (0 == result) {
+        PRINT_STDERR("quarantine journal entry %s after %d attempts", id,
+            journal->__failed_attempts);
+    }
+
+    return result;
+}
+
+static int deliver_entries(journal_t *journal, const int dir_fd,
+    const char *name, const int segment_fd, const int index_fd, int *done_fd,
+    off_t limit)
+{
+    const off_t done = read_done(*done_fd);
+    struct stat stat;
+
+    if (limit < 0) {
+        if (fstat(index_fd, &stat) < 0) {
+            CALL_ERR_ARGS("fstat", "%s%s", name, SEGMENT_INDEX_SUFFIX);
+            return -1;
+        }
+
+        limit = stat.st_size;
+    }
+
+    if (done >= limit) {
+        return 1;
+    }
+
+    char *index = read_index(index_fd, done, limit - done);
+
+    if (NULL == index) {
+        return -1;
+    }
+
+    size_t position = 0;
+    size_t size;
+    int result = 1;
+
+    while (0 != (size = entry_size(index + position, limit - done - position))) {
+        segment_entry_header_t header;
+        const char *id = index + position + sizeof(header);
+
+        memcpy(&header, index + position, sizeof(header));
+
+        if (deliver_entry(journal, segment_fd, &header, id, id + header.id_size) < 0
+                && (!is_poisoned(journal, name, done + position)
+                    || quarantine_entry(journal, segment_fd, &header, id) < 0)) {
+            result = 0;
+            break;
+        }
+
+        position += size;
+
+        if (write_done(dir_fd, done_fd, name, done + position) < 0) {
+            result = 0;
+            break;
+        }
+    }
+
+    if (1 == result && done + position < limit) {
+        PRINT_STDERR("skip invalid journal entry %s%s:%ld", name,
+            SEGMENT_INDEX_SUFFIX, done + position);
+    }
+
+    free(index);
+
+    return result;
+}
+
+static int open_segment_file(const int dir_fd, const char *name,
+    const char *suffix, const int flags)
+{
+    char file_name[FILE_NAME_SIZE];
+
+    if (segment_file_name(file_name, name, suffix) < 0) {
+        return -1;
+    }
+
+    const int fd = openat(dir_fd, file_name, flags | O_CLOEXEC);
+
+    if (fd < 0 && ENOENT != errno) {
+        CALL_ERR_ARGS("openat", "%s", file_name);
+    }
+
+    return fd;
+}
+
+static void unlink_segment_file(const int dir_fd, const char *name,
+    const char *suffix)
+{
+    char file_name[FILE_NAME_SIZE];
+
+    if (segment_file_name(file_name, name, suffix) == 0
+            && unlinkat(dir_fd, file_name, 0) < 0 && ENOENT != errno) {
+        CALL_ERR_ARGS("unlinkat", "%s", file_name);
+    }
+}
+
+static int deliver_segment(journal_t *journal, const int dir_fd,
+    const char *name, const off_t limit)
+{
+    int index_fd = open_segment_file(dir_fd, name, SEGMENT_INDEX_SUFFIX,
+        O_RDONLY);
+
+    if (index_fd < 0) {
+        return ENOENT == errno ? 1 : -1;
+    }
+
+    int segment_fd = open_segment_file(dir_fd, name, SEGMENT_DATA_SUFFIX,
+        O_RDONLY);
+    int done_fd = open_segment_file(dir_fd, name, JOURNAL_DONE_SUFFIX, O_RDWR);
+    int result = -1;
+
+    if (segment_fd >= 0) {
+        result = deliver_entries(journal, dir_fd, name, segment_fd, index_fd,
+            &done_fd, limit);
+    }
+
+    close_fd(&done_fd);
+    close_fd(&segment_fd);
+    close_fd(&index_fd);
+
+    if (1 == result && limit < 0) {
+        unlink_segment_file(dir_fd, name, SEGMENT_DATA_SUFFIX);
+        unlink_segment_file(dir_fd, name, SEGMENT_INDEX_SUFFIX);
+        unlink_segment_file(dir_fd, name, JOURNAL_DONE_SUFFIX);
+    }
+
+    return result;
+}
+
+static int deliver_dir(journal_t *journal, const char *path,
+    segment_store_t *store)
+{
+    struct dirent **entries;
+    const int count = scandir(path, &entries, is_index_name, alphasort);
+
+    if (count < 0) {
+        CALL_ERR_ARGS("scandir", "%s", path);
+        return -1;
+    }
+
+    char tail_name[SEGMENT_NAME_SIZE] = "";
+    const off_t tail = NULL == store ? -1 : segment_store_tail(store, tail_name);
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int result = dir_fd < 0 ? -1 : 1;
+
+    if (dir_fd < 0) {
+        CALL_ERR_ARGS("open", "%s", path);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        char name[SEGMENT_NAME_SIZE];
+
+        snprintf(name, sizeof(name), "%.*s", (int) (strlen(entries[i]->d_name)
+            - strlen(SEGMENT_INDEX_SUFFIX)), entries[i]->d_name);
+
+        const int is_tail = tail >= 0 && strcmp(name, tail_name) == 0;
+
+        if (1 == result && deliver_segment(journal, dir_fd, name,
+                is_tail ? tail : -1) != 1) {
+            result = 0;
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+    close_fd(&dir_fd);
+
+    return result;
+}
+
+static int replay_dirs(journal_t *journal)
+{
+    const char *journal_dir = journal->__settings->journal_dir;
+    struct dirent **entries;
+    const int count = scandir(journal_dir, &entries, is_sub_entry, alphasort);
+    int result = 1;
+
+    if (count < 0) {
+        CALL_ERR_ARGS("scandir", "%s", journal_dir);
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        char path[PATH_SIZE];
+        struct stat stat_buf;
+        int lock_fd = -1;
+
+        if (join_path(path, journal_dir, entries[i]->d_name) == 0
+                && strcmp(path, journal->__path) != 0
+                && stat(path, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode)) {
+            lock_fd = lock_dir(path);
+        }
+
+        if (lock_fd >= 0) {
+            if (deliver_dir(journal, path, NULL) == 1) {
+                remove_dir(path);
+            } else {
+                result = 0;
+            }
+        }
+
+        close_fd(&lock_fd);
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    return result;
+}
+
+static void run_delivery(helper_job_t *job)
+{
+    journal_t *journal = (journal_t *) ((char *) job
+        - offsetof(journal_t, __delivery_job));
+
+    if (journal->__is_replay_pending) {
+        journal->__is_replay_pending = replay_dirs(journal) != 1;
+    }
+
+    deliver_dir(journal, journal->__path, &journal->__store);
+}
+
+static void submit_delivery(journal_t *journal)
+{
+    pthread_mutex_lock(&journal->__mutex);
+
+    if (!helper_pool_is_pending(&journal->__pool, &journal->__delivery_job)) {
+        helper_pool_submit(&journal->__pool, &journal->__delivery_job);
+    }
+
+    pthread_mutex_unlock(&journal->__mutex);
+}
+
+static int open_dir(journal_t *journal, const settings_t *settings)
+{
+    char name[SEGMENT_NAME_SIZE];
+    char hidden_path[PATH_SIZE];
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    if (snprintf(name, sizeof(name), "%010ld-%d", current_time.tv_sec,
+            getpid()) < 0) {
+        CALL_ERR("snprintf");
+        return -1;
+    }
+
+    if (join_path(journal->__path, settings->journal_dir, name) < 0) {
+        return -1;
+    }
+
+    const int length = snprintf(hidden_path, sizeof(hidden_path), "%s/.%s",
+        settings->journal_dir, name);
+
+    if (length < 0 || length >= sizeof(hidden_path)) {
+        PRINT_STDERR("path too long: %s/.%s", settings->journal_dir, name);
+        return -1;
+    }
+
+    if (maildir_make_path(hidden_path, DIR_MODE) < 0) {
+        CALL_ERR_ARGS("mkdir", "%s", hidden_path);
+        return -1;
+    }
+
+    journal->__lock_fd = lock_dir(hidden_path);
+
+    if (journal->__lock_fd < 0) {
+        return -1;
+    }
+
+    if (rename(hidden_path, journal->__path) < 0) {
+        CALL_ERR_ARGS("rename", "%s, %s", hidden_path, journal->__path);
+        close_fd(&journal->__lock_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int journal_init(journal_t *journal, const settings_t *settings)
+{
+    journal->__settings = settings;
+    journal->__lock_fd = -1;
+    journal->__delivery_job.run = run_delivery;
+    journal->__delivery_job.signum = 0;
+    journal->__delivery_job.__is_pending = 0;
+    journal->__is_quarantine_open = 0;
+    journal->__failed_name[0] = '\0';
+    journal->__failed_offset = 0;
+    journal->__failed_attempts = 0;
+    journal->__is_replay_pending = 1;
+
+    if (open_dir(journal, settings) < 0) {
+        return -1;
+    }
+
+    if (maildir_cache_init(&journal->__cache, settings->maildir_roots,
+            settings->maildir_roots_count, settings->maildir_shard_width,
+            settings->maildir_cache_size) < 0) {
+        close_fd(&journal->__lock_fd);
+        return -1;
+    }
+
+    if (segment_store_init(&journal->__store, journal->__path,
+            settings->segment_max_size, settings->segment_rotate_interval) < 0) {
+        maildir_cache_destroy(&journal->__cache);
+        close_fd(&journal->__lock_fd);
+        return -1;
+    }
+
+    if (helper_pool_init(&journal->__pool, 1) < 0) {
+        segment_store_destroy(&journal->__store);
+        maildir_cache_destroy(&journal->__cache);
+        close_fd(&journal->__lock_fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&journal->__mutex, NULL);
+
+    submit_delivery(journal);
+
+    return 0;
+}
+
+void journal_destroy(journal_t *journal)
+{
+    helper_pool_destroy(&journal->__pool);
+    pthread_mutex_destroy(&journal->__mutex);
+    segment_store_destroy(&journal->__store);
+
+    if (deliver_dir(journal, journal->__path, NULL) == 1) {
+        remove_dir(journal->__path);
+    }
+
+    if (journal->__is_quarantine_open) {
+        segment_store_destroy(&journal->__quarantine);
+    }
+
+    maildir_cache_destroy(&journal->__cache);
+    close_fd(&journal->__lock_fd);
+}
+
+int journal_append(journal_t *journal, const char *id, const char *recipients,
+    const size_t recipients_count, const size_t recipients_size,
+    const char *data, const size_t size)
+{
+    if (segment_store_append(&journal->__store, id, recipients,
+            recipients_count, recipients_size, data, size) < 0) {
+        return -1;
+    }
+
+    submit_delivery(journal);
+
+    return 0;
+}
+
+int journal_sync(journal_t *journal, const unsigned long generation)
+{
+    return segment_store_sync(&journal->__store, generation);
+}
+
+void journal_tick(journal_t *journal)
+{
+    segment_store_rotate_expired(&journal->__store);
+    submit_delivery(journal);
+}
@@ -0,0 +1,41 @@
+#ifndef SMTP_SERVER_JOURNAL_H
+#define SMTP_SERVER_JOURNAL_H
+
+#include <pthread.h>
+
+#include "helper_pool.h"
+#include "maildir_cache.h"
+#include "segment.h"
+#include "settings.h"
+
+#define JOURNAL_DONE_SUFFIX ".done"
+#define JOURNAL_LOCK_NAME "lock"
+#define JOURNAL_QUARANTINE_NAME ".quarantine"
+
+typedef struct journal {
+    const settings_t *__settings;
+    char __path[PATH_SIZE];
+    int __lock_fd;
+    segment_store_t __store;
+    char __quarantine_path[PATH_SIZE];
+    segment_store_t __quarantine;
+    int __is_quarantine_open;
+    char __failed_name[SEGMENT_NAME_SIZE];
+    off_t __failed_offset;
+    int __failed_attempts;
+    int __is_replay_pending;
+    maildir_cache_t __cache;
+    helper_pool_t __pool;
+    helper_job_t __delivery_job;
+    pthread_mutex_t __mutex;
+} journal_t;
+
+int journal_init(journal_t *journal, const settings_t *settings);
+void journal_destroy(journal_t *journal);
+int journal_append(journal_t *journal, const char *id, const char *recipients,
+    const size_t recipients_count, const size_t recipients_size,
+    const char *data, const size_t size);
+int journal_sync(journal_t *journal, const unsigned long generation);
+void journal_tick(journal_t *journal);
+
+#endif
@@ -109,7 +109,8 @@ int log_init(log_t *log, const char *file_name)
         return -1;
     }
 
-    if (snprintf(log->__queue_name, sizeof(log->__queue_name), "/smtp-server.log") < 0) {
+    if (snprintf(log->__queue_name, sizeof(log->__queue_name), "/smtp-server.%d.log",
+            getpid()) < 0) {
         CALL_ERR("snprintf");
         return -1;
     }
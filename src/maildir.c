@@ -1,10 +1,17 @@
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 
 #include "log.h"
 #include "maildir.h"
 
-static int make_path(const char *path, const __mode_t mode)
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+int maildir_make_path(const char *path, const __mode_t mode)
 {
     char tmp[PATH_SIZE];
 
@@ -37,41 +44,31 @@ static int make_path(const char *path, const __mode_t mode)
     return mkdir(tmp, mode);
 }
 
-int maildir_init(maildir_t *maildir, const char *path, const char *recipient)
+static int open_dir(const char *path, const char *sub_path)
 {
-    const size_t path_len = strlen(path);
-
-    if (path_len + strlen(recipient) + strlen("/Maildir") + 2 > sizeof(maildir->__path)) {
-        PRINT_STDERR("%s", "path too long");
-        return -1;
-    }
-
-    const char *recipient_delim = strchr(recipient, '@');
+    char full_path[PATH_SIZE];
 
-    if (NULL == recipient_delim) {
-        PRINT_STDERR("%s", "recipient delim not found");
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", path, sub_path) < 0) {
+        CALL_ERR("snprintf");
         return -1;
     }
 
-    const char *domain = recipient_delim + 1;
-
-    memset(maildir->__path, 0, sizeof(maildir->__path));
-    strncpy(maildir->__path, path, sizeof(maildir->__path));
-    snprintf(maildir->__path + path_len, sizeof(maildir->__path) - path_len, "/%s/", domain);
-    strncpy(maildir->__path + strlen(maildir->__path), recipient, recipient_delim - recipient);
-    strcat(maildir->__path, "/Maildir");
+    return open(full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
 
+static int make_dirs(const char *path)
+{
     static const char *sub_paths[] = {"tmp", "new", "cur"};
     static const size_t sub_paths_count = sizeof(sub_paths) / sizeof(*sub_paths);
 
     for (size_t i = 0; i < sub_paths_count; ++i) {
         char full_path[PATH_SIZE];
 
-        if (snprintf(full_path, sizeof(full_path), "%s/%s", maildir->__path, sub_paths[i]) < 0) {
+        if (snprintf(full_path, sizeof(full_path), "%s/%s", path, sub_paths[i]) < 0) {
             return -1;
         }
 
-        if (make_path(full_path, S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
+        if (maildir_make_path(full_path, S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
             if (EEXIST != errno) {
                 CALL_ERR_ARGS("mkdir", "%s", full_path);
                 return -1;
@@ -82,87 +79,459 @@ int maildir_init(maildir_t *maildir, const char *path, const char *recipient)
     return 0;
 }
 
-int maildir_create_file(const maildir_t *maildir, const char *filename)
+static int open_dirs(maildir_t *maildir)
+{
+    maildir->__tmp_fd = open_dir(maildir->__path, "tmp");
+
+    if (maildir->__tmp_fd < 0) {
+        CALL_ERR_ARGS("open", "%s/tmp", maildir->__path);
+        return -1;
+    }
+
+    maildir->__new_fd = open_dir(maildir->__path, "new");
+
+    if (maildir->__new_fd < 0) {
+        CALL_ERR_ARGS("open", "%s/new", maildir->__path);
+        if (close(maildir->__tmp_fd) < 0) {
+            CALL_ERR("close");
+        }
+        maildir->__tmp_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int maildir_is_valid_shard_width(const int width)
+{
+    return width >= 0 && width <= MAILDIR_MAX_SHARD_WIDTH;
+}
+
+static uint32_t hash_local(const char *local, const size_t length)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char) local[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+size_t maildir_format_shard(char *shard, const char *local, const size_t length,
+    const int width)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    if (0 == width) {
+        shard[0] = '\0';
+        return 0;
+    }
+
+    uint32_t hash = hash_local(local, length);
+    char *p = shard;
+
+    for (int level = 0; level < 2; ++level) {
+        for (int i = 0; i < width; ++i) {
+            *p++ = digits[hash >> 28];
+            hash <<= 4;
+        }
+
+        *p++ = '/';
+    }
+
+    *p = '\0';
+
+    return p - shard;
+}
+
+static int format_path(char *maildir_path, const char *path,
+    const char *recipient, const int shard_width)
+{
+    const char *recipient_delim = strchr(recipient, '@');
+
+    if (NULL == recipient_delim) {
+        PRINT_STDERR("%s", "recipient delim not found");
+        return -1;
+    }
+
+    const char *domain = recipient_delim + 1;
+    const size_t local_len = recipient_delim - recipient;
+    char shard[MAILDIR_SHARD_SIZE];
+
+    maildir_format_shard(shard, recipient, local_len, shard_width);
+
+    const int path_len = snprintf(maildir_path, PATH_SIZE,
+        "%s/%s/%s%.*s/Maildir", path, domain, shard, (int) local_len, recipient);
+
+    if (path_len < 0 || path_len >= PATH_SIZE) {
+        PRINT_STDERR("%s", "path too long");
+        return -1;
+    }
+
+    return 0;
+}
+
+int maildir_exists(const char *path, const char *recipient,
+    const int shard_width)
 {
-    char file_path[PATH_SIZE];
+    char maildir_path[PATH_SIZE];
+    struct stat stat_buf;
+
+    return format_path(maildir_path, path, recipient, shard_width) == 0
+        && stat(maildir_path, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode);
+}
+
+void maildir_features_init(maildir_features_t *features)
+{
+    features->is_tmpfile_supported = 1;
+    features->is_fallocate_supported = 1;
+}
+
+int maildir_init(maildir_t *maildir, const char *path, const char *recipient,
+    const int shard_width, maildir_features_t *features)
+{
+    maildir->__features = features;
+    maildir->__tmp_fd = -1;
+    maildir->__new_fd = -1;
+    maildir->__sync_generation = 0;
+
+    if (format_path(maildir->__path, path, recipient, shard_width) < 0) {
+        return -1;
+    }
+
+    const int tmp_fd = open_dir(maildir->__path, "tmp");
+    const int new_fd = tmp_fd < 0 ? -1 : open_dir(maildir->__path, "new");
+
+    if (tmp_fd >= 0 && new_fd >= 0) {
+        maildir->__tmp_fd = tmp_fd;
+        maildir->__new_fd = new_fd;
+        return 0;
+    }
 
-    if (snprintf(file_path, sizeof(file_path), "%s/tmp/%s", maildir->__path, filename) < 0) {
+    if (tmp_fd >= 0 && close(tmp_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    if (make_dirs(maildir->__path) < 0) {
+        return -1;
+    }
+
+    return open_dirs(maildir);
+}
+
+void maildir_destroy(maildir_t *maildir)
+{
+    if (maildir->__tmp_fd >= 0 && close(maildir->__tmp_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    if (maildir->__new_fd >= 0 && close(maildir->__new_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    maildir->__tmp_fd = -1;
+    maildir->__new_fd = -1;
+}
+
+static int is_same_dir(const int fd, const char *path, const char *sub_path)
+{
+    char full_path[PATH_SIZE];
+
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", path, sub_path) < 0) {
         CALL_ERR("snprintf");
+        return 0;
+    }
+
+    struct stat fd_stat;
+    struct stat path_stat;
+
+    if (fstat(fd, &fd_stat) < 0 || stat(full_path, &path_stat) < 0) {
+        return 0;
+    }
+
+    return fd_stat.st_dev == path_stat.st_dev
+        && fd_stat.st_ino == path_stat.st_ino;
+}
+
+const char *maildir_path(const maildir_t *maildir)
+{
+    return maildir->__path;
+}
+
+int maildir_is_stale(const maildir_t *maildir)
+{
+    return !is_same_dir(maildir->__tmp_fd, maildir->__path, "tmp")
+        || !is_same_dir(maildir->__new_fd, maildir->__path, "new");
+}
+
+int maildir_sync_new(maildir_t *maildir, const unsigned long generation)
+{
+    if (0 != generation && __atomic_load_n(&maildir->__sync_generation,
+            __ATOMIC_ACQUIRE) == generation) {
+        return 0;
+    }
+
+    if (fsync(maildir->__new_fd) < 0) {
+        CALL_ERR_ARGS("fsync", "%s/new", maildir->__path);
         return -1;
     }
 
-    const int fd = open(file_path, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (0 != generation) {
+        __atomic_store_n(&maildir->__sync_generation, generation,
+            __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+int maildir_is_tmpfile_supported(const maildir_t *maildir)
+{
+    return __atomic_load_n(&maildir->__features->is_tmpfile_supported,
+        __ATOMIC_RELAXED);
+}
+
+static int create_tmpfile(const maildir_t *maildir)
+{
+    const int fd = openat(maildir->__tmp_fd, ".", O_TMPFILE | O_WRONLY, FILE_MODE);
 
     if (fd < 0) {
-        CALL_ERR_ARGS("open", "%s", file_path);
+        if (EOPNOTSUPP == errno || EISDIR == errno || EINVAL == errno) {
+            __atomic_store_n(&maildir->__features->is_tmpfile_supported, 0,
+                __ATOMIC_RELAXED);
+            return -2;
+        }
+
+        CALL_ERR_ARGS("openat", "%s/tmp", maildir->__path);
         return -1;
     }
 
     return fd;
 }
 
-int maildir_remove_file(const maildir_t *maildir, const char *filename)
+int maildir_create_file(const maildir_t *maildir, const char *filename,
+    int *is_tmpfile)
 {
-    char tmp_file_path[PATH_SIZE];
+    if (maildir_is_tmpfile_supported(maildir)) {
+        const int fd = create_tmpfile(maildir);
+
+        if (fd != -2) {
+            *is_tmpfile = 1;
+            return fd;
+        }
+    }
 
-    if (snprintf(tmp_file_path, sizeof(tmp_file_path), "%s/tmp/%s", maildir->__path, filename) < 0) {
-        CALL_ERR_ARGS("open", "%s %s %s", "%s/tmp/%s", maildir->__path, filename);
+    *is_tmpfile = 0;
+
+    const int fd = openat(maildir->__tmp_fd, filename, O_CREAT | O_WRONLY | O_EXCL, FILE_MODE);
+
+    if (fd < 0) {
+        CALL_ERR_ARGS("openat", "%s/tmp/%s", maildir->__path, filename);
         return -1;
     }
 
-    if (remove(tmp_file_path) < 0) {
-        CALL_ERR_ARGS("remove", "%s", tmp_file_path);
+    return fd;
+}
+
+int maildir_preallocate_file(const maildir_t *maildir, const int fd,
+    const size_t size)
+{
+    int *is_supported = &maildir->__features->is_fallocate_supported;
+
+    if (!__atomic_load_n(is_supported, __ATOMIC_RELAXED) || 0 == size) {
+        return 0;
+    }
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0) {
+        if (EOPNOTSUPP == errno || ENOSYS == errno) {
+            __atomic_store_n(is_supported, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        CALL_ERR_ARGS("fallocate", "%lu", size);
         return -1;
     }
 
     return 0;
 }
 
-int maildir_move_to_new(const maildir_t *maildir, const char *filename)
+int maildir_drop_file_cache(const int fd)
 {
-    char tmp_file_path[PATH_SIZE];
+    const int error = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    if (error != 0) {
+        errno = error;
+        CALL_ERR("posix_fadvise");
+        return -1;
+    }
+
+    return 0;
+}
 
-    if (snprintf(tmp_file_path, sizeof(tmp_file_path), "%s/tmp/%s", maildir->__path, filename) < 0) {
-        CALL_ERR_ARGS("open", "%s %s %s", "%s/tmp/%s", maildir->__path, filename);
+int maildir_remove_file(const maildir_t *maildir, const char *filename)
+{
+    if (unlinkat(maildir->__tmp_fd, filename, 0) < 0) {
+        CALL_ERR_ARGS("unlinkat", "%s/tmp/%s", maildir->__path, filename);
         return -1;
     }
 
-    char new_file_path[PATH_SIZE];
+    return 0;
+}
 
-    if (snprintf(new_file_path, sizeof(new_file_path), "%s/new/%s", maildir->__path, filename) < 0) {
-        CALL_ERR_ARGS("open", "%s %s %s", "%s/new/%s", maildir->__path, filename);
+int maildir_remove_new_file(const maildir_t *maildir, const char *filename)
+{
+    if (unlinkat(maildir->__new_fd, filename, 0) < 0) {
+        CALL_ERR_ARGS("unlinkat", "%s/new/%s", maildir->__path, filename);
         return -1;
     }
 
-    if (rename(tmp_file_path, new_file_path) < 0) {
-        CALL_ERR_ARGS("rename", "%s %s", tmp_file_path, new_file_path);
+    return 0;
+}
+
+int maildir_move_to_new(const maildir_t *maildir, const char *filename)
+{
+    if (renameat(maildir->__tmp_fd, filename, maildir->__new_fd, filename) < 0) {
+        CALL_ERR_ARGS("renameat", "%s/tmp/%s %s/new/%s", maildir->__path,
+            filename, maildir->__path, filename);
         return -1;
     }
 
     return 0;
 }
 
-int maildir_clone_file(const maildir_t *src, const maildir_t *dst,
+int maildir_link_to_new(const maildir_t *maildir, const int fd,
     const char *filename)
 {
-    char src_file_path[PATH_SIZE];
+    char fd_path[PATH_SIZE];
 
-    if (snprintf(src_file_path, sizeof(src_file_path), "%s/new/%s", src->__path, filename) < 0) {
-        CALL_ERR_ARGS("open", "%s %s %s", "%s/new/%s", src->__path, filename);
+    if (snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd) < 0) {
+        CALL_ERR("snprintf");
         return -1;
     }
 
-    char dst_file_path[PATH_SIZE];
-
-    if (snprintf(dst_file_path, sizeof(dst_file_path), "%s/new/%s", dst->__path, filename) < 0) {
-        CALL_ERR_ARGS("open", "%s %s %s", "%s/new/%s", dst->__path, filename);
+    if (linkat(AT_FDCWD, fd_path, maildir->__new_fd, filename, AT_SYMLINK_FOLLOW) < 0) {
+        CALL_ERR_ARGS("linkat", "%s %s/new/%s", fd_path, maildir->__path, filename);
         return -1;
     }
 
-    if (link(src_file_path, dst_file_path) < 0) {
-        CALL_ERR_ARGS("link", "%s %s", src_file_path, dst_file_path);
+    return 0;
+}
+
+static int copy_data(const int src_fd, const int dst_fd,
+    maildir_clone_method_t *method)
+{
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        *method = MAILDIR_CLONE_REFLINK;
+        return 0;
+    }
+
+    struct stat src_stat;
+
+    if (fstat(src_fd, &src_stat) < 0) {
+        CALL_ERR("fstat");
         return -1;
     }
 
+    *method = MAILDIR_CLONE_COPY;
+
+    off_t left = src_stat.st_size;
+    int is_copy_range = 1;
+
+    while (left > 0) {
+        const ssize_t copied = is_copy_range
+            ? copy_file_range(src_fd, NULL, dst_fd, NULL, left, 0)
+            : sendfile(dst_fd, src_fd, NULL, left);
+
+        if (copied < 0) {
+            if (is_copy_range && (EXDEV == errno || EINVAL == errno
+                    || EOPNOTSUPP == errno || ENOSYS == errno)) {
+                is_copy_range = 0;
+                continue;
+            }
+
+            CALL_ERR(is_copy_range ? "copy_file_range" : "sendfile");
+            return -1;
+        }
+
+        if (0 == copied) {
+            if (is_copy_range) {
+                is_copy_range = 0;
+                continue;
+            }
+
+            PRINT_STDERR("copied %ld of %ld bytes", src_stat.st_size - left,
+                src_stat.st_size);
+            return -1;
+        }
+
+        left -= copied;
+    }
+
     return 0;
 }
+
+static int copy_file(const maildir_t *src, const maildir_t *dst,
+    const char *filename, const int is_durable, maildir_clone_method_t *method)
+{
+    const int src_fd = openat(src->__new_fd, filename, O_RDONLY | O_CLOEXEC);
+
+    if (src_fd < 0) {
+        CALL_ERR_ARGS("openat", "%s/new/%s", src->__path, filename);
+        return -1;
+    }
+
+    int is_tmpfile;
+    const int dst_fd = maildir_create_file(dst, filename, &is_tmpfile);
+
+    if (dst_fd < 0) {
+        if (close(src_fd) < 0) {
+            CALL_ERR("close");
+        }
+        return -1;
+    }
+
+    int result = copy_data(src_fd, dst_fd, method);
+
+    if (0 == result && is_durable && fdatasync(dst_fd) < 0) {
+        CALL_ERR_ARGS("fdatasync", "%s/tmp/%s", dst->__path, filename);
+        result = -1;
+    }
+
+    if (0 == result) {
+        result = is_tmpfile
+            ? maildir_link_to_new(dst, dst_fd, filename)
+            : maildir_move_to_new(dst, filename);
+    }
+
+    if (result < 0 && !is_tmpfile) {
+        maildir_remove_file(dst, filename);
+    }
+
+    if (close(dst_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    if (close(src_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    return result;
+}
+
+int maildir_clone_file(const maildir_t *src, const maildir_t *dst,
+    const char *filename, const int is_durable, maildir_clone_method_t *method)
+{
+    if (linkat(src->__new_fd, filename, dst->__new_fd, filename, 0) == 0) {
+        *method = MAILDIR_CLONE_LINK;
+        return 0;
+    }
+
+    if (EXDEV == errno) {
+        return copy_file(src, dst, filename, is_durable, method);
+    }
+
+    CALL_ERR_ARGS("linkat", "%s/new/%s %s/new/%s", src->__path, filename,
+        dst->__path, filename);
+    return -1;
+}
@@ -1,17 +1,56 @@
 #ifndef SMTP_SERVER_MAILDIR_H
 #define SMTP_SERVER_MAILDIR_H
 
+#include <sys/types.h>
+
 #define PATH_SIZE 256
+#define MAILDIR_MAX_SHARD_WIDTH 4
+#define MAILDIR_SHARD_SIZE (2 * MAILDIR_MAX_SHARD_WIDTH + 3)
+
+typedef enum maildir_clone_method {
+    MAILDIR_CLONE_LINK,
+    MAILDIR_CLONE_REFLINK,
+    MAILDIR_CLONE_COPY
+} maildir_clone_method_t;
+
+typedef struct maildir_features {
+    int is_tmpfile_supported;
+    int is_fallocate_supported;
+} maildir_features_t;
 
 typedef struct maildir {
     char __path[PATH_SIZE];
+    maildir_features_t *__features;
+    int __tmp_fd;
+    int __new_fd;
+    unsigned long __sync_generation;
 } maildir_t;
 
-int maildir_init(maildir_t *maildir, const char *path, const char *recipient);
-int maildir_create_file(const maildir_t *maildir, const char *filename);
+int maildir_make_path(const char *path, const __mode_t mode);
+int maildir_is_valid_shard_width(const int width);
+size_t maildir_format_shard(char *shard, const char *local, const size_t length,
+    const int width);
+int maildir_exists(const char *path, const char *recipient,
+    const int shard_width);
+void maildir_features_init(maildir_features_t *features);
+int maildir_init(maildir_t *maildir, const char *path, const char *recipient,
+    const int shard_width, maildir_features_t *features);
+void maildir_destroy(maildir_t *maildir);
+const char *maildir_path(const maildir_t *maildir);
+int maildir_is_stale(const maildir_t *maildir);
+int maildir_is_tmpfile_supported(const maildir_t *maildir);
+int maildir_sync_new(maildir_t *maildir, const unsigned long generation);
+int maildir_create_file(const maildir_t *maildir, const char *filename,
+    int *is_tmpfile);
+int maildir_preallocate_file(const maildir_t *maildir, const int fd,
+    const size_t size);
+int maildir_drop_file_cache(const int fd);
 int maildir_remove_file(const maildir_t *maildir, const char *filename);
+int maildir_remove_new_file(const maildir_t *maildir, const char *filename);
 int maildir_move_to_new(const maildir_t *maildir, const char *filename);
-int maildir_clone_file(const maildir_t *src, const maildir_t *dst,
+int maildir_link_to_new(const maildir_t *maildir, const int fd,
     const char *filename);
+int maildir_clone_file(const maildir_t *src, const maildir_t *dst,
+    const char *filename, const int is_durable, maildir_clone_method_t *method);
 
 #endif
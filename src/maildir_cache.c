@@ -0,0 +1,351 @@
+#include <math.h>
+
+#include "log.h"
+#include "maildir_cache.h"
+
+#define PLACEMENT_UNKNOWN 0
+#define PLACEMENT_MISSING -1
+
+static int maildir_cache_entry_cmp(maildir_cache_entry_t *first,
+    maildir_cache_entry_t *second)
+{
+    return strcmp(first->__recipient, second->__recipient);
+}
+
+RB_GENERATE_STATIC(maildir_cache_tree, maildir_cache_entry, __tree_entry,
+    maildir_cache_entry_cmp)
+
+static uint64_t hash_key(const char *key)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (const char *p = key; '\0' != *p; ++p) {
+        hash ^= (unsigned char) *p;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static maildir_cache_placement_t *find_placement(const maildir_cache_t *cache,
+    const uint64_t hash)
+{
+    if (NULL == cache->__placements) {
+        return NULL;
+    }
+
+    return &cache->__placements[hash % cache->__capacity];
+}
+
+static void remember_root(maildir_cache_t *cache, const char *recipient,
+    const int root)
+{
+    const uint64_t hash = hash_key(recipient);
+    maildir_cache_placement_t *placement = find_placement(cache, hash);
+
+    if (NULL != placement) {
+        placement->hash = hash;
+        placement->root = root < 0 ? PLACEMENT_MISSING : root + 1;
+    }
+}
+
+static int recall_root(maildir_cache_t *cache, const char *recipient)
+{
+    const uint64_t hash = hash_key(recipient);
+
+    pthread_mutex_lock(&cache->__mutex);
+
+    const maildir_cache_placement_t *placement = find_placement(cache, hash);
+    const int root = NULL == placement || hash != placement->hash
+        || 0 == placement->root ? PLACEMENT_UNKNOWN : placement->root;
+
+    pthread_mutex_unlock(&cache->__mutex);
+
+    return root;
+}
+
+static void destroy_entry(maildir_cache_entry_t *entry)
+{
+    maildir_destroy(&entry->maildir);
+    free(entry->__recipient);
+    free(entry);
+}
+
+static void uncache_entry(maildir_cache_t *cache, maildir_cache_entry_t *entry)
+{
+    RB_REMOVE(maildir_cache_tree, &cache->__tree, entry);
+    TAILQ_REMOVE(&cache->__lru, entry, __lru_entry);
+    entry->__is_cached = 0;
+    --cache->__size;
+}
+
+static void evict_entries(maildir_cache_t *cache)
+{
+    maildir_cache_entry_t *entry = TAILQ_LAST(&cache->__lru, maildir_cache_lru);
+
+    while (cache->__size > cache->__capacity && NULL != entry) {
+        maildir_cache_entry_t *prev = TAILQ_PREV(entry, maildir_cache_lru,
+            __lru_entry);
+
+        if (0 == entry->__references) {
+            uncache_entry(cache, entry);
+            destroy_entry(entry);
+        }
+
+        entry = prev;
+    }
+}
+
+static maildir_cache_entry_t *create_entry(const maildir_cache_t *cache,
+    const char *recipient, const int root)
+{
+    maildir_cache_entry_t *entry = malloc(sizeof(maildir_cache_entry_t));
+
+    if (NULL == entry) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(maildir_cache_entry_t));
+        return NULL;
+    }
+
+    entry->__recipient = strdup(recipient);
+
+    if (NULL == entry->__recipient) {
+        CALL_ERR("strdup");
+        free(entry);
+        return NULL;
+    }
+
+    if (maildir_init(&entry->maildir, cache->__roots[root].path, recipient,
+            cache->__shard_width, &cache->__features[root]) < 0) {
+        free(entry->__recipient);
+        free(entry);
+        return NULL;
+    }
+
+    entry->__root = root;
+    entry->__references = 0;
+    entry->__is_cached = 0;
+
+    return entry;
+}
+
+static maildir_cache_entry_t *insert_entry(maildir_cache_t *cache,
+    maildir_cache_entry_t *entry)
+{
+    maildir_cache_entry_t *existing = RB_INSERT(maildir_cache_tree,
+        &cache->__tree, entry);
+
+    if (NULL != existing) {
+        destroy_entry(entry);
+        return existing;
+    }
+
+    entry->__is_cached = 1;
+    TAILQ_INSERT_HEAD(&cache->__lru, entry, __lru_entry);
+    ++cache->__size;
+    remember_root(cache, entry->__recipient, entry->__root);
+
+    return entry;
+}
+
+int maildir_cache_init(maildir_cache_t *cache, const maildir_root_t *roots,
+    const size_t roots_count, const int shard_width, const size_t capacity)
+{
+    if (!maildir_is_valid_shard_width(shard_width)) {
+        PRINT_STDERR("invalid maildir shard width: %d", shard_width);
+        return -1;
+    }
+
+    cache->__roots = roots;
+    cache->__roots_count = roots_count;
+    cache->__shard_width = shard_width;
+    cache->__capacity = capacity;
+    cache->__size = 0;
+    cache->__placements = NULL;
+    RB_INIT(&cache->__tree);
+    TAILQ_INIT(&cache->__lru);
+
+    cache->__features = calloc(roots_count, sizeof(maildir_features_t));
+
+    if (NULL == cache->__features) {
+        CALL_ERR_ARGS("calloc", "%lu", roots_count);
+        return -1;
+    }
+
+    for (size_t i = 0; i < roots_count; ++i) {
+        maildir_features_init(&cache->__features[i]);
+    }
+
+    if (capacity > 0 && roots_count > 1) {
+        cache->__placements = calloc(capacity, sizeof(maildir_cache_placement_t));
+
+        if (NULL == cache->__placements) {
+            CALL_ERR_ARGS("calloc", "%lu", capacity);
+            free(cache->__features);
+            return -1;
+        }
+    }
+
+    if (pthread_mutex_init(&cache->__mutex, NULL) != 0) {
+        PRINT_STDERR("%s", "error in pthread_mutex_init");
+        free(cache->__placements);
+        free(cache->__features);
+        return -1;
+    }
+
+    return 0;
+}
+
+void maildir_cache_destroy(maildir_cache_t *cache)
+{
+    maildir_cache_entry_t *entry, *temp;
+
+    TAILQ_FOREACH_SAFE(entry, &cache->__lru, __lru_entry, temp) {
+        uncache_entry(cache, entry);
+        destroy_entry(entry);
+    }
+
+    free(cache->__placements);
+    free(cache->__features);
+    pthread_mutex_destroy(&cache->__mutex);
+}
+
+static uint64_t mix_root(uint64_t hash, const size_t root)
+{
+    hash ^= (root + 1) * 0x9e3779b97f4a7c15ull;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+
+    return hash ^ (hash >> 31);
+}
+
+int maildir_cache_hash_root(const maildir_cache_t *cache, const char *key)
+{
+    const uint64_t hash = hash_key(key);
+    double best_score = 0;
+    int best_root = 0;
+
+    for (size_t i = 0; i < cache->__roots_count; ++i) {
+        const double unit = ((mix_root(hash, i) >> 11) + 0.5) / 9007199254740992.0;
+        const double score = -cache->__roots[i].weight / log(unit);
+
+        if (score > best_score) {
+            best_score = score;
+            best_root = i;
+        }
+    }
+
+    return best_root;
+}
+
+int maildir_cache_remembered_root(maildir_cache_t *cache, const char *recipient)
+{
+    const int root = recall_root(cache, recipient);
+
+    return root > 0 ? root - 1 : -1;
+}
+
+int maildir_cache_existing_root(maildir_cache_t *cache, const char *recipient)
+{
+    const int remembered = recall_root(cache, recipient);
+
+    if (PLACEMENT_UNKNOWN != remembered) {
+        return remembered > 0 ? remembered - 1 : -1;
+    }
+
+    int root = -1;
+
+    for (size_t i = 0; i < cache->__roots_count && root < 0; ++i) {
+        if (maildir_exists(cache->__roots[i].path, recipient,
+                cache->__shard_width)) {
+            root = i;
+        }
+    }
+
+    pthread_mutex_lock(&cache->__mutex);
+    remember_root(cache, recipient, root);
+    pthread_mutex_unlock(&cache->__mutex);
+
+    return root;
+}
+
+int maildir_cache_find_root(maildir_cache_t *cache, const char *recipient)
+{
+    maildir_cache_entry_t key = {.__recipient = (char *) recipient};
+
+    pthread_mutex_lock(&cache->__mutex);
+
+    const maildir_cache_entry_t *entry = RB_FIND(maildir_cache_tree,
+        &cache->__tree, &key);
+    const int root = NULL == entry ? -1 : entry->__root;
+
+    pthread_mutex_unlock(&cache->__mutex);
+
+    return root;
+}
+
+maildir_t *maildir_cache_get(maildir_cache_t *cache, const char *recipient,
+    const int root)
+{
+    maildir_cache_entry_t key = {.__recipient = (char *) recipient};
+
+    pthread_mutex_lock(&cache->__mutex);
+
+    maildir_cache_entry_t *entry = RB_FIND(maildir_cache_tree, &cache->__tree, &key);
+
+    if (NULL == entry) {
+        pthread_mutex_unlock(&cache->__mutex);
+
+        maildir_cache_entry_t *created = create_entry(cache, recipient, root);
+
+        if (NULL == created) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&cache->__mutex);
+
+        entry = insert_entry(cache, created);
+    } else {
+        TAILQ_REMOVE(&cache->__lru, entry, __lru_entry);
+        TAILQ_INSERT_HEAD(&cache->__lru, entry, __lru_entry);
+    }
+
+    ++entry->__references;
+
+    evict_entries(cache);
+
+    pthread_mutex_unlock(&cache->__mutex);
+
+    return &entry->maildir;
+}
+
+void maildir_cache_release(maildir_cache_t *cache, maildir_t *maildir)
+{
+    maildir_cache_entry_t *entry = (maildir_cache_entry_t *) maildir;
+
+    pthread_mutex_lock(&cache->__mutex);
+
+    --entry->__references;
+
+    if (!entry->__is_cached) {
+        if (0 == entry->__references) {
+            destroy_entry(entry);
+        }
+    } else {
+        evict_entries(cache);
+    }
+
+    pthread_mutex_unlock(&cache->__mutex);
+}
+
+void maildir_cache_invalidate(maildir_cache_t *cache, maildir_t *maildir)
+{
+    maildir_cache_entry_t *entry = (maildir_cache_entry_t *) maildir;
+
+    pthread_mutex_lock(&cache->__mutex);
+
+    if (entry->__is_cached) {
+        uncache_entry(cache, entry);
+    }
+
+    pthread_mutex_unlock(&cache->__mutex);
+}
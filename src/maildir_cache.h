@@ -0,0 +1,55 @@
+#ifndef SMTP_SERVER_MAILDIR_CACHE_H
+#define SMTP_SERVER_MAILDIR_CACHE_H
+
+#include <bsd/sys/queue.h>
+#include <bsd/sys/tree.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "maildir.h"
+#include "settings.h"
+
+typedef struct maildir_cache_entry {
+    maildir_t maildir;
+    char *__recipient;
+    int __root;
+    size_t __references;
+    int __is_cached;
+    RB_ENTRY(maildir_cache_entry) __tree_entry;
+    TAILQ_ENTRY(maildir_cache_entry) __lru_entry;
+} maildir_cache_entry_t;
+
+typedef struct maildir_cache_placement {
+    uint64_t hash;
+    int root;
+} maildir_cache_placement_t;
+
+typedef RB_HEAD(maildir_cache_tree, maildir_cache_entry) maildir_cache_tree_t;
+typedef TAILQ_HEAD(maildir_cache_lru, maildir_cache_entry) maildir_cache_lru_t;
+
+typedef struct maildir_cache {
+    const maildir_root_t *__roots;
+    maildir_features_t *__features;
+    size_t __roots_count;
+    int __shard_width;
+    size_t __capacity;
+    size_t __size;
+    maildir_cache_tree_t __tree;
+    maildir_cache_lru_t __lru;
+    maildir_cache_placement_t *__placements;
+    pthread_mutex_t __mutex;
+} maildir_cache_t;
+
+int maildir_cache_init(maildir_cache_t *cache, const maildir_root_t *roots,
+    const size_t roots_count, const int shard_width, const size_t capacity);
+void maildir_cache_destroy(maildir_cache_t *cache);
+int maildir_cache_hash_root(const maildir_cache_t *cache, const char *key);
+int maildir_cache_remembered_root(maildir_cache_t *cache, const char *recipient);
+int maildir_cache_existing_root(maildir_cache_t *cache, const char *recipient);
+int maildir_cache_find_root(maildir_cache_t *cache, const char *recipient);
+maildir_t *maildir_cache_get(maildir_cache_t *cache, const char *recipient,
+    const int root);
+void maildir_cache_release(maildir_cache_t *cache, maildir_t *maildir);
+void maildir_cache_invalidate(maildir_cache_t *cache, maildir_t *maildir);
+
+#endif
@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zstd.h>
+
+#include "log.h"
+
+typedef struct reader {
+    ZSTD_DCtx *context;
+    char *input;
+    size_t input_size;
+    char *output;
+    size_t output_size;
+} reader_t;
+
+static int write_all(const char *data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t written = write(STDOUT_FILENO, data, size);
+
+        if (written < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            CALL_ERR("write");
+            return -1;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+static int is_compressed(const char *data, const size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+
+    return size >= 4 && ZSTD_MAGICNUMBER == (bytes[0] | bytes[1] << 8
+        | bytes[2] << 16 | (uint32_t) bytes[3] << 24);
+}
+
+static int decompress(reader_t *reader, const size_t size, size_t *left)
+{
+    ZSTD_inBuffer input = {reader->input, size, 0};
+
+    while (input.pos < input.size) {
+        ZSTD_outBuffer output = {reader->output, reader->output_size, 0};
+
+        *left = ZSTD_decompressStream(reader->context, &output, &input);
+
+        if (ZSTD_isError(*left)) {
+            PRINT_STDERR("error in ZSTD_decompressStream: %s",
+                ZSTD_getErrorName(*left));
+            return -1;
+        }
+
+        if (write_all(reader->output, output.pos) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int cat_fd(reader_t *reader, const int fd, const char *path)
+{
+    int is_first = 1;
+    int is_zstd = 0;
+    size_t left = 0;
+    ssize_t size;
+
+    ZSTD_DCtx_reset(reader->context, ZSTD_reset_session_only);
+
+    while ((size = read(fd, reader->input, reader->input_size)) != 0) {
+        if (size < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            CALL_ERR_ARGS("read", "%s", path);
+            return -1;
+        }
+
+        if (is_first) {
+            is_zstd = is_compressed(reader->input, size);
+            is_first = 0;
+        }
+
+        const int result = is_zstd
+            ? decompress(reader, size, &left)
+            : write_all(reader->input, size);
+
+        if (result < 0) {
+            return -1;
+        }
+    }
+
+    if (is_zstd && left > 0) {
+        PRINT_STDERR("truncated compressed file: %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cat_file(reader_t *reader, const char *path)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        CALL_ERR_ARGS("open", "%s", path);
+        return -1;
+    }
+
+    const int result = cat_fd(reader, fd, path);
+
+    if (close(fd) < 0) {
+        CALL_ERR_ARGS("close", "%s", path);
+    }
+
+    return result;
+}
+
+static int init_reader(reader_t *reader)
+{
+    reader->input_size = ZSTD_DStreamInSize();
+    reader->output_size = ZSTD_DStreamOutSize();
+    reader->input = malloc(reader->input_size);
+    reader->output = malloc(reader->output_size);
+    reader->context = ZSTD_createDCtx();
+
+    if (NULL == reader->input || NULL == reader->output
+            || NULL == reader->context) {
+        PRINT_STDERR("%s", "cannot allocate decompression context");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_reader(reader_t *reader)
+{
+    ZSTD_freeDCtx(reader->context);
+    free(reader->input);
+    free(reader->output);
+}
+
+int main(int argc, char *argv[])
+{
+    reader_t reader;
+    int result = 0;
+
+    if (init_reader(&reader) < 0) {
+        destroy_reader(&reader);
+        return 1;
+    }
+
+    if (argc < 2) {
+        result = cat_fd(&reader, STDIN_FILENO, "-");
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        if (cat_file(&reader, argv[i]) < 0) {
+            result = -1;
+        }
+    }
+
+    destroy_reader(&reader);
+
+    return result < 0 ? 1 : 0;
+}
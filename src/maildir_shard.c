@@ -0,0 +1,285 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "maildir.h"
+
+#define MAX_SHARD_DEPTH 2
+
+typedef struct shard_stats {
+    size_t kept;
+    size_t moved;
+    size_t merged;
+    size_t failed;
+} shard_stats_t;
+
+static const char *sub_dirs[] = {"tmp", "new", "cur"};
+static const size_t sub_dirs_count = sizeof(sub_dirs) / sizeof(*sub_dirs);
+
+static int is_sub_entry(const struct dirent *entry)
+{
+    return '.' != entry->d_name[0];
+}
+
+static int is_dir(const char *path)
+{
+    struct stat stat_buf;
+
+    return stat(path, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode);
+}
+
+static int join_path(char *path, const char *dir, const char *name)
+{
+    const int length = snprintf(path, PATH_SIZE, "%s/%s", dir, name);
+
+    if (length < 0 || length >= PATH_SIZE) {
+        PRINT_STDERR("path too long: %s/%s", dir, name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int is_mailbox(const char *path)
+{
+    char maildir_path[PATH_SIZE];
+
+    return join_path(maildir_path, path, "Maildir") == 0 && is_dir(maildir_path);
+}
+
+static int make_parent(const char *path)
+{
+    char parent[PATH_SIZE];
+
+    snprintf(parent, sizeof(parent), "%s", path);
+    *strrchr(parent, '/') = '\0';
+
+    if (maildir_make_path(parent, S_IRWXU | S_IRWXG | S_IRWXO) < 0
+            && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", parent);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int merge_sub_dir(const char *src, const char *dst)
+{
+    DIR *dir = opendir(src);
+
+    if (NULL == dir) {
+        return ENOENT == errno ? 0 : -1;
+    }
+
+    if (maildir_make_path(dst, S_IRWXU | S_IRWXG | S_IRWXO) < 0
+            && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", dst);
+        closedir(dir);
+        return -1;
+    }
+
+    const int dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int result = dst_fd < 0 ? -1 : 0;
+    struct dirent *entry;
+
+    while (0 == result && NULL != (entry = readdir(dir))) {
+        if (!is_sub_entry(entry)) {
+            continue;
+        }
+
+        if (renameat(dirfd(dir), entry->d_name, dst_fd, entry->d_name) < 0) {
+            CALL_ERR_ARGS("renameat", "%s/%s", src, entry->d_name);
+            result = -1;
+        }
+    }
+
+    if (dst_fd >= 0 && close(dst_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    if (closedir(dir) < 0) {
+        CALL_ERR("closedir");
+    }
+
+    if (0 == result && rmdir(src) < 0) {
+        CALL_ERR_ARGS("rmdir", "%s", src);
+        result = -1;
+    }
+
+    return result;
+}
+
+static int merge_mailbox(const char *src, const char *dst)
+{
+    char src_maildir[PATH_SIZE];
+    char dst_maildir[PATH_SIZE];
+
+    if (join_path(src_maildir, src, "Maildir") < 0
+            || join_path(dst_maildir, dst, "Maildir") < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < sub_dirs_count; ++i) {
+        char src_sub[PATH_SIZE];
+        char dst_sub[PATH_SIZE];
+
+        if (join_path(src_sub, src_maildir, sub_dirs[i]) < 0
+                || join_path(dst_sub, dst_maildir, sub_dirs[i]) < 0
+                || merge_sub_dir(src_sub, dst_sub) < 0) {
+            return -1;
+        }
+    }
+
+    if (rmdir(src_maildir) < 0 || rmdir(src) < 0) {
+        CALL_ERR_ARGS("rmdir", "%s", src);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void move_mailbox(const char *src, const char *dst, shard_stats_t *stats)
+{
+    if (make_parent(dst) < 0) {
+        ++stats->failed;
+        return;
+    }
+
+    if (rename(src, dst) == 0) {
+        ++stats->moved;
+        return;
+    }
+
+    if (ENOTEMPTY != errno && EEXIST != errno) {
+        CALL_ERR_ARGS("rename", "%s, %s", src, dst);
+        ++stats->failed;
+        return;
+    }
+
+    if (merge_mailbox(src, dst) < 0) {
+        ++stats->failed;
+        return;
+    }
+
+    ++stats->merged;
+}
+
+static void shard_mailbox(const char *domain_path, const char *path,
+    const char *local, const int width, shard_stats_t *stats)
+{
+    char shard[MAILDIR_SHARD_SIZE];
+    char target[PATH_SIZE];
+
+    maildir_format_shard(shard, local, strlen(local), width);
+
+    const int length = snprintf(target, sizeof(target), "%s/%s%s",
+        domain_path, shard, local);
+
+    if (length < 0 || length >= sizeof(target)) {
+        PRINT_STDERR("path too long: %s/%s%s", domain_path, shard, local);
+        ++stats->failed;
+        return;
+    }
+
+    if (strcmp(path, target) == 0) {
+        ++stats->kept;
+        return;
+    }
+
+    move_mailbox(path, target, stats);
+}
+
+static int shard_dir(const char *domain_path, const char *path,
+    const int depth, const int width, shard_stats_t *stats)
+{
+    struct dirent **entries;
+    const int count = scandir(path, &entries, is_sub_entry, alphasort);
+
+    if (count < 0) {
+        CALL_ERR_ARGS("scandir", "%s", path);
+        return -1;
+    }
+
+    int result = 0;
+
+    for (int i = 0; i < count; ++i) {
+        char entry_path[PATH_SIZE];
+
+        if (0 == result && join_path(entry_path, path, entries[i]->d_name) < 0) {
+            result = -1;
+        }
+
+        if (0 == result && is_mailbox(entry_path)) {
+            shard_mailbox(domain_path, entry_path, entries[i]->d_name, width,
+                stats);
+        } else if (0 == result && depth < MAX_SHARD_DEPTH && is_dir(entry_path)) {
+            result = shard_dir(domain_path, entry_path, depth + 1, width, stats);
+
+            if (0 == result) {
+                rmdir(entry_path);
+            }
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    return result;
+}
+
+static int shard(const char *path, const int width, shard_stats_t *stats)
+{
+    struct dirent **entries;
+    const int count = scandir(path, &entries, is_sub_entry, alphasort);
+
+    if (count < 0) {
+        CALL_ERR_ARGS("scandir", "%s", path);
+        return -1;
+    }
+
+    int result = 0;
+
+    for (int i = 0; i < count; ++i) {
+        char domain_path[PATH_SIZE];
+
+        if (0 == result && join_path(domain_path, path, entries[i]->d_name) < 0) {
+            result = -1;
+        }
+
+        if (0 == result && is_dir(domain_path)) {
+            result = shard_dir(domain_path, domain_path, 0, width, stats);
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        PRINT_STDERR("Usage: %s <maildir> <shard width>\n", argv[0]);
+        return 1;
+    }
+
+    const int width = atoi(argv[2]);
+
+    if (!maildir_is_valid_shard_width(width)) {
+        PRINT_STDERR("invalid shard width: %s", argv[2]);
+        return 1;
+    }
+
+    shard_stats_t stats = {0, 0, 0, 0};
+    const int result = shard(argv[1], width, &stats);
+
+    printf("kept: %lu, moved: %lu, merged: %lu, failed: %lu\n",
+        stats.kept, stats.moved, stats.merged, stats.failed);
+
+    return result < 0 || stats.failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,431 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "maildir.h"
+#include "notifier.h"
+
+#define DIR_MODE (S_IRWXU | S_IRWXG | S_IRWXO)
+#define LOST_EVENT_SIZE 32
+
+static int is_socket_entry(const struct dirent *entry)
+{
+    const size_t length = strlen(entry->d_name);
+    const size_t suffix_length = strlen(NOTIFIER_SOCKET_SUFFIX);
+
+    return '.' != entry->d_name[0] && length > suffix_length
+        && strcmp(entry->d_name + length - suffix_length,
+            NOTIFIER_SOCKET_SUFFIX) == 0;
+}
+
+static int format_address(struct sockaddr_un *address, const char *dir,
+    const char *name)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    const int length = snprintf(address->sun_path, sizeof(address->sun_path),
+        "%s/%s", dir, name);
+
+    if (length < 0 || length >= sizeof(address->sun_path)) {
+        PRINT_STDERR("path too long: %s/%s", dir, name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void remove_stale_socket(const char *dir, const char *name)
+{
+    struct sockaddr_un address;
+
+    if (format_address(&address, dir, name) < 0) {
+        return;
+    }
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock < 0) {
+        CALL_ERR("socket");
+        return;
+    }
+
+    if (connect(sock, (struct sockaddr *) &address, sizeof(address)) < 0
+            && ECONNREFUSED == errno && unlink(address.sun_path) < 0
+            && ENOENT != errno) {
+        CALL_ERR_ARGS("unlink", "%s", address.sun_path);
+    }
+
+    if (close(sock) < 0) {
+        CALL_ERR("close");
+    }
+}
+
+static void remove_stale_sockets(const char *dir)
+{
+    struct dirent **entries;
+    const int count = scandir(dir, &entries, is_socket_entry, alphasort);
+
+    if (count < 0) {
+        CALL_ERR_ARGS("scandir", "%s", dir);
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        remove_stale_socket(dir, entries[i]->d_name);
+        free(entries[i]);
+    }
+
+    free(entries);
+}
+
+static int listen_socket(notifier_t *notifier, const char *dir)
+{
+    char name[PATH_SIZE];
+    struct sockaddr_un address;
+
+    snprintf(name, sizeof(name), ".%d%s", getpid(), NOTIFIER_SOCKET_SUFFIX);
+
+    if (format_address(&address, dir, name) < 0) {
+        return -1;
+    }
+
+    const int length = snprintf(notifier->__path, sizeof(notifier->__path),
+        "%s/%s", dir, name + 1);
+
+    if (length < 0 || length >= sizeof(notifier->__path)) {
+        PRINT_STDERR("path too long: %s/%s", dir, name + 1);
+        return -1;
+    }
+
+    unlink(address.sun_path);
+
+    notifier->__listen_fd = socket(AF_UNIX,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (notifier->__listen_fd < 0) {
+        CALL_ERR("socket");
+        return -1;
+    }
+
+    if (bind(notifier->__listen_fd, (struct sockaddr *) &address,
+            sizeof(address)) < 0) {
+        CALL_ERR_ARGS("bind", "%s", address.sun_path);
+        return -1;
+    }
+
+    if (listen(notifier->__listen_fd, SOMAXCONN) < 0) {
+        CALL_ERR_ARGS("listen", "%s", address.sun_path);
+        unlink(address.sun_path);
+        return -1;
+    }
+
+    if (rename(address.sun_path, notifier->__path) < 0) {
+        CALL_ERR_ARGS("rename", "%s, %s", address.sun_path, notifier->__path);
+        unlink(address.sun_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void remove_subscriber(notifier_t *notifier, subscriber_t *subscriber)
+{
+    TAILQ_REMOVE(&notifier->__subscribers, subscriber, __entry);
+    --notifier->__subscribers_count;
+
+    if (close(subscriber->sock) < 0) {
+        CALL_ERR("close");
+    }
+
+    buffer_destroy(&subscriber->queue);
+    free(subscriber);
+}
+
+static int reserve_polled(notifier_t *notifier)
+{
+    const size_t size = notifier->__subscribers_count + 1;
+
+    if (size <= notifier->__polled_size) {
+        return 0;
+    }
+
+    subscriber_t **polled = realloc(notifier->__polled,
+        2 * size * sizeof(subscriber_t *));
+
+    if (NULL == polled) {
+        CALL_ERR_ARGS("realloc", "%lu", 2 * size * sizeof(subscriber_t *));
+        return -1;
+    }
+
+    notifier->__polled = polled;
+    notifier->__polled_size = 2 * size;
+
+    return 0;
+}
+
+static void add_subscriber(notifier_t *notifier)
+{
+    const int sock = accept4(notifier->__listen_fd, NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (sock < 0) {
+        if (EAGAIN != errno && EWOULDBLOCK != errno) {
+            CALL_ERR("accept4");
+        }
+        return;
+    }
+
+    if (reserve_polled(notifier) < 0) {
+        close(sock);
+        return;
+    }
+
+    subscriber_t *subscriber = malloc(sizeof(subscriber_t));
+
+    if (NULL == subscriber) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(subscriber_t));
+        close(sock);
+        return;
+    }
+
+    if (buffer_init(&subscriber->queue, notifier->__queue_size) < 0) {
+        free(subscriber);
+        close(sock);
+        return;
+    }
+
+    subscriber->sock = sock;
+    subscriber->lost_count = 0;
+    subscriber->is_closed = 0;
+    TAILQ_INSERT_TAIL(&notifier->__subscribers, subscriber, __entry);
+    ++notifier->__subscribers_count;
+}
+
+static int flush_subscriber(subscriber_t *subscriber)
+{
+    buffer_t *queue = &subscriber->queue;
+
+    while (buffer_left(queue) > 0) {
+        const ssize_t sent = send(subscriber->sock, buffer_read_begin(queue),
+            buffer_left(queue), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+        }
+
+        buffer_shift_read(queue, sent);
+    }
+
+    buffer_reset(queue);
+
+    return 0;
+}
+
+static int is_subscriber_closed(subscriber_t *subscriber)
+{
+    char data[PATH_SIZE];
+
+    while (1) {
+        const ssize_t size = recv(subscriber->sock, data, sizeof(data),
+            MSG_DONTWAIT);
+
+        if (0 == size) {
+            return 1;
+        }
+
+        if (size < 0) {
+            return EAGAIN != errno && EWOULDBLOCK != errno;
+        }
+    }
+}
+
+static int reserve(subscriber_t *subscriber, const size_t size)
+{
+    buffer_t *queue = &subscriber->queue;
+
+    if (buffer_space(queue) < size) {
+        buffer_drop_read(queue);
+    }
+
+    return buffer_space(queue) < size ? -1 : 0;
+}
+
+static void enqueue_event(subscriber_t *subscriber, const char *event,
+    const size_t size)
+{
+    char lost_event[LOST_EVENT_SIZE];
+    const int lost_size = 0 == subscriber->lost_count ? 0 : snprintf(lost_event,
+        sizeof(lost_event), "L\t%lu\n", subscriber->lost_count);
+
+    if (reserve(subscriber, lost_size + size) < 0) {
+        ++subscriber->lost_count;
+        return;
+    }
+
+    buffer_write(&subscriber->queue, lost_event, lost_size);
+    buffer_write(&subscriber->queue, event, size);
+    subscriber->lost_count = 0;
+}
+
+static int flush_lost(subscriber_t *subscriber)
+{
+    if (flush_subscriber(subscriber) < 0) {
+        return -1;
+    }
+
+    if (0 == subscriber->lost_count || buffer_left(&subscriber->queue) > 0) {
+        return 0;
+    }
+
+    char lost_event[LOST_EVENT_SIZE];
+    const int lost_size = snprintf(lost_event, sizeof(lost_event), "L\t%lu\n",
+        subscriber->lost_count);
+
+    buffer_write(&subscriber->queue, lost_event, lost_size);
+    subscriber->lost_count = 0;
+
+    return flush_subscriber(subscriber);
+}
+
+int notifier_init(notifier_t *notifier, const char *dir,
+    const size_t queue_size)
+{
+    notifier->__listen_fd = -1;
+    notifier->__queue_size = queue_size;
+    notifier->__subscribers_count = 0;
+    notifier->__polled = NULL;
+    notifier->__polled_size = 0;
+    TAILQ_INIT(&notifier->__subscribers);
+
+    if (queue_size < NOTIFIER_EVENT_SIZE + LOST_EVENT_SIZE) {
+        PRINT_STDERR("notify queue size is less than %d: %lu",
+            NOTIFIER_EVENT_SIZE + LOST_EVENT_SIZE, queue_size);
+        return -1;
+    }
+
+    if (maildir_make_path(dir, DIR_MODE) < 0 && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", dir);
+        return -1;
+    }
+
+    remove_stale_sockets(dir);
+
+    if (listen_socket(notifier, dir) < 0) {
+        if (notifier->__listen_fd >= 0 && close(notifier->__listen_fd) < 0) {
+            CALL_ERR("close");
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+void notifier_destroy(notifier_t *notifier)
+{
+    while (!TAILQ_EMPTY(&notifier->__subscribers)) {
+        remove_subscriber(notifier, TAILQ_FIRST(&notifier->__subscribers));
+    }
+
+    free(notifier->__polled);
+    notifier->__polled = NULL;
+    notifier->__polled_size = 0;
+
+    if (unlink(notifier->__path) < 0) {
+        CALL_ERR_ARGS("unlink", "%s", notifier->__path);
+    }
+
+    if (close(notifier->__listen_fd) < 0) {
+        CALL_ERR("close");
+    }
+}
+
+void notifier_remove_closed(notifier_t *notifier)
+{
+    subscriber_t *subscriber, *temp;
+
+    TAILQ_FOREACH_SAFE(subscriber, &notifier->__subscribers, __entry, temp) {
+        if (subscriber->is_closed) {
+            remove_subscriber(notifier, subscriber);
+        }
+    }
+}
+
+size_t notifier_pollfds_count(const notifier_t *notifier)
+{
+    return 1 + notifier->__subscribers_count;
+}
+
+size_t notifier_fill_pollfds(notifier_t *notifier, struct pollfd *pollfds)
+{
+    subscriber_t *subscriber;
+    size_t index = 0;
+
+    pollfds[index].fd = notifier->__listen_fd;
+    pollfds[index].events = POLLIN;
+    pollfds[index].revents = 0;
+    ++index;
+
+    TAILQ_FOREACH(subscriber, &notifier->__subscribers, __entry) {
+        notifier->__polled[index - 1] = subscriber;
+        pollfds[index].fd = subscriber->sock;
+        pollfds[index].events = POLLIN | POLLERR | POLLHUP
+            | (buffer_left(&subscriber->queue) > 0 ? POLLOUT : 0);
+        pollfds[index].revents = 0;
+        ++index;
+    }
+
+    return index;
+}
+
+void notifier_serve(notifier_t *notifier, const struct pollfd *pollfd,
+    const size_t index)
+{
+    if (0 == index) {
+        add_subscriber(notifier);
+        return;
+    }
+
+    subscriber_t *subscriber = notifier->__polled[index - 1];
+
+    if (subscriber->is_closed) {
+        return;
+    }
+
+    if ((pollfd->revents & (POLLERR | POLLHUP)) != 0
+            || ((pollfd->revents & POLLIN) != 0
+                && is_subscriber_closed(subscriber))
+            || ((pollfd->revents & POLLOUT) != 0
+                && flush_lost(subscriber) < 0)) {
+        subscriber->is_closed = 1;
+    }
+}
+
+void notifier_publish(notifier_t *notifier, const char *mailbox,
+    const char *filename, const uint64_t size)
+{
+    char event[NOTIFIER_EVENT_SIZE];
+    const int length = snprintf(event, sizeof(event), "D\t%lu\t%s\t%s\n",
+        size, mailbox, filename);
+
+    if (length < 0 || length >= sizeof(event)) {
+        PRINT_STDERR("event too long: %s/%s", mailbox, filename);
+        return;
+    }
+
+    subscriber_t *subscriber;
+
+    TAILQ_FOREACH(subscriber, &notifier->__subscribers, __entry) {
+        if (subscriber->is_closed) {
+            continue;
+        }
+
+        enqueue_event(subscriber, event, length);
+
+        if (flush_subscriber(subscriber) < 0) {
+            subscriber->is_closed = 1;
+        }
+    }
+}
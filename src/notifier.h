@@ -0,0 +1,45 @@
+#ifndef SMTP_SERVER_NOTIFIER_H
+#define SMTP_SERVER_NOTIFIER_H
+
+#include <bsd/sys/queue.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "log.h"
+
+#define NOTIFIER_SOCKET_SUFFIX ".sock"
+#define NOTIFIER_EVENT_SIZE (3 * PATH_SIZE)
+
+typedef struct subscriber {
+    int sock;
+    buffer_t queue;
+    size_t lost_count;
+    int is_closed;
+    TAILQ_ENTRY(subscriber) __entry;
+} subscriber_t;
+
+typedef TAILQ_HEAD(subscriber_list, subscriber) subscriber_list_t;
+
+typedef struct notifier {
+    char __path[PATH_SIZE];
+    int __listen_fd;
+    size_t __queue_size;
+    subscriber_list_t __subscribers;
+    size_t __subscribers_count;
+    subscriber_t **__polled;
+    size_t __polled_size;
+} notifier_t;
+
+int notifier_init(notifier_t *notifier, const char *dir,
+    const size_t queue_size);
+void notifier_destroy(notifier_t *notifier);
+void notifier_remove_closed(notifier_t *notifier);
+size_t notifier_pollfds_count(const notifier_t *notifier);
+size_t notifier_fill_pollfds(notifier_t *notifier, struct pollfd *pollfds);
+void notifier_serve(notifier_t *notifier, const struct pollfd *pollfd,
+    const size_t index);
+void notifier_publish(notifier_t *notifier, const char *mailbox,
+    const char *filename, const uint64_t size);
+
+#endif
@@ -49,7 +49,22 @@ const char *parse_mail(buffer_t *in_buf, size_t *length)
     return parse_first_group(RE_MAIL, in_buf, length);
 }
 
+const char *parse_mail_size(buffer_t *in_buf, size_t *length)
+{
+    return parse_first_group(RE_MAIL_SIZE, in_buf, length);
+}
+
 const char *parse_rcpt(buffer_t *in_buf, size_t *length)
 {
     return parse_first_group(RE_RCPT, in_buf, length);
 }
+
+const char *parse_bdat(buffer_t *in_buf, size_t *length)
+{
+    return parse_first_group(RE_BDAT, in_buf, length);
+}
+
+const char *parse_bdat_last(buffer_t *in_buf, size_t *length)
+{
+    return parse_first_group(RE_BDAT_LAST, in_buf, length);
+}
@@ -9,11 +9,17 @@
 #define RE_EHLO_HELO "^(?i:" EHLO "|" HELO ")(?:\\s+(" RE_DOMAIN "))?\\s*" CRLF
 #define RE_REVERSE_PATH "[^>\\s@]+@[^>\\s@]+"
 #define RE_MAIL "^(?i:" MAIL "\\s+from):\\s*<(?:[^:]*:)?(" RE_REVERSE_PATH ")>.*" CRLF
+#define RE_MAIL_SIZE "^(?i:" MAIL "\\s+from):\\s*<[^>]*>.*\\s(?i:size)=([0-9]+)(?:\\s[^\\r\\n]*)?" CRLF
 #define RE_FORWARD_PATH RE_REVERSE_PATH
 #define RE_RCPT "^(?i:" RCPT "\\s+to):\\s*<(?:[^:]*:)?(" RE_FORWARD_PATH ")>.*" CRLF
+#define RE_BDAT "^(?i:" BDAT ")\\s+([0-9]+)(?:\\s+(?i:last))?\\s*" CRLF
+#define RE_BDAT_LAST "^(?i:" BDAT ")\\s+[0-9]+\\s+((?i:last))\\s*" CRLF
 
 const char *parse_ehlo_helo(buffer_t *in_buf, size_t *length);
 const char *parse_mail(buffer_t *in_buf, size_t *length);
+const char *parse_mail_size(buffer_t *in_buf, size_t *length);
 const char *parse_rcpt(buffer_t *in_buf, size_t *length);
+const char *parse_bdat(buffer_t *in_buf, size_t *length);
+const char *parse_bdat_last(buffer_t *in_buf, size_t *length);
 
 #endif
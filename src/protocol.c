@@ -25,6 +25,10 @@ const char *event_string(const te_smtp_server_event event)
             return "more_data";
         case SMTP_SERVER_EV_DATA_END:
             return "data_end";
+        case SMTP_SERVER_EV_BDAT:
+            return "bdat";
+        case SMTP_SERVER_EV_BDAT_LAST:
+            return "bdat_last";
         case SMTP_SERVER_EV_QUIT:
             return "quit";
         case SMTP_SERVER_EV_INVALID:
@@ -49,6 +53,8 @@ const char *state_string(const te_smtp_server_state state)
             return "wait_rcpt_or_data";
         case SMTP_SERVER_ST_WAIT_MORE_DATA:
             return "wait_more_data";
+        case SMTP_SERVER_ST_WAIT_BDAT:
+            return "wait_bdat";
         case SMTP_SERVER_ST_ERROR:
             return "error";
         case SMTP_SERVER_ST_INVALID:
@@ -114,6 +120,17 @@ static int handle_data_end(context_t *context)
     return handle(context, SMTP_SERVER_EV_DATA_END);
 }
 
+static int handle_bdat(context_t *context)
+{
+    if (!context->is_wait_transition) {
+        size_t length;
+        context->is_last_chunk = NULL != parse_bdat_last(&context->in_message, &length);
+    }
+
+    return handle(context, context->is_last_chunk
+        ? SMTP_SERVER_EV_BDAT_LAST : SMTP_SERVER_EV_BDAT);
+}
+
 static int handle_rset(context_t *context)
 {
     return handle(context, SMTP_SERVER_EV_RSET);
@@ -214,6 +231,7 @@ static int process_command_on_wait_ehlo(context_t *context)
     };
 
     static const char *wrong_commands[] = {
+        BDAT,
         DATA,
         DATA_END,
         MAIL,
@@ -240,6 +258,7 @@ static int process_command_on_wait_mail(context_t *context)
     };
 
     static const char *wrong_commands[] = {
+        BDAT,
         DATA,
         DATA_END,
         RCPT
@@ -263,6 +282,7 @@ static int process_command_on_wait_rcpt(context_t *context)
     };
 
     static const char *wrong_commands[] = {
+        BDAT,
         DATA,
         DATA_END,
         MAIL
@@ -276,6 +296,7 @@ static int process_command_on_wait_rcpt(context_t *context)
 static int process_command_on_wait_rcpt_or_data(context_t *context)
 {
     static const command_t correct_commands[] = {
+        {BDAT, handle_bdat},
         {DATA, handle_data},
         {EHLO, handle_ehlo},
         {HELO, handle_ehlo},
@@ -305,6 +326,30 @@ static int process_command_on_wait_more_data(context_t *context)
     }
 }
 
+static int process_command_on_wait_bdat(context_t *context)
+{
+    static const command_t correct_commands[] = {
+        {BDAT, handle_bdat},
+        {EHLO, handle_ehlo},
+        {HELO, handle_ehlo},
+        {NOOP, handle_noop},
+        {QUIT, handle_quit},
+        {RSET, handle_rset},
+        {VRFY, handle_vrfy}
+    };
+
+    static const char *wrong_commands[] = {
+        DATA,
+        DATA_END,
+        MAIL,
+        RCPT
+    };
+
+    return process_command(context,
+        correct_commands, COMMANDS_END(correct_commands),
+        wrong_commands, COMMANDS_END(wrong_commands));
+}
+
 static int process_command_on_error(context_t *context)
 {
     static const command_t correct_commands[] = {
@@ -316,6 +361,7 @@ static int process_command_on_error(context_t *context)
     };
 
     static const char *wrong_commands[] = {
+        BDAT,
         DATA,
         DATA_END,
         MAIL,
@@ -328,6 +374,12 @@ static int process_command_on_error(context_t *context)
         wrong_commands, COMMANDS_END(wrong_commands));
 }
 
+static int is_wait_chunk_data(const context_t *context)
+{
+    return context->is_wait_transition && context->chunk_left > 0
+        && buffer_left(&context->in_message) == 0;
+}
+
 int process_client(context_t *context)
 {
     switch (context->state) {
@@ -350,12 +402,20 @@ int process_client(context_t *context)
     timeval_diff(&diff, &context->last_action_time, &current_time);
     const long long duration = timeval_to_msec(&diff);
 
-    if (duration > context->settings->timeout) {
+    const int is_wait_chunk = is_wait_chunk_data(context);
+    const long long timeout = context->is_wait_transition && !is_wait_chunk
+        ? context->settings->storage_timeout : context->settings->timeout;
+
+    if (duration > timeout) {
         log_write(context->log, "[%s] timeout after %ld msec",
             context->uuid, duration);
         return handle(context, SMTP_SERVER_EV_TIMEOUT);
     }
 
+    if (is_wait_chunk) {
+        return 0;
+    }
+
     if (!context->is_wait_transition) {
         buffer_t *in_buf = &context->in_message;
 
@@ -400,6 +460,8 @@ int process_client(context_t *context)
             return process_command_on_wait_rcpt_or_data(context);
         case SMTP_SERVER_ST_WAIT_MORE_DATA:
             return process_command_on_wait_more_data(context);
+        case SMTP_SERVER_ST_WAIT_BDAT:
+            return process_command_on_wait_bdat(context);
         case SMTP_SERVER_ST_ERROR:
             return process_command_on_error(context);
         default:
@@ -4,6 +4,7 @@
 #include "context.h"
 #include "parse.h"
 
+#define BDAT "bdat"
 #define DATA "data"
 #define DATA_END "." CRLF
 #define EHLO "ehlo"
@@ -0,0 +1,465 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "log.h"
+#include "quota.h"
+#include "time.h"
+
+#define FILE_MODE (S_IRUSR | S_IWUSR)
+#define DIR_MODE (S_IRWXU | S_IRWXG | S_IRWXO)
+#define HASH_OFFSET 14695981039346656037ULL
+#define HASH_PRIME 1099511628211ULL
+#define BUSY_SPINS_COUNT 1024
+#define CLAIM_ATTEMPTS_COUNT 8
+#define SLOT_STATE_MASK 3
+#define SLOT_OWNER_SHIFT 2
+#define RECONCILE_SCAN_SIZE 1024
+#define RECONCILE_BATCH_SIZE 8
+
+static uint64_t hash_address(const char *address, const size_t length)
+{
+    uint64_t hash = HASH_OFFSET;
+
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char) address[i]) * HASH_PRIME;
+    }
+
+    return hash;
+}
+
+static long long current_msec(void)
+{
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    return timeval_to_msec(&current_time);
+}
+
+static void close_fd(int *fd)
+{
+    if (*fd >= 0 && close(*fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    *fd = -1;
+}
+
+static int is_valid_file(quota_table_t *table)
+{
+    struct stat stat_buf;
+    quota_header_t header;
+
+    if (fstat(table->__fd, &stat_buf) < 0) {
+        CALL_ERR_ARGS("fstat", "%s", table->__path);
+        return -1;
+    }
+
+    if (stat_buf.st_size != table->__map_size) {
+        return 0;
+    }
+
+    if (pread(table->__fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return 0;
+    }
+
+    return QUOTA_TABLE_MAGIC == header.magic
+        && table->__slots_count == header.slots_count;
+}
+
+static int reset_file(quota_table_t *table)
+{
+    const quota_header_t header = {
+        .magic = QUOTA_TABLE_MAGIC,
+        .slots_count = table->__slots_count
+    };
+
+    if (ftruncate(table->__fd, 0) < 0
+            || ftruncate(table->__fd, table->__map_size) < 0) {
+        CALL_ERR_ARGS("ftruncate", "%s, %lu", table->__path, table->__map_size);
+        return -1;
+    }
+
+    if (pwrite(table->__fd, &header, sizeof(header), 0) != sizeof(header)) {
+        CALL_ERR_ARGS("pwrite", "%s", table->__path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int prepare_file(quota_table_t *table)
+{
+    if (flock(table->__fd, LOCK_EX) < 0) {
+        CALL_ERR_ARGS("flock", "%s", table->__path);
+        return -1;
+    }
+
+    const int is_valid = is_valid_file(table);
+    const int result = is_valid < 0 ? -1 : is_valid ? 0 : reset_file(table);
+
+    if (flock(table->__fd, LOCK_UN) < 0) {
+        CALL_ERR_ARGS("flock", "%s", table->__path);
+        return -1;
+    }
+
+    return result;
+}
+
+static void run_reconcile(helper_job_t *job);
+
+int quota_table_init(quota_table_t *table, const char *dir,
+    const size_t slots_count, const int64_t limit,
+    const long long reconcile_interval)
+{
+    table->__fd = -1;
+    table->__header = NULL;
+    table->__slots = NULL;
+    table->__slots_count = slots_count;
+    table->__map_size = sizeof(quota_header_t)
+        + slots_count * sizeof(quota_slot_t);
+    table->__limit = limit;
+    table->__reconcile_interval = reconcile_interval;
+    table->__reconcile_next = 0;
+    table->__reconcile_job.run = run_reconcile;
+    table->__reconcile_job.signum = 0;
+    table->__reconcile_job.__is_pending = 0;
+
+    if (0 == slots_count) {
+        PRINT_STDERR("quota table has no slots: %s", dir);
+        return -1;
+    }
+
+    const int length = snprintf(table->__path, sizeof(table->__path), "%s/%s",
+        dir, QUOTA_TABLE_NAME);
+
+    if (length < 0 || length >= sizeof(table->__path)) {
+        PRINT_STDERR("path too long: %s", dir);
+        return -1;
+    }
+
+    if (maildir_make_path(dir, DIR_MODE) < 0 && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", dir);
+        return -1;
+    }
+
+    table->__fd = open(table->__path, O_RDWR | O_CREAT | O_CLOEXEC, FILE_MODE);
+
+    if (table->__fd < 0) {
+        CALL_ERR_ARGS("open", "%s", table->__path);
+        return -1;
+    }
+
+    if (prepare_file(table) < 0) {
+        close_fd(&table->__fd);
+        return -1;
+    }
+
+    table->__header = mmap(NULL, table->__map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, table->__fd, 0);
+
+    if (MAP_FAILED == table->__header) {
+        CALL_ERR_ARGS("mmap", "%s", table->__path);
+        table->__header = NULL;
+        close_fd(&table->__fd);
+        return -1;
+    }
+
+    if (helper_pool_init(&table->__pool, 1) < 0) {
+        quota_table_destroy(table);
+        return -1;
+    }
+
+    table->__slots = (quota_slot_t *) (table->__header + 1);
+
+    return 0;
+}
+
+void quota_table_destroy(quota_table_t *table)
+{
+    if (NULL != table->__slots) {
+        helper_pool_destroy(&table->__pool);
+    }
+
+    if (NULL != table->__header
+            && munmap(table->__header, table->__map_size) < 0) {
+        CALL_ERR("munmap");
+    }
+
+    table->__header = NULL;
+    table->__slots = NULL;
+    close_fd(&table->__fd);
+}
+
+static uint32_t slot_state(const uint32_t word)
+{
+    return word & SLOT_STATE_MASK;
+}
+
+static int is_owner_alive(const uint32_t word)
+{
+    const pid_t owner = word >> SLOT_OWNER_SHIFT;
+
+    return kill(owner, 0) == 0 || EPERM == errno;
+}
+
+static uint32_t wait_slot(quota_slot_t *slot)
+{
+    uint32_t word = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+    for (size_t i = 0; QUOTA_SLOT_BUSY == slot_state(word)
+            && i < BUSY_SPINS_COUNT; ++i) {
+        sched_yield();
+        word = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    }
+
+    if (QUOTA_SLOT_BUSY == slot_state(word) && !is_owner_alive(word)
+            && __atomic_compare_exchange_n(&slot->state, &word,
+                QUOTA_SLOT_DELETED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        PRINT_STDERR("recover quota slot of dead process %u",
+            word >> SLOT_OWNER_SHIFT);
+        return QUOTA_SLOT_DELETED;
+    }
+
+    return slot_state(word);
+}
+
+static int claim_slot(quota_slot_t *slot, const uint64_t hash,
+    const char *address, const size_t length, const char *mailbox)
+{
+    uint32_t expected = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    const uint32_t busy = QUOTA_SLOT_BUSY
+        | (uint32_t) getpid() << SLOT_OWNER_SHIFT;
+
+    if ((QUOTA_SLOT_EMPTY != expected && QUOTA_SLOT_DELETED != expected)
+            || !__atomic_compare_exchange_n(&slot->state, &expected, busy,
+                0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    slot->hash = hash;
+    slot->address_length = length;
+    memcpy(slot->address, address, length);
+    slot->address[length] = '\0';
+    snprintf(slot->mailbox, sizeof(slot->mailbox), "%s", mailbox);
+    slot->usage = 0;
+    slot->reconcile_time = 0;
+    __atomic_store_n(&slot->state, QUOTA_SLOT_READY, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static int is_slot_of(const quota_slot_t *slot, const uint64_t hash,
+    const char *address, const size_t length)
+{
+    return hash == slot->hash && length == slot->address_length
+        && memcmp(slot->address, address, length) == 0;
+}
+
+static quota_slot_t *probe_slot(quota_table_t *table, const uint64_t hash,
+    const char *address, const size_t length, quota_slot_t **free_slot)
+{
+    *free_slot = NULL;
+
+    for (size_t i = 0; i < table->__slots_count; ++i) {
+        quota_slot_t *slot = &table->__slots[(hash + i) % table->__slots_count];
+        const uint32_t state = wait_slot(slot);
+
+        if (QUOTA_SLOT_READY == state && is_slot_of(slot, hash, address, length)) {
+            return slot;
+        }
+
+        if ((QUOTA_SLOT_EMPTY == state || QUOTA_SLOT_DELETED == state)
+                && NULL == *free_slot) {
+            *free_slot = slot;
+        }
+
+        if (QUOTA_SLOT_EMPTY == state) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static quota_slot_t *find_slot(quota_table_t *table, const char *address,
+    const size_t length, const char *mailbox)
+{
+    if (length >= PATH_SIZE) {
+        return NULL;
+    }
+
+    const uint64_t hash = hash_address(address, length);
+
+    for (size_t i = 0; i < CLAIM_ATTEMPTS_COUNT; ++i) {
+        quota_slot_t *free_slot;
+        quota_slot_t *slot = probe_slot(table, hash, address, length,
+            &free_slot);
+
+        if (NULL != slot || NULL == mailbox) {
+            return slot;
+        }
+
+        if (NULL == free_slot) {
+            PRINT_STDERR("quota table is full: %s", table->__path);
+            return NULL;
+        }
+
+        if (claim_slot(free_slot, hash, address, length, mailbox)) {
+            return free_slot;
+        }
+    }
+
+    return NULL;
+}
+
+quota_status_t quota_table_check(quota_table_t *table, const char *address,
+    const size_t length, const size_t size)
+{
+    if ((int64_t) size > table->__limit) {
+        return QUOTA_TOO_LARGE;
+    }
+
+    const quota_slot_t *slot = find_slot(table, address, length, NULL);
+
+    if (NULL == slot) {
+        return QUOTA_WITHIN;
+    }
+
+    const int64_t usage = __atomic_load_n(&slot->usage, __ATOMIC_RELAXED);
+
+    return usage + (int64_t) size > table->__limit
+        || usage >= table->__limit ? QUOTA_FULL : QUOTA_WITHIN;
+}
+
+void quota_table_charge(quota_table_t *table, const char *address,
+    const char *mailbox, const size_t size)
+{
+    quota_slot_t *slot = find_slot(table, address, strlen(address), mailbox);
+
+    if (NULL != slot) {
+        __atomic_add_fetch(&slot->usage, size, __ATOMIC_RELAXED);
+    }
+}
+
+static int measure_dir(const char *mailbox, const char *sub_dir,
+    int64_t *size)
+{
+    char path[PATH_SIZE];
+    const int length = snprintf(path, sizeof(path), "%s/%s", mailbox, sub_dir);
+
+    if (length < 0 || length >= sizeof(path)) {
+        PRINT_STDERR("path too long: %s", mailbox);
+        return -1;
+    }
+
+    DIR *dir = opendir(path);
+
+    if (NULL == dir) {
+        if (ENOENT == errno) {
+            return 0;
+        }
+
+        CALL_ERR_ARGS("opendir", "%s", path);
+        return -1;
+    }
+
+    struct dirent *entry;
+    struct stat stat_buf;
+
+    while (NULL != (entry = readdir(dir))) {
+        if ('.' != entry->d_name[0]
+                && fstatat(dirfd(dir), entry->d_name, &stat_buf,
+                    AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISREG(stat_buf.st_mode)) {
+            *size += stat_buf.st_size;
+        }
+    }
+
+    if (closedir(dir) < 0) {
+        CALL_ERR_ARGS("closedir", "%s", path);
+    }
+
+    return 0;
+}
+
+static int claim_reconcile(const quota_table_t *table, quota_slot_t *slot,
+    const long long now)
+{
+    if (QUOTA_SLOT_READY != __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    int64_t reconcile_time = __atomic_load_n(&slot->reconcile_time,
+        __ATOMIC_RELAXED);
+
+    if (now - reconcile_time < table->__reconcile_interval) {
+        return 0;
+    }
+
+    return __atomic_compare_exchange_n(&slot->reconcile_time, &reconcile_time,
+        now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void reconcile_slot(quota_slot_t *slot)
+{
+    int64_t size = 0;
+
+    if (measure_dir(slot->mailbox, "new", &size) < 0
+            || measure_dir(slot->mailbox, "cur", &size) < 0) {
+        return;
+    }
+
+    __atomic_store_n(&slot->usage, size, __ATOMIC_RELAXED);
+
+    if (0 == size) {
+        uint32_t expected = QUOTA_SLOT_READY;
+
+        __atomic_compare_exchange_n(&slot->state, &expected,
+            QUOTA_SLOT_DELETED, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+static void run_reconcile(helper_job_t *job)
+{
+    quota_table_t *table = (quota_table_t *) ((char *) job
+        - offsetof(quota_table_t, __reconcile_job));
+    const long long now = current_msec();
+
+    if (now < 0) {
+        return;
+    }
+
+    size_t reconciled = 0;
+
+    for (size_t i = 0; i < RECONCILE_SCAN_SIZE && i < table->__slots_count
+            && reconciled < RECONCILE_BATCH_SIZE; ++i) {
+        quota_slot_t *slot = &table->__slots[table->__reconcile_next];
+
+        table->__reconcile_next = (table->__reconcile_next + 1)
+            % table->__slots_count;
+
+        if (claim_reconcile(table, slot, now)) {
+            reconcile_slot(slot);
+            ++reconciled;
+        }
+    }
+}
+
+void quota_table_reconcile(quota_table_t *table)
+{
+    if (!helper_pool_is_pending(&table->__pool, &table->__reconcile_job)) {
+        helper_pool_submit(&table->__pool, &table->__reconcile_job);
+    }
+}
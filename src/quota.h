@@ -0,0 +1,65 @@
+#ifndef SMTP_SERVER_QUOTA_H
+#define SMTP_SERVER_QUOTA_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "helper_pool.h"
+#include "maildir.h"
+
+#define QUOTA_TABLE_MAGIC 0x32544f51
+#define QUOTA_TABLE_NAME "table"
+
+typedef enum quota_slot_state {
+    QUOTA_SLOT_EMPTY,
+    QUOTA_SLOT_BUSY,
+    QUOTA_SLOT_READY,
+    QUOTA_SLOT_DELETED
+} quota_slot_state_t;
+
+typedef enum quota_status {
+    QUOTA_WITHIN,
+    QUOTA_FULL,
+    QUOTA_TOO_LARGE
+} quota_status_t;
+
+typedef struct quota_header {
+    uint32_t magic;
+    uint32_t slots_count;
+} quota_header_t;
+
+typedef struct quota_slot {
+    uint32_t state;
+    uint32_t address_length;
+    uint64_t hash;
+    int64_t usage;
+    int64_t reconcile_time;
+    char address[PATH_SIZE];
+    char mailbox[PATH_SIZE];
+} quota_slot_t;
+
+typedef struct quota_table {
+    char __path[PATH_SIZE];
+    int __fd;
+    quota_header_t *__header;
+    quota_slot_t *__slots;
+    size_t __slots_count;
+    size_t __map_size;
+    int64_t __limit;
+    long long __reconcile_interval;
+    size_t __reconcile_next;
+    helper_pool_t __pool;
+    helper_job_t __reconcile_job;
+} quota_table_t;
+
+int quota_table_init(quota_table_t *table, const char *dir,
+    const size_t slots_count, const int64_t limit,
+    const long long reconcile_interval);
+void quota_table_destroy(quota_table_t *table);
+quota_status_t quota_table_check(quota_table_t *table, const char *address,
+    const size_t length, const size_t size);
+void quota_table_charge(quota_table_t *table, const char *address,
+    const char *mailbox, const size_t size);
+void quota_table_reconcile(quota_table_t *table);
+
+#endif
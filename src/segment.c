@@ -0,0 +1,400 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "maildir.h"
+#include "segment.h"
+#include "time.h"
+
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+static int open_file(segment_store_t *store, const char *suffix)
+{
+    char name[SEGMENT_NAME_SIZE + sizeof(SEGMENT_INDEX_SUFFIX)];
+
+    if (snprintf(name, sizeof(name), "%s%s", store->__name, suffix) < 0) {
+        CALL_ERR("snprintf");
+        return -1;
+    }
+
+    return openat(store->__dir_fd, name,
+        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, FILE_MODE);
+}
+
+static int unlink_file(segment_store_t *store, const char *suffix)
+{
+    char name[SEGMENT_NAME_SIZE + sizeof(SEGMENT_INDEX_SUFFIX)];
+
+    if (snprintf(name, sizeof(name), "%s%s", store->__name, suffix) < 0) {
+        CALL_ERR("snprintf");
+        return -1;
+    }
+
+    if (unlinkat(store->__dir_fd, name, 0) < 0) {
+        CALL_ERR_ARGS("unlinkat", "%s/%s", store->__path, name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_fd(int *fd)
+{
+    if (*fd >= 0 && close(*fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    *fd = -1;
+}
+
+static int open_segment(segment_store_t *store)
+{
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    while (1) {
+        if (snprintf(store->__name, sizeof(store->__name), "%010ld-%d-%06lu",
+                current_time.tv_sec, getpid(), store->__sequence++) < 0) {
+            CALL_ERR("snprintf");
+            return -1;
+        }
+
+        store->__data_fd = open_file(store, SEGMENT_DATA_SUFFIX);
+
+        if (store->__data_fd >= 0) {
+            break;
+        }
+
+        if (EEXIST != errno) {
+            CALL_ERR_ARGS("openat", "%s/%s%s", store->__path, store->__name,
+                SEGMENT_DATA_SUFFIX);
+            return -1;
+        }
+    }
+
+    if (flock(store->__data_fd, LOCK_EX | LOCK_NB) < 0) {
+        CALL_ERR_ARGS("flock", "%s/%s%s", store->__path, store->__name,
+            SEGMENT_DATA_SUFFIX);
+        close_fd(&store->__data_fd);
+        unlink_file(store, SEGMENT_DATA_SUFFIX);
+        return -1;
+    }
+
+    store->__index_fd = open_file(store, SEGMENT_INDEX_SUFFIX);
+
+    if (store->__index_fd < 0) {
+        CALL_ERR_ARGS("openat", "%s/%s%s", store->__path, store->__name,
+            SEGMENT_INDEX_SUFFIX);
+        close_fd(&store->__data_fd);
+        unlink_file(store, SEGMENT_DATA_SUFFIX);
+        return -1;
+    }
+
+    store->__data_size = 0;
+    store->__index_size = 0;
+    store->__open_time = current_time;
+    store->__sync_generation = 0;
+
+    return 0;
+}
+
+static int sync_segment(segment_store_t *store)
+{
+    if (fdatasync(store->__data_fd) < 0) {
+        CALL_ERR_ARGS("fdatasync", "%s/%s%s", store->__path, store->__name,
+            SEGMENT_DATA_SUFFIX);
+        return -1;
+    }
+
+    if (fdatasync(store->__index_fd) < 0) {
+        CALL_ERR_ARGS("fdatasync", "%s/%s%s", store->__path, store->__name,
+            SEGMENT_INDEX_SUFFIX);
+        return -1;
+    }
+
+    if (fsync(store->__dir_fd) < 0) {
+        CALL_ERR_ARGS("fsync", "%s", store->__path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int close_segment(segment_store_t *store)
+{
+    int result = 0;
+
+    if (store->__data_fd < 0) {
+        return 0;
+    }
+
+    if (0 == store->__data_size) {
+        close_fd(&store->__data_fd);
+        close_fd(&store->__index_fd);
+        unlink_file(store, SEGMENT_DATA_SUFFIX);
+        unlink_file(store, SEGMENT_INDEX_SUFFIX);
+        return 0;
+    }
+
+    if (sync_segment(store) < 0) {
+        result = -1;
+    }
+
+    close_fd(&store->__index_fd);
+    close_fd(&store->__data_fd);
+
+    return result;
+}
+
+static int rotate_segment(segment_store_t *store)
+{
+    if (close_segment(store) < 0) {
+        return -1;
+    }
+
+    return open_segment(store);
+}
+
+static int is_expired(segment_store_t *store)
+{
+    if (0 == store->__data_size || store->__rotate_interval <= 0) {
+        return 0;
+    }
+
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return 0;
+    }
+
+    return mtimeval_diff(&store->__open_time, &current_time)
+        >= store->__rotate_interval;
+}
+
+static int write_full(const int fd, const char *data, const size_t size,
+    const off_t offset)
+{
+    size_t written = 0;
+
+    while (written < size) {
+        const ssize_t result = pwrite(fd, data + written, size - written,
+            offset + written);
+
+        if (result < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            CALL_ERR_ARGS("pwrite", "%d, %lu, %ld", fd, size - written,
+                offset + written);
+            return -1;
+        }
+
+        written += result;
+    }
+
+    return 0;
+}
+
+int segment_store_init(segment_store_t *store, const char *path,
+    const off_t max_size, const long long rotate_interval)
+{
+    store->__path = path;
+    store->__max_size = max_size;
+    store->__rotate_interval = rotate_interval;
+    store->__data_fd = -1;
+    store->__index_fd = -1;
+    store->__sequence = 0;
+    store->__data_size = 0;
+    store->__index_size = 0;
+    store->__sync_generation = 0;
+    timerclear(&store->__open_time);
+
+    if (maildir_make_path(path, S_IRWXU | S_IRWXG | S_IRWXO) < 0
+            && EEXIST != errno) {
+        CALL_ERR_ARGS("mkdir", "%s", path);
+        return -1;
+    }
+
+    store->__dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (store->__dir_fd < 0) {
+        CALL_ERR_ARGS("open", "%s", path);
+        return -1;
+    }
+
+    if (open_segment(store) < 0) {
+        close_fd(&store->__dir_fd);
+        return -1;
+    }
+
+    const int error = pthread_mutex_init(&store->__mutex, NULL);
+
+    if (error != 0) {
+        errno = error;
+        CALL_ERR("pthread_mutex_init");
+        close_segment(store);
+        close_fd(&store->__dir_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void segment_store_destroy(segment_store_t *store)
+{
+    close_segment(store);
+    close_fd(&store->__dir_fd);
+    pthread_mutex_destroy(&store->__mutex);
+}
+
+static int append_entry(segment_store_t *store, char *entry,
+    const size_t entry_size, const char *data, const size_t size)
+{
+    if (store->__data_size > 0
+            && (store->__data_size + (off_t) size > store->__max_size
+                || is_expired(store))
+            && rotate_segment(store) < 0) {
+        return -1;
+    }
+
+    if (store->__data_fd < 0 && open_segment(store) < 0) {
+        return -1;
+    }
+
+    segment_entry_header_t *header = (segment_entry_header_t *) entry;
+
+    header->offset = store->__data_size;
+
+    if (write_full(store->__data_fd, data, size, store->__data_size) < 0) {
+        return -1;
+    }
+
+    if (write_full(store->__index_fd, entry, entry_size,
+            store->__index_size) < 0) {
+        return -1;
+    }
+
+    store->__data_size += size;
+    store->__index_size += entry_size;
+
+    return 0;
+}
+
+int segment_store_append(segment_store_t *store, const char *id,
+    const char *recipients, const size_t recipients_count,
+    const size_t recipients_size, const char *data, const size_t size)
+{
+    const size_t id_size = strlen(id) + 1;
+    const size_t entry_size = sizeof(segment_entry_header_t) + id_size
+        + recipients_size;
+    char *entry = malloc(entry_size);
+
+    if (NULL == entry) {
+        CALL_ERR_ARGS("malloc", "%lu", entry_size);
+        return -1;
+    }
+
+    const segment_entry_header_t header = {
+        .magic = SEGMENT_ENTRY_MAGIC,
+        .id_size = id_size,
+        .offset = 0,
+        .length = size,
+        .recipients_count = recipients_count,
+        .recipients_size = recipients_size
+    };
+
+    memcpy(entry, &header, sizeof(header));
+    memcpy(entry + sizeof(header), id, id_size);
+    memcpy(entry + sizeof(header) + id_size, recipients, recipients_size);
+
+    pthread_mutex_lock(&store->__mutex);
+    const int result = append_entry(store, entry, entry_size, data, size);
+    pthread_mutex_unlock(&store->__mutex);
+
+    free(entry);
+
+    return result;
+}
+
+int segment_store_sync(segment_store_t *store, const unsigned long generation)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&store->__mutex);
+
+    if (store->__data_fd >= 0
+            && (0 == generation || generation != store->__sync_generation)) {
+        result = sync_segment(store);
+
+        if (0 == result) {
+            store->__sync_generation = generation;
+        }
+    }
+
+    pthread_mutex_unlock(&store->__mutex);
+
+    return result;
+}
+
+int segment_store_rotate_expired(segment_store_t *store)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&store->__mutex);
+
+    if (is_expired(store)) {
+        result = rotate_segment(store);
+    }
+
+    pthread_mutex_unlock(&store->__mutex);
+
+    return result;
+}
+
+off_t segment_store_tail(segment_store_t *store, char *name)
+{
+    pthread_mutex_lock(&store->__mutex);
+
+    const off_t index_size = store->__data_fd < 0 ? -1 : store->__index_size;
+
+    memcpy(name, store->__name, SEGMENT_NAME_SIZE);
+
+    pthread_mutex_unlock(&store->__mutex);
+
+    return index_size;
+}
+
+int segment_is_locked(const int dir_fd, const char *data_name)
+{
+    const int fd = openat(dir_fd, data_name, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        CALL_ERR_ARGS("openat", "%s", data_name);
+        return -1;
+    }
+
+    int result = 0;
+
+    if (flock(fd, LOCK_SH | LOCK_NB) < 0) {
+        if (EWOULDBLOCK == errno) {
+            result = 1;
+        } else {
+            CALL_ERR_ARGS("flock", "%s", data_name);
+            result = -1;
+        }
+    }
+
+    if (close(fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    return result;
+}
@@ -0,0 +1,50 @@
+#ifndef SMTP_SERVER_SEGMENT_H
+#define SMTP_SERVER_SEGMENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define SEGMENT_ENTRY_MAGIC 0x31474553
+#define SEGMENT_DATA_SUFFIX ".seg"
+#define SEGMENT_INDEX_SUFFIX ".idx"
+#define SEGMENT_NAME_SIZE 64
+
+typedef struct segment_entry_header {
+    uint32_t magic;
+    uint32_t id_size;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t recipients_count;
+    uint32_t recipients_size;
+} segment_entry_header_t;
+
+typedef struct segment_store {
+    const char *__path;
+    off_t __max_size;
+    long long __rotate_interval;
+    int __dir_fd;
+    int __data_fd;
+    int __index_fd;
+    char __name[SEGMENT_NAME_SIZE];
+    unsigned long __sequence;
+    off_t __data_size;
+    off_t __index_size;
+    struct timeval __open_time;
+    unsigned long __sync_generation;
+    pthread_mutex_t __mutex;
+} segment_store_t;
+
+int segment_store_init(segment_store_t *store, const char *path,
+    const off_t max_size, const long long rotate_interval);
+void segment_store_destroy(segment_store_t *store);
+int segment_store_append(segment_store_t *store, const char *id,
+    const char *recipients, const size_t recipients_count,
+    const size_t recipients_size, const char *data, const size_t size);
+int segment_store_sync(segment_store_t *store, const unsigned long generation);
+int segment_store_rotate_expired(segment_store_t *store);
+off_t segment_store_tail(segment_store_t *store, char *name);
+int segment_is_locked(const int dir_fd, const char *data_name);
+
+#endif
@@ -0,0 +1,410 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "segment.h"
+
+typedef struct id_list {
+    char **ids;
+    size_t count;
+    char *__data;
+} id_list_t;
+
+typedef struct compact_stats {
+    size_t segments;
+    size_t messages;
+    size_t deleted;
+    size_t truncated;
+} compact_stats_t;
+
+static int compare_ids(const void *first, const void *second)
+{
+    return strcmp(*(char * const *) first, *(char * const *) second);
+}
+
+static char *read_file(const int dir_fd, const char *name, size_t *size)
+{
+    const int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        CALL_ERR_ARGS("openat", "%s", name);
+        return NULL;
+    }
+
+    struct stat stat;
+
+    if (fstat(fd, &stat) < 0) {
+        CALL_ERR_ARGS("fstat", "%s", name);
+        close(fd);
+        return NULL;
+    }
+
+    char *data = malloc(stat.st_size + 1);
+
+    if (NULL == data) {
+        CALL_ERR_ARGS("malloc", "%ld", stat.st_size + 1);
+        close(fd);
+        return NULL;
+    }
+
+    size_t total = 0;
+
+    while (total < stat.st_size) {
+        const ssize_t result = read(fd, data + total, stat.st_size - total);
+
+        if (result <= 0) {
+            if (result < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if (result < 0) {
+                CALL_ERR_ARGS("read", "%s", name);
+            }
+
+            break;
+        }
+
+        total += result;
+    }
+
+    if (close(fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    data[total] = '\0';
+    *size = total;
+
+    return data;
+}
+
+static int id_list_init(id_list_t *list, const char *file_name)
+{
+    list->ids = NULL;
+    list->count = 0;
+    list->__data = NULL;
+
+    if (NULL == file_name) {
+        return 0;
+    }
+
+    size_t size;
+
+    list->__data = read_file(AT_FDCWD, file_name, &size);
+
+    if (NULL == list->__data) {
+        return -1;
+    }
+
+    size_t lines = 1;
+
+    for (size_t i = 0; i < size; ++i) {
+        if ('\n' == list->__data[i]) {
+            ++lines;
+        }
+    }
+
+    list->ids = malloc(lines * sizeof(char *));
+
+    if (NULL == list->ids) {
+        CALL_ERR_ARGS("malloc", "%lu", lines * sizeof(char *));
+        free(list->__data);
+        return -1;
+    }
+
+    for (char *line = strtok(list->__data, "\r\n"); NULL != line;
+            line = strtok(NULL, "\r\n")) {
+        list->ids[list->count++] = line;
+    }
+
+    qsort(list->ids, list->count, sizeof(char *), compare_ids);
+
+    return 0;
+}
+
+static void id_list_destroy(id_list_t *list)
+{
+    free(list->ids);
+    free(list->__data);
+}
+
+static int id_list_contains(const id_list_t *list, const char *id)
+{
+    return 0 != list->count && NULL != bsearch(&id, list->ids, list->count,
+        sizeof(char *), compare_ids);
+}
+
+static int is_data_name(const struct dirent *entry)
+{
+    const size_t length = strlen(entry->d_name);
+    const size_t suffix_length = strlen(SEGMENT_DATA_SUFFIX);
+
+    return length > suffix_length && strcmp(entry->d_name + length
+        - suffix_length, SEGMENT_DATA_SUFFIX) == 0;
+}
+
+static int index_name(const char *data_name, char *name, const size_t size)
+{
+    const size_t length = strlen(data_name) - strlen(SEGMENT_DATA_SUFFIX);
+
+    if (snprintf(name, size, "%.*s%s", (int) length, data_name,
+            SEGMENT_INDEX_SUFFIX) < 0) {
+        CALL_ERR("snprintf");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_data(const int fd, char **data, size_t *capacity,
+    const size_t size, const off_t offset)
+{
+    if (size > *capacity) {
+        char *resized = realloc(*data, size);
+
+        if (NULL == resized) {
+            CALL_ERR_ARGS("realloc", "%p, %lu", *data, size);
+            return -1;
+        }
+
+        *data = resized;
+        *capacity = size;
+    }
+
+    size_t total = 0;
+
+    while (total < size) {
+        const ssize_t result = pread(fd, *data + total, size - total,
+            offset + total);
+
+        if (result < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if (result <= 0) {
+            CALL_ERR_ARGS("pread", "%d, %lu, %ld", fd, size - total,
+                offset + total);
+            return -1;
+        }
+
+        total += result;
+    }
+
+    return 0;
+}
+
+static int compact_segment(segment_store_t *store, const int dir_fd,
+    const char *data_name, const id_list_t *deleted, compact_stats_t *stats)
+{
+    char name[SEGMENT_NAME_SIZE + sizeof(SEGMENT_INDEX_SUFFIX)];
+
+    if (index_name(data_name, name, sizeof(name)) < 0) {
+        return -1;
+    }
+
+    size_t index_size;
+    char *index = read_file(dir_fd, name, &index_size);
+
+    if (NULL == index) {
+        return -1;
+    }
+
+    const int data_fd = openat(dir_fd, data_name, O_RDONLY | O_CLOEXEC);
+
+    if (data_fd < 0) {
+        CALL_ERR_ARGS("openat", "%s", data_name);
+        free(index);
+        return -1;
+    }
+
+    struct stat stat;
+    int result = fstat(data_fd, &stat);
+
+    if (result < 0) {
+        CALL_ERR_ARGS("fstat", "%s", data_name);
+    }
+
+    char *data = NULL;
+    size_t capacity = 0;
+    size_t position = 0;
+
+    while (0 == result && position < index_size) {
+        segment_entry_header_t header;
+
+        if (index_size - position < sizeof(header)) {
+            ++stats->truncated;
+            break;
+        }
+
+        memcpy(&header, index + position, sizeof(header));
+
+        const size_t entry_size = sizeof(header) + header.id_size
+            + header.recipients_size;
+        const char *id = index + position + sizeof(header);
+
+        if (SEGMENT_ENTRY_MAGIC != header.magic || 0 == header.id_size
+                || index_size - position < entry_size
+                || '\0' != id[header.id_size - 1]
+                || header.offset + header.length > (uint64_t) stat.st_size) {
+            ++stats->truncated;
+            break;
+        }
+
+        position += entry_size;
+
+        if (id_list_contains(deleted, id)) {
+            ++stats->deleted;
+            continue;
+        }
+
+        result = read_data(data_fd, &data, &capacity, header.length,
+            header.offset);
+
+        if (0 == result) {
+            result = segment_store_append(store, id, id + header.id_size,
+                header.recipients_count, header.recipients_size, data,
+                header.length);
+        }
+
+        if (0 == result) {
+            ++stats->messages;
+        }
+    }
+
+    free(data);
+    free(index);
+
+    if (close(data_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    return result;
+}
+
+static int remove_segment(const int dir_fd, const char *data_name)
+{
+    char name[SEGMENT_NAME_SIZE + sizeof(SEGMENT_INDEX_SUFFIX)];
+
+    if (index_name(data_name, name, sizeof(name)) < 0) {
+        return -1;
+    }
+
+    if (unlinkat(dir_fd, data_name, 0) < 0) {
+        CALL_ERR_ARGS("unlinkat", "%s", data_name);
+        return -1;
+    }
+
+    if (unlinkat(dir_fd, name, 0) < 0) {
+        CALL_ERR_ARGS("unlinkat", "%s", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compact(const char *path, const off_t max_size,
+    const id_list_t *deleted, compact_stats_t *stats)
+{
+    struct dirent **entries;
+    const int count = scandir(path, &entries, is_data_name, alphasort);
+
+    if (count < 0) {
+        CALL_ERR_ARGS("scandir", "%s", path);
+        return -1;
+    }
+
+    segment_store_t store;
+    int result = segment_store_init(&store, path, max_size, 0);
+    const int is_store_ready = 0 == result;
+    int *is_compacted = calloc(count + 1, sizeof(int));
+
+    if (NULL == is_compacted) {
+        CALL_ERR_ARGS("calloc", "%d", count + 1);
+        result = -1;
+    }
+
+    const int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir_fd < 0) {
+        CALL_ERR_ARGS("open", "%s", path);
+        result = -1;
+    }
+
+    for (int i = 0; 0 == result && i < count; ++i) {
+        const int is_locked = segment_is_locked(dir_fd, entries[i]->d_name);
+
+        if (0 != is_locked) {
+            result = is_locked < 0 ? -1 : 0;
+            continue;
+        }
+
+        result = compact_segment(&store, dir_fd, entries[i]->d_name, deleted,
+            stats);
+        is_compacted[i] = 0 == result;
+    }
+
+    if (0 == result && segment_store_sync(&store, 0) < 0) {
+        result = -1;
+    }
+
+    if (is_store_ready) {
+        segment_store_destroy(&store);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (0 == result && is_compacted[i]
+                && remove_segment(dir_fd, entries[i]->d_name) == 0) {
+            ++stats->segments;
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+    free(is_compacted);
+
+    if (dir_fd >= 0) {
+        if (0 == result && fsync(dir_fd) < 0) {
+            CALL_ERR_ARGS("fsync", "%s", path);
+            result = -1;
+        }
+
+        if (close(dir_fd) < 0) {
+            CALL_ERR("close");
+        }
+    }
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        PRINT_STDERR("Usage: %s <segment dir> <max segment size> "
+            "[deleted message ids file]\n", argv[0]);
+        return 1;
+    }
+
+    const long long max_size = atoll(argv[2]);
+
+    if (max_size <= 0) {
+        PRINT_STDERR("invalid max segment size: %s", argv[2]);
+        return 1;
+    }
+
+    id_list_t deleted;
+
+    if (id_list_init(&deleted, argc > 3 ? argv[3] : NULL) < 0) {
+        return 1;
+    }
+
+    compact_stats_t stats = {0, 0, 0, 0};
+    const int result = compact(argv[1], max_size, &deleted, &stats);
+
+    id_list_destroy(&deleted);
+
+    printf("segments: %lu, messages: %lu, deleted: %lu, truncated: %lu\n",
+        stats.segments, stats.messages, stats.deleted, stats.truncated);
+
+    return result < 0 ? 1 : 0;
+}
@@ -44,10 +44,161 @@ static int read_uint16(config_t *config, const char *path, uint16_t *value)
     return 0;
 }
 
+static int read_durability(config_t *config, const char *path,
+    durability_t *value)
+{
+    const char *string_value;
+
+    if (read_string(config, path, &string_value) < 0) {
+        return -1;
+    }
+
+    if (strcmp(string_value, "none") == 0) {
+        *value = DURABILITY_NONE;
+    } else if (strcmp(string_value, "fdatasync") == 0) {
+        *value = DURABILITY_FDATASYNC;
+    } else if (strcmp(string_value, "group") == 0) {
+        *value = DURABILITY_GROUP;
+    } else {
+        PRINT_STDERR("error: invalid '%s' value: %s", path, string_value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_storage(config_t *config, const char *path, storage_t *value)
+{
+    const char *string_value;
+
+    if (read_string(config, path, &string_value) < 0) {
+        return -1;
+    }
+
+    if (strcmp(string_value, "maildir") == 0) {
+        *value = STORAGE_MAILDIR;
+    } else if (strcmp(string_value, "segment") == 0) {
+        *value = STORAGE_SEGMENT;
+    } else if (strcmp(string_value, "journal") == 0) {
+        *value = STORAGE_JOURNAL;
+    } else if (strcmp(string_value, "memory") == 0) {
+        *value = STORAGE_MEMORY;
+    } else if (strcmp(string_value, "null") == 0) {
+        *value = STORAGE_NULL;
+    } else {
+        PRINT_STDERR("error: invalid '%s' value: %s", path, string_value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_compression(config_t *config, const char *path,
+    compression_t *value)
+{
+    const char *string_value;
+
+    if (read_string(config, path, &string_value) < 0) {
+        return -1;
+    }
+
+    if (strcmp(string_value, "none") == 0) {
+        *value = COMPRESSION_NONE;
+    } else if (strcmp(string_value, "zstd") == 0) {
+        *value = COMPRESSION_ZSTD;
+    } else {
+        PRINT_STDERR("error: invalid '%s' value: %s", path, string_value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_maildir_placement(config_t *config, const char *path,
+    maildir_placement_t *value)
+{
+    const char *string_value;
+
+    if (read_string(config, path, &string_value) < 0) {
+        return -1;
+    }
+
+    if (strcmp(string_value, "domain") == 0) {
+        *value = MAILDIR_PLACEMENT_DOMAIN;
+    } else if (strcmp(string_value, "mailbox") == 0) {
+        *value = MAILDIR_PLACEMENT_MAILBOX;
+    } else if (strcmp(string_value, "least_loaded") == 0) {
+        *value = MAILDIR_PLACEMENT_LEAST_LOADED;
+    } else {
+        PRINT_STDERR("error: invalid '%s' value: %s", path, string_value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_maildir_root(config_setting_t *setting, const char *path,
+    const int index, maildir_root_t *root)
+{
+    if (NULL == setting
+            || config_setting_lookup_string(setting, "path", &root->path) != CONFIG_TRUE
+            || config_setting_lookup_int(setting, "weight", &root->weight) != CONFIG_TRUE) {
+        PRINT_STDERR("error: no path or weight in '%s' element %d", path, index);
+        return -1;
+    }
+
+    if (root->weight < 1) {
+        PRINT_STDERR("error: '%s' element %d weight < 1: %d", path, index,
+            root->weight);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_maildir_roots(config_t *config, const char *path,
+    settings_t *settings)
+{
+    config_setting_t *list = config_lookup(config, path);
+
+    if (NULL == list) {
+        PRINT_STDERR("error: no '%s' list setting in config", path);
+        return -1;
+    }
+
+    const int count = config_setting_length(list);
+
+    settings->maildir_roots_count = count > 0 ? count : 1;
+    settings->maildir_roots = calloc(settings->maildir_roots_count,
+        sizeof(maildir_root_t));
+
+    if (NULL == settings->maildir_roots) {
+        CALL_ERR_ARGS("calloc", "%lu", settings->maildir_roots_count);
+        return -1;
+    }
+
+    if (0 == count) {
+        settings->maildir_roots[0].path = settings->maildir;
+        settings->maildir_roots[0].weight = 1;
+        return 0;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (read_maildir_root(config_setting_get_elem(list, i), path, i,
+                &settings->maildir_roots[i]) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 int settings_init(settings_t *settings, const char *file_name)
 {
     config_t *config = &settings->__config;
     config_init(config);
+    settings->maildir_roots = NULL;
+    settings->maildir_roots_count = 0;
 
     if (config_read_file(config, file_name) != CONFIG_TRUE) {
         CALL_ERR_ARGS("config_read_file", "%s:%d %s", config_error_file(config),
@@ -60,6 +211,11 @@ int settings_init(settings_t *settings, const char *file_name)
 #define READ_INT(name) if (read_int(config, #name, &settings->name) < 0) { return -1; }
 #define READ_INT64(name) if (read_int64(config, #name, &settings->name) < 0) { return -1; }
 #define READ_UINT16(name) if (read_uint16(config, #name, &settings->name) < 0) { return -1; }
+#define READ_DURABILITY(name) if (read_durability(config, #name, &settings->name) < 0) { return -1; }
+#define READ_STORAGE(name) if (read_storage(config, #name, &settings->name) < 0) { return -1; }
+#define READ_MAILDIR_ROOTS(name) if (read_maildir_roots(config, #name, settings) < 0) { return -1; }
+#define READ_COMPRESSION(name) if (read_compression(config, #name, &settings->name) < 0) { return -1; }
+#define READ_MAILDIR_PLACEMENT(name) if (read_maildir_placement(config, #name, &settings->name) < 0) { return -1; }
 
     READ_STRING(address)
     READ_UINT16(port)
@@ -68,9 +224,54 @@ int settings_init(settings_t *settings, const char *file_name)
     READ_STRING(maildir)
     READ_STRING(log)
     READ_INT(max_in_message_size)
+    READ_INT(sync_write_max_size)
+    READ_INT(sync_write_max_latency)
+    READ_INT(memory_spool_size)
+    READ_INT(maildir_cache_size)
+    READ_INT(maildir_shard_width)
+    READ_MAILDIR_ROOTS(maildir_roots)
+    READ_MAILDIR_PLACEMENT(maildir_placement)
+    READ_INT(fan_out_batch_size)
+    READ_DURABILITY(durability)
+    READ_INT(group_commit_interval)
+    READ_INT(helper_threads_count)
+    READ_STORAGE(storage)
+    READ_STRING(segment_dir)
+    READ_INT(segment_max_size)
+    READ_INT(segment_rotate_interval)
+    READ_STRING(journal_dir)
+    READ_INT(journal_retry_count)
+    READ_STRING(intent_log_dir)
+    READ_INT(intent_log_slots)
+    READ_INT(dedup_min_size)
+    READ_STRING(dedup_dir)
+    READ_INT(dedup_index_size)
+    READ_COMPRESSION(compression)
+    READ_INT(compression_level)
+    READ_STRING(delivery_index_dir)
+    READ_INT(delivery_index_max_size)
+    READ_STRING(notify_dir)
+    READ_INT(notify_queue_size)
+    READ_STRING(quota_dir)
+    READ_INT(quota_slots)
+    READ_INT64(quota_size)
+    READ_INT(quota_reconcile_interval)
+    READ_INT(memory_storage_size)
+    READ_INT(max_message_size)
+    READ_INT(flow_control_high_watermark)
+    READ_INT(flow_control_low_watermark)
+    READ_INT(write_buffers_count)
+    READ_INT(write_buffer_size)
+    READ_INT(maildir_drop_cache_min_size)
     READ_INT64(timeout)
+    READ_INT64(storage_timeout)
     READ_INT(daemon)
 
+#undef READ_MAILDIR_PLACEMENT
+#undef READ_COMPRESSION
+#undef READ_MAILDIR_ROOTS
+#undef READ_STORAGE
+#undef READ_DURABILITY
 #undef READ_UINT16
 #undef READ_INT64
 #undef READ_INT
@@ -81,10 +282,27 @@ int settings_init(settings_t *settings, const char *file_name)
         return -1;
     }
 
+    if (settings->flow_control_high_watermark > 0
+            && settings->flow_control_low_watermark
+                >= settings->flow_control_high_watermark) {
+        PRINT_STDERR("error: flow_control_low_watermark >= "
+            "flow_control_high_watermark: %d", settings->flow_control_low_watermark);
+        return -1;
+    }
+
+    if (STORAGE_MAILDIR != settings->storage && STORAGE_NULL != settings->storage
+            && settings->max_message_size < 1) {
+        PRINT_STDERR("error: max_message_size < 1 with in-memory spool: %d",
+            settings->max_message_size);
+        return -1;
+    }
+
     return 0;
 }
 
 void settings_destroy(settings_t *settings)
 {
+    free(settings->maildir_roots);
+    settings->maildir_roots = NULL;
     config_destroy(&settings->__config);
 }
@@ -4,6 +4,36 @@
 #include <libconfig.h>
 #include <stdint.h>
 
+typedef enum durability {
+    DURABILITY_NONE,
+    DURABILITY_FDATASYNC,
+    DURABILITY_GROUP
+} durability_t;
+
+typedef enum storage {
+    STORAGE_MAILDIR,
+    STORAGE_SEGMENT,
+    STORAGE_JOURNAL,
+    STORAGE_MEMORY,
+    STORAGE_NULL
+} storage_t;
+
+typedef enum compression {
+    COMPRESSION_NONE,
+    COMPRESSION_ZSTD
+} compression_t;
+
+typedef enum maildir_placement {
+    MAILDIR_PLACEMENT_DOMAIN,
+    MAILDIR_PLACEMENT_MAILBOX,
+    MAILDIR_PLACEMENT_LEAST_LOADED
+} maildir_placement_t;
+
+typedef struct maildir_root {
+    const char *path;
+    int weight;
+} maildir_root_t;
+
 typedef struct settings {
     const char *address;
     uint16_t port;
@@ -12,7 +42,48 @@ typedef struct settings {
     const char *maildir;
     const char *log;
     int max_in_message_size;
+    int sync_write_max_size;
+    int sync_write_max_latency;
+    int memory_spool_size;
+    int maildir_cache_size;
+    int maildir_shard_width;
+    maildir_root_t *maildir_roots;
+    size_t maildir_roots_count;
+    maildir_placement_t maildir_placement;
+    int fan_out_batch_size;
+    durability_t durability;
+    int group_commit_interval;
+    int helper_threads_count;
+    storage_t storage;
+    const char *segment_dir;
+    int segment_max_size;
+    int segment_rotate_interval;
+    const char *journal_dir;
+    int journal_retry_count;
+    const char *intent_log_dir;
+    int intent_log_slots;
+    int dedup_min_size;
+    const char *dedup_dir;
+    int dedup_index_size;
+    compression_t compression;
+    int compression_level;
+    const char *delivery_index_dir;
+    int delivery_index_max_size;
+    const char *notify_dir;
+    int notify_queue_size;
+    const char *quota_dir;
+    int quota_slots;
+    long long quota_size;
+    int quota_reconcile_interval;
+    int memory_storage_size;
+    int max_message_size;
+    int flow_control_high_watermark;
+    int flow_control_low_watermark;
+    int write_buffers_count;
+    int write_buffer_size;
+    int maildir_drop_cache_min_size;
     long long timeout;
+    long long storage_timeout;
     int daemon;
     config_t __config;
 } settings_t;
@@ -1,3 +1,4 @@
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 
 #include "log.h"
@@ -32,3 +33,25 @@ int set_signals_handle(void (*handle)(int))
 
     return 0;
 }
+
+int open_signal_fd(const int signum)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, signum);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        CALL_ERR("sigprocmask");
+        return -1;
+    }
+
+    const int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (fd < 0) {
+        CALL_ERR_ARGS("signalfd", "%d", signum);
+        return -1;
+    }
+
+    return fd;
+}
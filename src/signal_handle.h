@@ -3,5 +3,6 @@
 
 int set_signal_handle(const int signum, void (*handle)(int));
 int set_signals_handle(void (*handle)(int));
+int open_signal_fd(const int signum);
 
 #endif
@@ -0,0 +1,600 @@
+#include <fcntl.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "spool.h"
+#include "time.h"
+
+#define WRITE_LATENCY_WEIGHT 8
+#define SYNC_WRITE_RETRY_INTERVAL 1000
+#define SPLICE_PIPE_SIZE 1048576
+
+static void destroy_storage(spool_t *spool)
+{
+    if (NULL != spool->storage->destroy) {
+        spool->storage->destroy(spool->storage_state);
+    }
+
+    spool->storage_state = NULL;
+}
+
+static void close_splice_pipe(spool_t *spool)
+{
+    for (size_t i = 0; i < 2; ++i) {
+        if (spool->__splice_pipe[i] != -1 && close(spool->__splice_pipe[i]) < 0) {
+            CALL_ERR("close");
+        }
+
+        spool->__splice_pipe[i] = -1;
+    }
+}
+
+static int open_splice_pipe(spool_t *spool)
+{
+    if (pipe2(spool->__splice_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        CALL_ERR("pipe2");
+        spool->__splice_pipe[0] = -1;
+        spool->__splice_pipe[1] = -1;
+        return -1;
+    }
+
+    const int size = fcntl(spool->__splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    spool->__splice_pipe_size = size > 0
+        ? (size_t) size : (size_t) fcntl(spool->__splice_pipe[1], F_GETPIPE_SZ);
+
+    return 0;
+}
+
+static void destroy_dedup_index(spool_t *spool)
+{
+    if (NULL != spool->dedup_index) {
+        dedup_index_destroy(spool->dedup_index);
+        free(spool->dedup_index);
+    }
+
+    spool->dedup_index = NULL;
+}
+
+static int init_dedup_index(spool_t *spool, const settings_t *settings)
+{
+    if (0 == settings->dedup_min_size
+            || STORAGE_WRITE_FILE != spool->storage->write_mode) {
+        return 0;
+    }
+
+    spool->dedup_index = malloc(sizeof(dedup_index_t));
+
+    if (NULL == spool->dedup_index) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(dedup_index_t));
+        return -1;
+    }
+
+    if (dedup_index_init(spool->dedup_index, settings->dedup_dir,
+            settings->dedup_index_size) < 0) {
+        free(spool->dedup_index);
+        spool->dedup_index = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_compressor_pool(spool_t *spool)
+{
+    if (NULL != spool->compressor_pool) {
+        compressor_pool_destroy(spool->compressor_pool);
+        free(spool->compressor_pool);
+    }
+
+    spool->compressor_pool = NULL;
+}
+
+static int init_compressor_pool(spool_t *spool, const settings_t *settings)
+{
+    if (COMPRESSION_NONE == settings->compression
+            || STORAGE_WRITE_FILE != spool->storage->write_mode) {
+        return 0;
+    }
+
+    spool->compressor_pool = malloc(sizeof(compressor_pool_t));
+
+    if (NULL == spool->compressor_pool) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(compressor_pool_t));
+        return -1;
+    }
+
+    if (compressor_pool_init(spool->compressor_pool,
+            settings->compression_level) < 0) {
+        free(spool->compressor_pool);
+        spool->compressor_pool = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_delivery_index(spool_t *spool)
+{
+    if (NULL != spool->delivery_index) {
+        delivery_index_destroy(spool->delivery_index);
+        free(spool->delivery_index);
+    }
+
+    spool->delivery_index = NULL;
+}
+
+static int init_delivery_index(spool_t *spool, const settings_t *settings)
+{
+    if (0 == settings->delivery_index_max_size
+            || STORAGE_WRITE_FILE != spool->storage->write_mode) {
+        return 0;
+    }
+
+    spool->delivery_index = malloc(sizeof(delivery_index_t));
+
+    if (NULL == spool->delivery_index) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(delivery_index_t));
+        return -1;
+    }
+
+    if (delivery_index_init(spool->delivery_index, settings->delivery_index_dir,
+            settings->delivery_index_max_size) < 0) {
+        free(spool->delivery_index);
+        spool->delivery_index = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_notifier(spool_t *spool)
+{
+    if (NULL != spool->notifier) {
+        notifier_destroy(spool->notifier);
+        free(spool->notifier);
+    }
+
+    spool->notifier = NULL;
+}
+
+static int init_notifier(spool_t *spool, const settings_t *settings)
+{
+    if (0 == settings->notify_queue_size
+            || STORAGE_WRITE_FILE != spool->storage->write_mode) {
+        return 0;
+    }
+
+    spool->notifier = malloc(sizeof(notifier_t));
+
+    if (NULL == spool->notifier) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(notifier_t));
+        return -1;
+    }
+
+    if (notifier_init(spool->notifier, settings->notify_dir,
+            settings->notify_queue_size) < 0) {
+        free(spool->notifier);
+        spool->notifier = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_quota_table(spool_t *spool)
+{
+    if (NULL != spool->quota_table) {
+        quota_table_destroy(spool->quota_table);
+        free(spool->quota_table);
+    }
+
+    spool->quota_table = NULL;
+}
+
+static int init_quota_table(spool_t *spool, const settings_t *settings)
+{
+    if (0 == settings->quota_size
+            || STORAGE_WRITE_FILE != spool->storage->write_mode) {
+        return 0;
+    }
+
+    spool->quota_table = malloc(sizeof(quota_table_t));
+
+    if (NULL == spool->quota_table) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(quota_table_t));
+        return -1;
+    }
+
+    if (quota_table_init(spool->quota_table, settings->quota_dir,
+            settings->quota_slots, settings->quota_size,
+            settings->quota_reconcile_interval) < 0) {
+        free(spool->quota_table);
+        spool->quota_table = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_lanes(spool_t *spool, const size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        helper_pool_destroy(&spool->lanes[i].helper_pool);
+    }
+
+    free(spool->lanes);
+    spool->lanes = NULL;
+    spool->lanes_count = 0;
+}
+
+static int init_lanes(spool_t *spool, const settings_t *settings)
+{
+    spool->lanes_count = NULL == spool->storage->place
+        ? 1 : settings->maildir_roots_count;
+    spool->lanes = calloc(spool->lanes_count, sizeof(spool_lane_t));
+
+    if (NULL == spool->lanes) {
+        CALL_ERR_ARGS("calloc", "%lu", spool->lanes_count);
+        return -1;
+    }
+
+    for (size_t i = 0; i < spool->lanes_count; ++i) {
+        spool_lane_t *lane = &spool->lanes[i];
+
+        TAILQ_INIT(&lane->commit_queue);
+        TAILQ_INIT(&lane->flushing_queue);
+        timerclear(&lane->__commit_queue_time);
+        lane->commit_flush_generation = 0;
+        lane->queued_size = 0;
+
+        if (helper_pool_init(&lane->helper_pool,
+                settings->helper_threads_count) < 0) {
+            destroy_lanes(spool, i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int spool_init(spool_t *spool, const settings_t *settings)
+{
+    spool->settings = settings;
+    spool->__write_latency = 0;
+    spool->__is_nowait_supported = 1;
+    timerclear(&spool->__sync_write_retry_time);
+    spool->__commit_generation = 0;
+    spool->unpersisted_size = 0;
+    spool->__is_flow_stopped = 0;
+    spool->dedup_index = NULL;
+    spool->compressor_pool = NULL;
+    spool->delivery_index = NULL;
+    spool->notifier = NULL;
+    spool->quota_table = NULL;
+    TAILQ_INIT(&spool->cancelled_writes);
+
+    spool->storage = storage_backend(settings->storage);
+    spool->storage_state = NULL;
+
+    if (NULL != spool->storage->init
+            && spool->storage->init(&spool->storage_state, settings) < 0) {
+        return -1;
+    }
+
+    if (init_lanes(spool, settings) < 0) {
+        destroy_storage(spool);
+        return -1;
+    }
+
+    if (open_splice_pipe(spool) < 0) {
+        destroy_lanes(spool, spool->lanes_count);
+        destroy_storage(spool);
+        return -1;
+    }
+
+    if (init_dedup_index(spool, settings) < 0
+            || init_compressor_pool(spool, settings) < 0
+            || init_delivery_index(spool, settings) < 0
+            || init_notifier(spool, settings) < 0
+            || init_quota_table(spool, settings) < 0) {
+        destroy_notifier(spool);
+        destroy_delivery_index(spool);
+        destroy_compressor_pool(spool);
+        destroy_dedup_index(spool);
+        close_splice_pipe(spool);
+        destroy_lanes(spool, spool->lanes_count);
+        destroy_storage(spool);
+        return -1;
+    }
+
+    return 0;
+}
+
+void spool_destroy(spool_t *spool)
+{
+    destroy_quota_table(spool);
+    destroy_notifier(spool);
+    destroy_delivery_index(spool);
+    destroy_compressor_pool(spool);
+    destroy_dedup_index(spool);
+    close_splice_pipe(spool);
+    destroy_lanes(spool, spool->lanes_count);
+    destroy_storage(spool);
+}
+
+void spool_tick(spool_t *spool)
+{
+    if (NULL != spool->storage->tick) {
+        spool->storage->tick(spool->storage_state);
+    }
+
+    if (NULL != spool->quota_table) {
+        quota_table_reconcile(spool->quota_table);
+    }
+}
+
+int spool_is_sync_write(const spool_t *spool, const size_t size)
+{
+    if (size > spool->settings->sync_write_max_size) {
+        return 0;
+    }
+
+    if (spool->__write_latency <= spool->settings->sync_write_max_latency) {
+        return 1;
+    }
+
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return 0;
+    }
+
+    return timercmp(&current_time, &spool->__sync_write_retry_time, >);
+}
+
+void spool_start_commit_queue(spool_lane_t *lane)
+{
+    if (gettimeofday(&lane->__commit_queue_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        timerclear(&lane->__commit_queue_time);
+    }
+}
+
+int spool_lane_commit_timeout(const spool_t *spool, spool_lane_t *lane,
+    const int timeout)
+{
+    if (TAILQ_EMPTY(&lane->commit_queue)
+            || helper_pool_is_pending(&lane->helper_pool, &lane->commit_flush_job)) {
+        return timeout;
+    }
+
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return 0;
+    }
+
+    const long long left = spool->settings->group_commit_interval
+        - mtimeval_diff(&lane->__commit_queue_time, &current_time);
+
+    if (left <= 0) {
+        return 0;
+    }
+
+    return left < timeout ? left : timeout;
+}
+
+int spool_commit_queue_timeout(spool_t *spool, const int timeout)
+{
+    int result = timeout;
+
+    for (size_t i = 0; i < spool->lanes_count; ++i) {
+        result = spool_lane_commit_timeout(spool, &spool->lanes[i], result);
+    }
+
+    return result;
+}
+
+unsigned long spool_next_commit_generation(spool_t *spool)
+{
+    return ++spool->__commit_generation;
+}
+
+static void update_write_latency(spool_t *spool, struct timeval *begin,
+    struct timeval *end)
+{
+    const long long latency = utimeval_diff(begin, end);
+
+    if (spool->__write_latency > spool->settings->sync_write_max_latency) {
+        spool->__write_latency = latency;
+    } else {
+        spool->__write_latency += (latency - spool->__write_latency)
+            / WRITE_LATENCY_WEIGHT;
+    }
+
+    if (spool->__write_latency > spool->settings->sync_write_max_latency) {
+        const struct timeval interval = {
+            .tv_sec = SYNC_WRITE_RETRY_INTERVAL / 1000,
+            .tv_usec = SYNC_WRITE_RETRY_INTERVAL % 1000 * 1000
+        };
+
+        timeradd(end, &interval, &spool->__sync_write_retry_time);
+    }
+}
+
+ssize_t spool_sync_write(spool_t *spool, const int fd, const void *data,
+    const size_t size, const off_t offset)
+{
+    struct iovec iov = {
+        .iov_base = (void *) data,
+        .iov_len = size
+    };
+
+    struct timeval begin;
+
+    if (gettimeofday(&begin, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    ssize_t written = -1;
+
+#ifdef RWF_NOWAIT
+    if (spool->__is_nowait_supported) {
+        written = pwritev2(fd, &iov, 1, offset, RWF_NOWAIT);
+
+        if (written < 0) {
+            if (EAGAIN == errno) {
+                return 0;
+            }
+
+            if (EOPNOTSUPP != errno) {
+                CALL_ERR_ARGS("pwritev2", "%d, %lu, %ld", fd, size, offset);
+                return -1;
+            }
+
+            spool->__is_nowait_supported = 0;
+        }
+    }
+#endif
+
+    if (written < 0) {
+        written = pwritev(fd, &iov, 1, offset);
+
+        if (written < 0) {
+            CALL_ERR_ARGS("pwritev", "%d, %lu, %ld", fd, size, offset);
+            return -1;
+        }
+    }
+
+    struct timeval end;
+
+    if (gettimeofday(&end, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    update_write_latency(spool, &begin, &end);
+
+    return written;
+}
+
+void spool_account_unpersisted(spool_t *spool, const size_t released,
+    const size_t added)
+{
+    const size_t high_watermark = spool->settings->flow_control_high_watermark;
+    const size_t low_watermark = spool->settings->flow_control_low_watermark;
+
+    spool->unpersisted_size = spool->unpersisted_size - released + added;
+
+    if (0 == high_watermark) {
+        spool->__is_flow_stopped = 0;
+    } else if (spool->unpersisted_size >= high_watermark) {
+        spool->__is_flow_stopped = 1;
+    } else if (spool->unpersisted_size <= low_watermark) {
+        spool->__is_flow_stopped = 0;
+    }
+}
+
+int spool_is_flow_stopped(const spool_t *spool)
+{
+    return spool->__is_flow_stopped;
+}
+
+static int drain_splice_pipe(spool_t *spool, const int fd, size_t size,
+    off_t offset)
+{
+    while (size > 0) {
+        const ssize_t written = splice(spool->__splice_pipe[0], NULL, fd,
+            &offset, size, SPLICE_F_MOVE);
+
+        if (written <= 0) {
+            CALL_ERR_ARGS("splice", "%d, %lu, %ld", fd, size, offset);
+            close_splice_pipe(spool);
+            open_splice_pipe(spool);
+            return -1;
+        }
+
+        size -= written;
+    }
+
+    return 0;
+}
+
+size_t spool_splice_size(const spool_t *spool, const size_t size)
+{
+    const size_t max_size = MIN((size_t) spool->settings->sync_write_max_size,
+        spool->__splice_pipe_size);
+
+    return MIN(size, max_size);
+}
+
+static int drain_timed_splice_pipe(spool_t *spool, const int fd,
+    const size_t size, const off_t offset)
+{
+    struct timeval begin;
+
+    if (gettimeofday(&begin, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    if (drain_splice_pipe(spool, fd, size, offset) < 0) {
+        return -1;
+    }
+
+    struct timeval end;
+
+    if (gettimeofday(&end, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
+
+    update_write_latency(spool, &begin, &end);
+
+    return 0;
+}
+
+ssize_t spool_splice(spool_t *spool, const int in_fd, const int out_fd,
+    const size_t size, const off_t offset)
+{
+    if (-1 == spool->__splice_pipe[0] && open_splice_pipe(spool) < 0) {
+        return -1;
+    }
+
+    size_t spliced = 0;
+
+    while (spliced < size) {
+        const ssize_t received = splice(in_fd, NULL, spool->__splice_pipe[1],
+            NULL, MIN(size - spliced, spool->__splice_pipe_size),
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (received < 0) {
+            if (EAGAIN == errno && spliced > 0) {
+                break;
+            }
+
+            if (EAGAIN != errno) {
+                CALL_ERR_ARGS("splice", "%d, %lu", in_fd, size - spliced);
+            }
+
+            return -1;
+        }
+
+        if (0 == received) {
+            break;
+        }
+
+        if (drain_timed_splice_pipe(spool, out_fd, received, offset + spliced) < 0) {
+            return -1;
+        }
+
+        spliced += received;
+    }
+
+    return spliced;
+}
@@ -0,0 +1,73 @@
+#ifndef SMTP_SERVER_SPOOL_H
+#define SMTP_SERVER_SPOOL_H
+
+#include <bsd/sys/queue.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "compressor.h"
+#include "dedup.h"
+#include "delivery_index.h"
+#include "helper_pool.h"
+#include "notifier.h"
+#include "quota.h"
+#include "settings.h"
+#include "storage.h"
+
+struct transaction;
+struct cancelled_write;
+
+typedef TAILQ_HEAD(commit_queue, transaction) commit_queue_t;
+typedef TAILQ_HEAD(cancelled_write_queue, cancelled_write) cancelled_write_queue_t;
+
+typedef struct spool_lane {
+    helper_pool_t helper_pool;
+    commit_queue_t commit_queue;
+    commit_queue_t flushing_queue;
+    helper_job_t commit_flush_job;
+    unsigned long commit_flush_generation;
+    struct timeval __commit_queue_time;
+    size_t queued_size;
+} spool_lane_t;
+
+typedef struct spool {
+    const settings_t *settings;
+    long long __write_latency;
+    int __is_nowait_supported;
+    struct timeval __sync_write_retry_time;
+    const storage_backend_t *storage;
+    void *storage_state;
+    spool_lane_t *lanes;
+    size_t lanes_count;
+    unsigned long __commit_generation;
+    int __splice_pipe[2];
+    size_t __splice_pipe_size;
+    size_t unpersisted_size;
+    int __is_flow_stopped;
+    dedup_index_t *dedup_index;
+    compressor_pool_t *compressor_pool;
+    delivery_index_t *delivery_index;
+    notifier_t *notifier;
+    quota_table_t *quota_table;
+    cancelled_write_queue_t cancelled_writes;
+} spool_t;
+
+int spool_init(spool_t *spool, const settings_t *settings);
+void spool_destroy(spool_t *spool);
+void spool_tick(spool_t *spool);
+int spool_is_sync_write(const spool_t *spool, const size_t size);
+void spool_start_commit_queue(spool_lane_t *lane);
+int spool_lane_commit_timeout(const spool_t *spool, spool_lane_t *lane,
+    const int timeout);
+int spool_commit_queue_timeout(spool_t *spool, const int timeout);
+unsigned long spool_next_commit_generation(spool_t *spool);
+ssize_t spool_sync_write(spool_t *spool, const int fd, const void *data,
+    const size_t size, const off_t offset);
+void spool_account_unpersisted(spool_t *spool, const size_t released,
+    const size_t added);
+int spool_is_flow_stopped(const spool_t *spool);
+size_t spool_splice_size(const spool_t *spool, const size_t size);
+ssize_t spool_splice(spool_t *spool, const int in_fd, const int out_fd,
+    const size_t size, const off_t offset);
+
+#endif
@@ -0,0 +1,18 @@
+#include "storage.h"
+
+const storage_backend_t *storage_backend(const storage_t storage)
+{
+    switch (storage) {
+        case STORAGE_SEGMENT:
+            return &storage_segment;
+        case STORAGE_JOURNAL:
+            return &storage_journal;
+        case STORAGE_MEMORY:
+            return &storage_memory;
+        case STORAGE_NULL:
+            return &storage_null;
+        case STORAGE_MAILDIR:
+        default:
+            return &storage_maildir;
+    }
+}
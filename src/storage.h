@@ -0,0 +1,49 @@
+#ifndef SMTP_SERVER_STORAGE_H
+#define SMTP_SERVER_STORAGE_H
+
+#include <sys/types.h>
+
+#include "settings.h"
+
+struct transaction;
+struct recipient;
+
+typedef enum storage_write_mode {
+    STORAGE_WRITE_FILE,
+    STORAGE_WRITE_MEMORY,
+    STORAGE_WRITE_DISCARD
+} storage_write_mode_t;
+
+typedef struct storage_backend {
+    const char *name;
+    storage_write_mode_t write_mode;
+    int (*init)(void **state, const settings_t *settings);
+    void (*destroy)(void *state);
+    void (*tick)(void *state);
+    int (*place)(struct transaction *transaction, struct recipient *recipient);
+    int (*begin)(struct transaction *transaction);
+    int (*append)(struct transaction *transaction, const char *data,
+        const size_t size);
+    int (*sync)(struct transaction *transaction,
+        const unsigned long generation);
+    int (*commit)(struct transaction *transaction);
+    int (*clone)(struct transaction *transaction, struct recipient *recipient);
+    int (*sync_recipient)(struct transaction *transaction,
+        struct recipient *recipient, const unsigned long generation);
+    void (*drop_cache)(struct transaction *transaction, const size_t size);
+    void (*rollback)(struct transaction *transaction);
+    void (*retract)(struct transaction *transaction,
+        struct recipient *recipient);
+    void (*release)(struct transaction *transaction,
+        struct recipient *recipient);
+} storage_backend_t;
+
+extern const storage_backend_t storage_maildir;
+extern const storage_backend_t storage_segment;
+extern const storage_backend_t storage_journal;
+extern const storage_backend_t storage_memory;
+extern const storage_backend_t storage_null;
+
+const storage_backend_t *storage_backend(const storage_t storage);
+
+#endif
@@ -0,0 +1,80 @@
+#include "journal.h"
+#include "log.h"
+#include "storage.h"
+#include "transaction.h"
+
+static int init_journal_storage(void **state, const settings_t *settings)
+{
+    journal_t *journal = malloc(sizeof(journal_t));
+
+    if (NULL == journal) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(journal_t));
+        return -1;
+    }
+
+    if (journal_init(journal, settings) < 0) {
+        free(journal);
+        return -1;
+    }
+
+    *state = journal;
+
+    return 0;
+}
+
+static void destroy_journal_storage(void *state)
+{
+    journal_destroy(state);
+    free(state);
+}
+
+static void tick_journal(void *state)
+{
+    journal_tick(state);
+}
+
+static int append_journal(transaction_t *transaction, const char *data,
+    const size_t size)
+{
+    size_t recipients_count;
+    size_t recipients_size;
+    char *recipients = transaction_pack_recipients(transaction,
+        &recipients_count, &recipients_size);
+
+    if (NULL == recipients) {
+        return -1;
+    }
+
+    const int result = journal_append(transaction->spool->storage_state,
+        transaction_data_filename(transaction), recipients, recipients_count,
+        recipients_size, data, size);
+
+    free(recipients);
+
+    return result;
+}
+
+static int sync_journal(transaction_t *transaction,
+    const unsigned long generation)
+{
+    return journal_sync(transaction->spool->storage_state, generation);
+}
+
+const storage_backend_t storage_journal = {
+    .name = "journal",
+    .write_mode = STORAGE_WRITE_MEMORY,
+    .init = init_journal_storage,
+    .destroy = destroy_journal_storage,
+    .tick = tick_journal,
+    .place = NULL,
+    .begin = NULL,
+    .append = append_journal,
+    .sync = sync_journal,
+    .commit = NULL,
+    .clone = NULL,
+    .sync_recipient = NULL,
+    .drop_cache = NULL,
+    .rollback = NULL,
+    .retract = NULL,
+    .release = NULL
+};
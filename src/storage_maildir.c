@@ -0,0 +1,409 @@
+#include "intent_log.h"
+#include "log.h"
+#include "maildir_cache.h"
+#include "storage.h"
+#include "transaction.h"
+
+typedef struct maildir_storage {
+    maildir_cache_t cache;
+    intent_log_t intent_log;
+} maildir_storage_t;
+
+static maildir_cache_t *get_cache(const transaction_t *transaction)
+{
+    return &((maildir_storage_t *) transaction->spool->storage_state)->cache;
+}
+
+static intent_log_t *get_intent_log(const transaction_t *transaction)
+{
+    return &((maildir_storage_t *) transaction->spool->storage_state)->intent_log;
+}
+
+static int least_loaded_root(const transaction_t *transaction,
+    const char *address)
+{
+    const settings_t *settings = transaction->settings;
+    const spool_lane_t *lanes = transaction->spool->lanes;
+    int best_root = maildir_cache_hash_root(get_cache(transaction), address);
+
+    for (size_t i = 0; i < settings->maildir_roots_count; ++i) {
+        if (lanes[i].queued_size * settings->maildir_roots[best_root].weight
+                < lanes[best_root].queued_size * settings->maildir_roots[i].weight) {
+            best_root = i;
+        }
+    }
+
+    return best_root;
+}
+
+static int remembered_root(transaction_t *transaction, const char *address)
+{
+    maildir_cache_t *cache = get_cache(transaction);
+    const int root = maildir_cache_find_root(cache, address);
+
+    return root >= 0 ? root : maildir_cache_remembered_root(cache, address);
+}
+
+static int place_mailbox(transaction_t *transaction, recipient_t *recipient)
+{
+    const int root = remembered_root(transaction, recipient->address);
+
+    if (root >= 0) {
+        return root;
+    }
+
+    const int existing = maildir_cache_existing_root(get_cache(transaction),
+        recipient->address);
+
+    if (existing >= 0) {
+        return existing;
+    }
+
+    if (transaction_first_recipient(transaction) == recipient) {
+        return transaction_lane_root(transaction);
+    }
+
+    return least_loaded_root(transaction, recipient->address);
+}
+
+static int resolve_root(transaction_t *transaction, recipient_t *recipient)
+{
+    const settings_t *settings = transaction->settings;
+
+    if (recipient->root >= 0) {
+        return recipient->root;
+    }
+
+    if (1 == settings->maildir_roots_count) {
+        recipient->root = 0;
+        return recipient->root;
+    }
+
+    switch (settings->maildir_placement) {
+        case MAILDIR_PLACEMENT_DOMAIN:
+            recipient->root = maildir_cache_hash_root(get_cache(transaction),
+                transaction_recipient_domain(recipient));
+            break;
+        case MAILDIR_PLACEMENT_MAILBOX:
+            recipient->root = maildir_cache_hash_root(get_cache(transaction),
+                recipient->address);
+            break;
+        case MAILDIR_PLACEMENT_LEAST_LOADED:
+            recipient->root = place_mailbox(transaction, recipient);
+            break;
+    }
+
+    return recipient->root;
+}
+
+static int place_recipient(transaction_t *transaction, recipient_t *recipient)
+{
+    if (recipient->root >= 0 || 1 == transaction->settings->maildir_roots_count
+            || MAILDIR_PLACEMENT_LEAST_LOADED != transaction->settings->maildir_placement) {
+        return resolve_root(transaction, recipient);
+    }
+
+    const int root = remembered_root(transaction, recipient->address);
+
+    if (root >= 0) {
+        recipient->root = root;
+        return recipient->root;
+    }
+
+    return least_loaded_root(transaction, recipient->address);
+}
+
+static maildir_t *acquire_maildir(transaction_t *transaction,
+    recipient_t *recipient)
+{
+    if (NULL == recipient->maildir) {
+        recipient->maildir = maildir_cache_get(get_cache(transaction),
+            recipient->address, resolve_root(transaction, recipient));
+    }
+
+    return recipient->maildir;
+}
+
+static void release_maildir(transaction_t *transaction, recipient_t *recipient)
+{
+    if (NULL != recipient->maildir) {
+        maildir_cache_release(get_cache(transaction), recipient->maildir);
+        recipient->maildir = NULL;
+    }
+}
+
+static maildir_t *reacquire_stale_maildir(transaction_t *transaction,
+    recipient_t *recipient)
+{
+    if (!maildir_is_stale(recipient->maildir)) {
+        return NULL;
+    }
+
+    maildir_cache_invalidate(get_cache(transaction), recipient->maildir);
+    release_maildir(transaction, recipient);
+
+    return acquire_maildir(transaction, recipient);
+}
+
+static int init_maildir_storage(void **state, const settings_t *settings)
+{
+    maildir_storage_t *storage = malloc(sizeof(maildir_storage_t));
+
+    if (NULL == storage) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(maildir_storage_t));
+        return -1;
+    }
+
+    if (maildir_cache_init(&storage->cache, settings->maildir_roots,
+            settings->maildir_roots_count, settings->maildir_shard_width,
+            settings->maildir_cache_size) < 0) {
+        free(storage);
+        return -1;
+    }
+
+    if (intent_log_init(&storage->intent_log, settings->intent_log_dir,
+            settings->intent_log_slots) < 0) {
+        maildir_cache_destroy(&storage->cache);
+        free(storage);
+        return -1;
+    }
+
+    *state = storage;
+
+    return 0;
+}
+
+static void destroy_maildir_storage(void *state)
+{
+    maildir_storage_t *storage = state;
+
+    intent_log_destroy(&storage->intent_log);
+    maildir_cache_destroy(&storage->cache);
+    free(storage);
+}
+
+static int preallocate_file(transaction_t *transaction,
+    const maildir_t *maildir, const int fd)
+{
+    if (fd >= 0) {
+        maildir_preallocate_file(maildir, fd,
+            transaction_expected_size(transaction));
+    }
+
+    return fd;
+}
+
+static int track_file(transaction_t *transaction, const maildir_t *maildir)
+{
+    return intent_log_add(get_intent_log(transaction),
+        transaction_intent_slot(transaction), maildir_path(maildir),
+        transaction_data_filename(transaction));
+}
+
+static int create_file(transaction_t *transaction, const maildir_t *maildir)
+{
+    if (!maildir_is_tmpfile_supported(maildir) && track_file(transaction, maildir) < 0) {
+        return -1;
+    }
+
+    const char *filename = transaction_data_filename(transaction);
+    int is_tmpfile = 0;
+    int fd = maildir_create_file(maildir, filename, &is_tmpfile);
+
+    transaction_set_tmpfile(transaction, is_tmpfile);
+
+    if (fd >= 0 && !is_tmpfile && track_file(transaction, maildir) < 0) {
+        if (close(fd) < 0) {
+            CALL_ERR("close");
+        }
+
+        maildir_remove_file(maildir, filename);
+        fd = -1;
+    }
+
+    if (fd < 0 || is_tmpfile) {
+        intent_log_clear(get_intent_log(transaction),
+            transaction_intent_slot(transaction));
+    }
+
+    return fd;
+}
+
+static int begin_file(transaction_t *transaction)
+{
+    recipient_t *recipient = transaction_first_recipient(transaction);
+    maildir_t *maildir = acquire_maildir(transaction, recipient);
+
+    if (NULL == maildir) {
+        return -1;
+    }
+
+    const int fd = create_file(transaction, maildir);
+
+    if (fd >= 0) {
+        return preallocate_file(transaction, maildir, fd);
+    }
+
+    maildir = reacquire_stale_maildir(transaction, recipient);
+
+    if (NULL == maildir) {
+        return -1;
+    }
+
+    return preallocate_file(transaction, maildir,
+        create_file(transaction, maildir));
+}
+
+static int sync_file(transaction_t *transaction,
+    const unsigned long generation)
+{
+    if (fdatasync(transaction_data_fd(transaction)) < 0) {
+        CALL_ERR("fdatasync");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int commit_file(transaction_t *transaction)
+{
+    recipient_t *recipient = transaction_first_recipient(transaction);
+    const char *filename = transaction_data_filename(transaction);
+
+    if (!transaction_is_tmpfile(transaction)) {
+        if (maildir_move_to_new(recipient->maildir, filename) < 0) {
+            return -1;
+        }
+
+        intent_log_clear(get_intent_log(transaction),
+            transaction_intent_slot(transaction));
+
+        return 0;
+    }
+
+    const int fd = transaction_data_fd(transaction);
+
+    if (maildir_link_to_new(recipient->maildir, fd, filename) == 0) {
+        return 0;
+    }
+
+    maildir_t *maildir = reacquire_stale_maildir(transaction, recipient);
+
+    if (NULL == maildir) {
+        return -1;
+    }
+
+    return maildir_link_to_new(maildir, fd, filename);
+}
+
+static const maildir_t *clone_source(const transaction_t *transaction,
+    const recipient_t *recipient)
+{
+    const recipient_t *source = transaction_copy_source(transaction);
+
+    if (NULL != source && strcmp(transaction_recipient_domain(source),
+            transaction_recipient_domain(recipient)) == 0) {
+        return source->maildir;
+    }
+
+    return transaction_first_recipient(transaction)->maildir;
+}
+
+static int clone_tracked_file(transaction_t *transaction,
+    const maildir_t *src, const maildir_t *dst, recipient_t *recipient)
+{
+    intent_log_t *intent_log = get_intent_log(transaction);
+    const char *filename = transaction_data_filename(transaction);
+    int intent_slot = -1;
+
+    if (!maildir_is_tmpfile_supported(dst) && intent_log_add(intent_log,
+            &intent_slot, maildir_path(dst), filename) < 0) {
+        return -1;
+    }
+
+    const int result = maildir_clone_file(src, dst, filename,
+        DURABILITY_NONE != transaction->settings->durability,
+        &recipient->clone_method);
+
+    intent_log_clear(intent_log, &intent_slot);
+
+    return result;
+}
+
+static int clone_file(transaction_t *transaction, recipient_t *recipient)
+{
+    const maildir_t *src = clone_source(transaction, recipient);
+    maildir_t *dst = acquire_maildir(transaction, recipient);
+
+    if (NULL == dst) {
+        return -1;
+    }
+
+    if (clone_tracked_file(transaction, src, dst, recipient) == 0) {
+        return 0;
+    }
+
+    dst = reacquire_stale_maildir(transaction, recipient);
+
+    if (NULL == dst) {
+        return -1;
+    }
+
+    return clone_tracked_file(transaction, src, dst, recipient);
+}
+
+static int sync_recipient_dir(transaction_t *transaction,
+    recipient_t *recipient, const unsigned long generation)
+{
+    return maildir_sync_new(recipient->maildir, generation);
+}
+
+static void drop_file_cache(transaction_t *transaction, const size_t size)
+{
+    const settings_t *settings = transaction->settings;
+    const int min_size = settings->maildir_drop_cache_min_size;
+
+    if (DURABILITY_NONE == settings->durability || min_size <= 0
+            || size < (size_t) min_size) {
+        return;
+    }
+
+    maildir_drop_file_cache(transaction_data_fd(transaction));
+}
+
+static void rollback_file(transaction_t *transaction)
+{
+    if (transaction_is_tmpfile(transaction)) {
+        return;
+    }
+
+    maildir_remove_file(transaction_first_recipient(transaction)->maildir,
+        transaction_data_filename(transaction));
+    intent_log_clear(get_intent_log(transaction),
+        transaction_intent_slot(transaction));
+}
+
+static void retract_file(transaction_t *transaction, recipient_t *recipient)
+{
+    maildir_remove_new_file(recipient->maildir,
+        transaction_data_filename(transaction));
+}
+
+const storage_backend_t storage_maildir = {
+    .name = "maildir",
+    .write_mode = STORAGE_WRITE_FILE,
+    .init = init_maildir_storage,
+    .destroy = destroy_maildir_storage,
+    .tick = NULL,
+    .place = place_recipient,
+    .begin = begin_file,
+    .append = NULL,
+    .sync = sync_file,
+    .commit = commit_file,
+    .clone = clone_file,
+    .sync_recipient = sync_recipient_dir,
+    .drop_cache = drop_file_cache,
+    .rollback = rollback_file,
+    .retract = retract_file,
+    .release = release_maildir
+};
@@ -0,0 +1,162 @@
+#include <bsd/sys/queue.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "storage.h"
+#include "transaction.h"
+
+typedef struct memory_message {
+    const char *id;
+    const char *recipients;
+    size_t recipients_count;
+    const char *data;
+    size_t size;
+    size_t __allocated;
+    TAILQ_ENTRY(memory_message) __entry;
+} memory_message_t;
+
+typedef TAILQ_HEAD(memory_message_queue, memory_message) memory_message_queue_t;
+
+typedef struct memory_store {
+    size_t __capacity;
+    size_t __size;
+    memory_message_queue_t __messages;
+    pthread_mutex_t __mutex;
+} memory_store_t;
+
+static int init_memory_storage(void **state, const settings_t *settings)
+{
+    memory_store_t *store = malloc(sizeof(memory_store_t));
+
+    if (NULL == store) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(memory_store_t));
+        return -1;
+    }
+
+    const int error = pthread_mutex_init(&store->__mutex, NULL);
+
+    if (error != 0) {
+        errno = error;
+        CALL_ERR("pthread_mutex_init");
+        free(store);
+        return -1;
+    }
+
+    store->__capacity = settings->memory_storage_size;
+    store->__size = 0;
+    TAILQ_INIT(&store->__messages);
+
+    *state = store;
+
+    return 0;
+}
+
+static void evict_message(memory_store_t *store)
+{
+    memory_message_t *message = TAILQ_FIRST(&store->__messages);
+
+    TAILQ_REMOVE(&store->__messages, message, __entry);
+    store->__size -= message->__allocated;
+    free(message);
+}
+
+static void destroy_memory_storage(void *state)
+{
+    memory_store_t *store = state;
+
+    while (!TAILQ_EMPTY(&store->__messages)) {
+        evict_message(store);
+    }
+
+    pthread_mutex_destroy(&store->__mutex);
+    free(store);
+}
+
+static memory_message_t *create_message(const char *id,
+    const char *recipients, const size_t recipients_count,
+    const size_t recipients_size, const char *data, const size_t size)
+{
+    const size_t id_size = strlen(id) + 1;
+    const size_t allocated = sizeof(memory_message_t) + id_size
+        + recipients_size + size;
+    memory_message_t *message = malloc(allocated);
+
+    if (NULL == message) {
+        CALL_ERR_ARGS("malloc", "%lu", allocated);
+        return NULL;
+    }
+
+    char *position = (char *) (message + 1);
+
+    message->id = memcpy(position, id, id_size);
+    position += id_size;
+    message->recipients = memcpy(position, recipients, recipients_size);
+    message->recipients_count = recipients_count;
+    position += recipients_size;
+    message->data = memcpy(position, data, size);
+    message->size = size;
+    message->__allocated = allocated;
+
+    return message;
+}
+
+static int append_message(transaction_t *transaction, const char *data,
+    const size_t size)
+{
+    memory_store_t *store = transaction->spool->storage_state;
+    size_t recipients_count;
+    size_t recipients_size;
+    char *recipients = transaction_pack_recipients(transaction,
+        &recipients_count, &recipients_size);
+
+    if (NULL == recipients) {
+        return -1;
+    }
+
+    memory_message_t *message = create_message(
+        transaction_data_filename(transaction), recipients, recipients_count,
+        recipients_size, data, size);
+
+    free(recipients);
+
+    if (NULL == message) {
+        return -1;
+    }
+
+    if (message->__allocated > store->__capacity) {
+        free(message);
+        return 0;
+    }
+
+    pthread_mutex_lock(&store->__mutex);
+
+    while (store->__size + message->__allocated > store->__capacity) {
+        evict_message(store);
+    }
+
+    TAILQ_INSERT_TAIL(&store->__messages, message, __entry);
+    store->__size += message->__allocated;
+
+    pthread_mutex_unlock(&store->__mutex);
+
+    return 0;
+}
+
+const storage_backend_t storage_memory = {
+    .name = "memory",
+    .write_mode = STORAGE_WRITE_MEMORY,
+    .init = init_memory_storage,
+    .destroy = destroy_memory_storage,
+    .tick = NULL,
+    .place = NULL,
+    .begin = NULL,
+    .append = append_message,
+    .sync = NULL,
+    .commit = NULL,
+    .clone = NULL,
+    .sync_recipient = NULL,
+    .drop_cache = NULL,
+    .rollback = NULL,
+    .retract = NULL,
+    .release = NULL
+};
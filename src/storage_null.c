@@ -0,0 +1,22 @@
+#include <stddef.h>
+
+#include "storage.h"
+
+const storage_backend_t storage_null = {
+    .name = "null",
+    .write_mode = STORAGE_WRITE_DISCARD,
+    .init = NULL,
+    .destroy = NULL,
+    .tick = NULL,
+    .place = NULL,
+    .begin = NULL,
+    .append = NULL,
+    .sync = NULL,
+    .commit = NULL,
+    .clone = NULL,
+    .sync_recipient = NULL,
+    .drop_cache = NULL,
+    .rollback = NULL,
+    .retract = NULL,
+    .release = NULL
+};
@@ -0,0 +1,81 @@
+#include "log.h"
+#include "segment.h"
+#include "storage.h"
+#include "transaction.h"
+
+static int init_segment_storage(void **state, const settings_t *settings)
+{
+    segment_store_t *store = malloc(sizeof(segment_store_t));
+
+    if (NULL == store) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(segment_store_t));
+        return -1;
+    }
+
+    if (segment_store_init(store, settings->segment_dir,
+            settings->segment_max_size, settings->segment_rotate_interval) < 0) {
+        free(store);
+        return -1;
+    }
+
+    *state = store;
+
+    return 0;
+}
+
+static void destroy_segment_storage(void *state)
+{
+    segment_store_destroy(state);
+    free(state);
+}
+
+static void rotate_segment(void *state)
+{
+    segment_store_rotate_expired(state);
+}
+
+static int append_segment(transaction_t *transaction, const char *data,
+    const size_t size)
+{
+    size_t recipients_count;
+    size_t recipients_size;
+    char *recipients = transaction_pack_recipients(transaction,
+        &recipients_count, &recipients_size);
+
+    if (NULL == recipients) {
+        return -1;
+    }
+
+    const int result = segment_store_append(transaction->spool->storage_state,
+        transaction_data_filename(transaction), recipients, recipients_count,
+        recipients_size, data, size);
+
+    free(recipients);
+
+    return result;
+}
+
+static int sync_segment(transaction_t *transaction,
+    const unsigned long generation)
+{
+    return segment_store_sync(transaction->spool->storage_state, generation);
+}
+
+const storage_backend_t storage_segment = {
+    .name = "segment",
+    .write_mode = STORAGE_WRITE_MEMORY,
+    .init = init_segment_storage,
+    .destroy = destroy_segment_storage,
+    .tick = rotate_segment,
+    .place = NULL,
+    .begin = NULL,
+    .append = append_segment,
+    .sync = sync_segment,
+    .commit = NULL,
+    .clone = NULL,
+    .sync_recipient = NULL,
+    .drop_cache = NULL,
+    .rollback = NULL,
+    .retract = NULL,
+    .release = NULL
+};
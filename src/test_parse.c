@@ -121,6 +121,62 @@ static void test_parse_mail_empty_should_return_null()
     NEGATIVE_TEST("", parse_mail);
 }
 
+static void test_parse_mail_size_should_succeed()
+{
+    POSITIVE_TEST("mail from:<" ADDRESS "> SIZE=1024\r\n", parse_mail_size, "1024");
+}
+
+static void test_parse_mail_size_mixed_case_should_succeed()
+{
+    POSITIVE_TEST("MAIL FROM:<" ADDRESS "> sIzE=1024\r\n", parse_mail_size, "1024");
+}
+
+static void test_parse_mail_size_with_other_parameters_should_succeed()
+{
+    POSITIVE_TEST("mail from:<" ADDRESS "> BODY=8BITMIME SIZE=1024 SMTPUTF8\r\n",
+        parse_mail_size, "1024");
+}
+
+static void test_parse_mail_size_without_size_should_return_null()
+{
+    NEGATIVE_TEST("mail from:<" ADDRESS "> BODY=8BITMIME\r\n", parse_mail_size);
+}
+
+static void test_parse_mail_size_inside_reverse_path_should_return_null()
+{
+    NEGATIVE_TEST("mail from:<size=1024@" TEST_DOMAIN ">\r\n", parse_mail_size);
+}
+
+static void test_parse_mail_size_not_number_should_return_null()
+{
+    NEGATIVE_TEST("mail from:<" ADDRESS "> SIZE=big\r\n", parse_mail_size);
+}
+
+static void test_parse_bdat_should_succeed()
+{
+    POSITIVE_TEST("BDAT 1024\r\n", parse_bdat, "1024");
+}
+
+static void test_parse_bdat_last_should_succeed()
+{
+    POSITIVE_TEST("bdat 0 LAST\r\n", parse_bdat, "0");
+}
+
+static void test_parse_bdat_without_size_should_return_null()
+{
+    NEGATIVE_TEST("bdat last\r\n", parse_bdat);
+}
+
+static void test_parse_bdat_last_mixed_case_should_succeed()
+{
+    POSITIVE_TEST("BdAt 1024 LaSt\r\n", parse_bdat_last, "LaSt");
+}
+
+static void test_parse_bdat_last_without_last_should_return_null()
+{
+    NEGATIVE_TEST("bdat 1024\r\n", parse_bdat_last);
+}
+
 static void test_parse_rcpt_lower_case_should_succeed()
 {
     POSITIVE_TEST("rcpt to:<" ADDRESS ">\r\n", parse_rcpt, ADDRESS);
@@ -202,6 +258,21 @@ int main()
    ADD_TEST(parse_mail, test_parse_mail_without_crlf_should_return_null);
    ADD_TEST(parse_ehlo, test_parse_mail_empty_should_return_null);
 
+   INIT_SUITE(parse_mail_size);
+   ADD_TEST(parse_mail_size, test_parse_mail_size_should_succeed);
+   ADD_TEST(parse_mail_size, test_parse_mail_size_mixed_case_should_succeed);
+   ADD_TEST(parse_mail_size, test_parse_mail_size_with_other_parameters_should_succeed);
+   ADD_TEST(parse_mail_size, test_parse_mail_size_without_size_should_return_null);
+   ADD_TEST(parse_mail_size, test_parse_mail_size_inside_reverse_path_should_return_null);
+   ADD_TEST(parse_mail_size, test_parse_mail_size_not_number_should_return_null);
+
+   INIT_SUITE(parse_bdat);
+   ADD_TEST(parse_bdat, test_parse_bdat_should_succeed);
+   ADD_TEST(parse_bdat, test_parse_bdat_last_should_succeed);
+   ADD_TEST(parse_bdat, test_parse_bdat_without_size_should_return_null);
+   ADD_TEST(parse_bdat, test_parse_bdat_last_mixed_case_should_succeed);
+   ADD_TEST(parse_bdat, test_parse_bdat_last_without_last_should_return_null);
+
    INIT_SUITE(parse_rcpt);
    ADD_TEST(parse_rcpt, test_parse_rcpt_lower_case_should_succeed);
    ADD_TEST(parse_rcpt, test_parse_rcpt_upper_case_should_succeed);
@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <assert.h>
+#include <sys/param.h>
 
 #include "log.h"
 #include "protocol.h"
@@ -12,6 +13,11 @@ typedef enum write_status {
     WRITE_ERROR
 } write_status_t;
 
+#define INITIAL_SPOOL_SIZE 16384
+#define DECLARED_SPOOL_SIZE_MAX (16 * INITIAL_SPOOL_SIZE)
+#define BODY_HASH_OFFSET 14695981039346656037ULL
+#define BODY_HASH_PRIME 1099511628211ULL
+
 static void free_value(char **value)
 {
     if (*value != NULL) {
@@ -30,558 +36,2186 @@ static void free_reverse_path(transaction_t *transaction)
     free_value(&transaction->__reverse_path);
 }
 
-static void destroy_recipient_list(transaction_t *transaction)
+const char *transaction_recipient_domain(const recipient_t *recipient)
 {
-    recipient_list_entry_t *item, *temp;
-    LIST_FOREACH_SAFE(item, &transaction->__recipient_list, entry, temp) {
-        LIST_REMOVE(item, entry);
-        free(item->recipient.address);
-        free(item);
-    }
+    const char *delim = strchr(recipient->address, '@');
+
+    return NULL == delim ? "" : delim + 1;
 }
 
-static void abort_write(transaction_t *transaction)
+static int recipient_tree_entry_cmp(recipient_tree_entry_t *first,
+    recipient_tree_entry_t *second)
 {
-    if (close(transaction->__aiocb.aio_fildes) < 0) {
-        CALL_ERR("close")
+    const int domain_cmp = strcmp(transaction_recipient_domain(&first->recipient),
+        transaction_recipient_domain(&second->recipient));
+
+    if (domain_cmp != 0) {
+        return domain_cmp;
     }
 
-    transaction->__aiocb.aio_fildes = -1;
+    return strcmp(first->recipient.address, second->recipient.address);
+}
 
-    recipient_t *recipient = transaction->__first_recipient;
-    maildir_t *maildir = &recipient->maildir;
+RB_GENERATE_STATIC(recipient_tree, recipient_tree_entry, entry,
+    recipient_tree_entry_cmp)
 
-    maildir_remove_file(maildir, transaction->__data_filename);
+static const storage_backend_t *get_storage(const transaction_t *transaction)
+{
+    return transaction->spool->storage;
 }
 
-static int generate_filename(transaction_t *transaction)
+static void destroy_recipient_list(transaction_t *transaction)
 {
-    struct timeval timeval;
+    const storage_backend_t *storage = get_storage(transaction);
+    recipient_tree_entry_t *item, *temp;
+    RB_FOREACH_SAFE(item, recipient_tree, &transaction->__recipients, temp) {
+        RB_REMOVE(recipient_tree, &transaction->__recipients, item);
 
-    if (gettimeofday(&timeval, NULL) < 0) {
-        CALL_ERR("gettimeofday");
-        return -1;
-    }
-
-    const size_t max_len = sizeof(transaction->__data_filename) - 1;
-    char *name = transaction->__data_filename;
-    char hostname[256];
-
-    if (gethostname(hostname, sizeof(hostname) - 1) < 0) {
-        CALL_ERR("gethostname");
-        return -1;
-    }
+        if (NULL != storage->release) {
+            storage->release(transaction, &item->recipient);
+        }
 
-    if (snprintf(name, max_len, "%016lx_%016lx_%08x_%08x_%s.eml", timeval.tv_sec,
-            timeval.tv_usec, getpid(), rand(), hostname) < 0) {
-        CALL_ERR("snprintf");
-        return -1;
+        free(item->recipient.address);
+        free(item);
     }
-
-    return 0;
 }
 
-static int create_file(transaction_t *transaction)
+static int is_write_mode(const transaction_t *transaction,
+    const storage_write_mode_t mode)
 {
-    if (generate_filename(transaction) < 0) {
-        return -1;
-    }
-
-    recipient_t *recipient = transaction->__first_recipient;
-    maildir_t *maildir = &recipient->maildir;
-
-    if (maildir_init(maildir, transaction->settings->maildir,
-            recipient->address) < 0) {
-        return -1;
-    }
+    return mode == get_storage(transaction)->write_mode;
+}
 
-    return maildir_create_file(maildir, transaction->__data_filename);
+static int is_compression_enabled(const transaction_t *transaction)
+{
+    return NULL != transaction->spool->compressor_pool;
 }
 
-static int continue_dump_data(transaction_t *transaction, const char *value,
-    const size_t size)
+static int is_dedup_enabled(const transaction_t *transaction)
 {
-    transaction->__aiocb.aio_buf = (void *) value;
-    transaction->__aiocb.aio_offset += transaction->__aiocb.aio_nbytes;
-    transaction->__aiocb.aio_nbytes = size;
-    transaction->__aiocb.aio_lio_opcode = LIO_WRITE;
+    return NULL != transaction->spool->dedup_index
+        && !is_compression_enabled(transaction);
+}
 
-    if (aio_write(&transaction->__aiocb) < 0) {
-        CALL_ERR("aio_write")
-        return -1;
+static void release_compressor(transaction_t *transaction)
+{
+    if (NULL != transaction->__compressor) {
+        compressor_pool_release(transaction->spool->compressor_pool,
+            transaction->__compressor);
     }
 
-    return 0;
+    transaction->__compressor = NULL;
 }
 
-static int begin_dump_data(transaction_t *transaction, const char *value,
-    const size_t size)
+static uint64_t hash_body(uint64_t hash, const char *value, const size_t size)
 {
-    const int fd = create_file(transaction);
-
-    if (fd < 0) {
-        return -1;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (unsigned char) value[i]) * BODY_HASH_PRIME;
     }
 
-    transaction->__aiocb.aio_fildes = fd;
-    transaction->__aiocb.aio_offset = 0;
-    transaction->__aiocb.aio_nbytes = 0;
+    return hash;
+}
 
-    return continue_dump_data(transaction, value, size);
+static int is_spool_enabled(const transaction_t *transaction)
+{
+    return (transaction->settings->memory_spool_size > 0
+            && is_write_mode(transaction, STORAGE_WRITE_FILE))
+        || is_write_mode(transaction, STORAGE_WRITE_MEMORY);
 }
 
-static write_status_t get_write_status(transaction_t *transaction)
+static void yield(transaction_t *transaction)
 {
-    if (-1 == transaction->__aiocb.aio_fildes) {
-        return WRITE_NOT_STARTED;
+    if (sigqueue(getpid(), TRANSACTION_AIO_SIGNAL,
+            transaction->__aiocb.aio_sigevent.sigev_value) < 0) {
+        CALL_ERR("sigqueue");
     }
+}
 
-    switch (aio_error(&transaction->__aiocb)) {
-        case 0: {
-            if (NULL == transaction->__aiocb.aio_buf) {
-                return WRITE_DONE;
-            }
+static void run_job(helper_job_t *job);
 
-            const ssize_t result = aio_return(&transaction->__aiocb);
+static void submit_job(transaction_t *transaction,
+    const transaction_job_kind_t kind)
+{
+    transaction->__job_kind = kind;
+    transaction->__is_job_submitted = 1;
+    helper_pool_submit(&transaction->__lane->helper_pool, &transaction->__job);
+}
 
-            if (result < transaction->__aiocb.aio_nbytes) {
-                PRINT_STDERR("written %ld of %lu bytes", result, transaction->__aiocb.aio_nbytes);
-                return WRITE_ERROR;
-            }
+static int is_job_running(transaction_t *transaction,
+    const transaction_job_kind_t kind)
+{
+    return transaction->__is_job_submitted && kind == transaction->__job_kind
+        && helper_pool_is_pending(&transaction->__lane->helper_pool,
+            &transaction->__job);
+}
 
-            transaction->__aiocb.aio_buf = NULL;
+static void wait_job(transaction_t *transaction)
+{
+    if (!transaction->__is_job_submitted) {
+        return;
+    }
 
-            return WRITE_DONE;
-        }
+    helper_pool_wait(&transaction->__lane->helper_pool, &transaction->__job);
 
-        case EINPROGRESS:
-            return WRITE_WAIT;
+    transaction->__is_job_submitted = 0;
 
-        default:
-            PRINT_STDERR("error in aio_error: %s", strerror(aio_error(&transaction->__aiocb)));
-            return WRITE_ERROR;
+    if (TRANSACTION_JOB_CREATE == transaction->__job_kind
+            && transaction->__job_fd >= 0) {
+        transaction->__aiocb.aio_fildes = transaction->__job_fd;
+        transaction->__aiocb.aio_buf = NULL;
     }
+
+    transaction->__pending_value = NULL;
+    transaction->__pending_size = 0;
 }
 
-static void cancel_dump_data(transaction_t *transaction)
+static void complete_commit_flush(spool_lane_t *lane)
 {
-    switch (get_write_status(transaction)) {
-        case WRITE_NOT_STARTED:
-            break;
-
-        case WRITE_WAIT:
-            if (aio_cancel(transaction->__aiocb.aio_fildes, &transaction->__aiocb) < 0) {
-                CALL_ERR("aio_cancel");
-            }
+    transaction_t *transaction, *temp;
 
-        case WRITE_DONE:
-            abort_write(transaction);
-            break;
+    TAILQ_FOREACH_SAFE(transaction, &lane->flushing_queue, __commit_entry, temp) {
+        TAILQ_REMOVE(&lane->flushing_queue, transaction, __commit_entry);
+        transaction->__commit_queue = NULL;
 
-        default:
-            break;
+        yield(transaction);
     }
 }
 
-static transaction_status_t async_dump_data(transaction_t *transaction,
-    const char *value, const size_t size)
+static void enqueue_commit(transaction_t *transaction)
 {
-    switch (get_write_status(transaction)) {
-        case WRITE_NOT_STARTED:
-            if (begin_dump_data(transaction, value, size) < 0) {
-                return TRANSACTION_ERROR;
-            }
-            return TRANSACTION_DONE;
-
-        case WRITE_DONE:
-            if (continue_dump_data(transaction, value, size) < 0) {
-                return TRANSACTION_ERROR;
-            }
-            return TRANSACTION_DONE;
-
-        case WRITE_WAIT:
-            return TRANSACTION_WAIT;
+    spool_lane_t *lane = transaction->__lane;
 
-        default:
-            abort_write(transaction);
-            return TRANSACTION_ERROR;
+    if (TAILQ_EMPTY(&lane->commit_queue)) {
+        spool_start_commit_queue(lane);
     }
 
-    return 0;
+    TAILQ_INSERT_TAIL(&lane->commit_queue, transaction, __commit_entry);
+    transaction->__commit_queue = &lane->commit_queue;
 }
 
-static int end_write(transaction_t *transaction)
+static void dequeue_commit(transaction_t *transaction)
 {
-    if (close(transaction->__aiocb.aio_fildes) < 0) {
-        PRINT_STDERR("error close file: %s", transaction->__data_filename);
-        return -1;
+    spool_lane_t *lane = transaction->__lane;
+
+    if (NULL == transaction->__commit_queue) {
+        return;
     }
 
-    transaction->__aiocb.aio_fildes = -1;
+    if (&lane->commit_queue == transaction->__commit_queue) {
+        TAILQ_REMOVE(&lane->commit_queue, transaction, __commit_entry);
+        transaction->__commit_queue = NULL;
+        return;
+    }
 
-    return 0;
+    helper_pool_wait(&lane->helper_pool, &lane->commit_flush_job);
+    complete_commit_flush(lane);
 }
 
-static int get_hostname(const int sock, char *hostname, const size_t size,
-    int getname(int, struct sockaddr *, socklen_t *))
+static int is_commit_queued(transaction_t *transaction)
 {
-    struct sockaddr_in addr;
-    socklen_t addr_size = sizeof(addr);
+    spool_lane_t *lane = transaction->__lane;
 
-    if (getname(sock, (struct sockaddr *) &addr, &addr_size) < 0) {
-        CALL_ERR_ARGS("get*name", "%d", sock);
-        return -1;
+    if (NULL == transaction->__commit_queue) {
+        return 0;
     }
 
-    if (inet_ntop(AF_INET, &addr.sin_addr, hostname, size - 1) == NULL) {
-        CALL_ERR("inet_ntop");
-        return -1;
+    if (&lane->commit_queue == transaction->__commit_queue
+            || helper_pool_is_pending(&lane->helper_pool, &lane->commit_flush_job)) {
+        return 1;
     }
 
+    complete_commit_flush(lane);
+
     return 0;
 }
 
-static int get_local_hostname(const int sock, char *hostname, const size_t size)
+static int is_buffered_write(const transaction_t *transaction)
 {
-    return get_hostname(sock, hostname, size, getsockname);
+    return NULL != transaction->__write_buffers;
 }
 
-static int get_remote_hostname(const int sock, char *hostname, const size_t size)
+static size_t pending_buffers_size(const transaction_t *transaction)
 {
-    return get_hostname(sock, hostname, size, getpeername);
-}
+    const size_t count = transaction->settings->write_buffers_count;
+    size_t size = 0;
 
-static void free_header(transaction_t *transaction)
-{
-    if (transaction->__header != NULL) {
-        free(transaction->__header);
-        transaction->__header = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        if (transaction->__write_buffers[i].is_pending) {
+            size += transaction->__write_buffers[i].size;
+        }
     }
+
+    return size;
 }
 
-#define RETURN_PATH_HEADER "Return-path: <%s>" CRLF
+static void update_unpersisted(transaction_t *transaction)
+{
+    size_t size = 0;
+
+    if (transaction->__is_committing) {
+        size = transaction->__data_size;
+    } else if (is_buffered_write(transaction)) {
+        size = pending_buffers_size(transaction);
+    } else if (transaction->__aiocb.aio_fildes != -1
+            && NULL != transaction->__aiocb.aio_buf) {
+        size = transaction->__aiocb.aio_nbytes;
+    }
 
-#define RECIEVED_HEADER_FROM " from %s(%s)"
-#define RECIEVED_HEADER_BY " by %s(%s)"
-#define RECIEVED_HEADER_VIA " via %s"
-#define RECIEVED_HEADER_FOR " for <%s>"
-#define RECIEVED_HEADER_DATE "; %s"
-#define RECIEVED_HEADER "Received:" \
-    RECIEVED_HEADER_FROM \
-    RECIEVED_HEADER_BY \
-    RECIEVED_HEADER_VIA \
-    RECIEVED_HEADER_FOR \
-    RECIEVED_HEADER_DATE \
-    CRLF
+    spool_account_unpersisted(transaction->spool,
+        transaction->__unpersisted_size, size);
+    transaction->__lane->queued_size += size - transaction->__unpersisted_size;
+    transaction->__unpersisted_size = size;
+}
 
-static char *generate_header(transaction_t *transaction)
+static int is_write_buffer_pending(write_buffer_t *buffer)
 {
-    char from_tcp[100];
-    if (get_remote_hostname(transaction->__sock, from_tcp, sizeof(from_tcp)) < 0) {
-        return NULL;
+    if (!buffer->is_pending) {
+        return 0;
     }
 
-    char by_tcp[100];
-    if (get_local_hostname(transaction->__sock, by_tcp, sizeof(by_tcp)) < 0) {
-        return NULL;
+    if (EINPROGRESS == aio_error(&buffer->aiocb)) {
+        return 1;
     }
 
-    char by_domain[256];
-    if (gethostname(by_domain, sizeof(by_domain) - 1) < 0) {
-        CALL_ERR("gethostname");
-        return NULL;
-    }
+    aio_return(&buffer->aiocb);
+    buffer->is_pending = 0;
 
-    const char *from_domain = transaction->__domain ? transaction->__domain : "";
-    const char *return_path = transaction->__reverse_path;
-    static const char via[] = "SMTP";
-    const char *for_ = transaction->__first_recipient->address;
+    return 0;
+}
 
-    struct timeval timeval;
+static void wait_write_buffers(write_buffer_t *buffers, const size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const struct aiocb *list[] = {&buffers[i].aiocb};
 
-    if (gettimeofday(&timeval, NULL) < 0) {
-        CALL_ERR("gettimeofday");
-        return NULL;
+        while (is_write_buffer_pending(&buffers[i])) {
+            aio_suspend(list, 1, NULL);
+        }
     }
+}
 
-    struct tm *tm = localtime(&timeval.tv_sec);
-
-    if (NULL == tm) {
-        CALL_ERR("localtime");
-        return NULL;
+static void free_write_buffers(write_buffer_t *buffers, const size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        free(buffers[i].data);
     }
 
-    char date[32];
+    free(buffers);
+}
 
-    if (strftime(date, sizeof(date), "%a, %d %b %Y %T %z", tm) == 0) {
-        CALL_ERR("strftime");
-        return NULL;
-    }
+static size_t cancel_write_buffers(transaction_t *transaction)
+{
+    const size_t count = transaction->settings->write_buffers_count;
+    size_t pending_count = 0;
 
-    const size_t size = sizeof(RECIEVED_HEADER) + sizeof(RETURN_PATH_HEADER)
-        + strlen(return_path) + strlen(from_domain) + strlen(from_tcp)
-        + strlen(by_domain) + strlen(by_tcp) + sizeof(via) + strlen(for_)
-        + strlen(date);
-    char *header = malloc(size);
+    for (size_t i = 0; i < count; ++i) {
+        write_buffer_t *buffer = &transaction->__write_buffers[i];
 
-    if (NULL == header) {
-        CALL_ERR_ARGS("malloc", "%lu", size);
-        return NULL;
-    }
+        if (buffer->is_pending
+                && aio_cancel(buffer->aiocb.aio_fildes, &buffer->aiocb) < 0) {
+            CALL_ERR("aio_cancel");
+        }
 
-    if (snprintf(header, size, RETURN_PATH_HEADER RECIEVED_HEADER,
-            return_path, from_domain, from_tcp, by_domain, by_tcp, via, for_,
-            date) < 0) {
-        free(header);
-        CALL_ERR_ARGS("snprintf", "%s %lu %s %s %s %s %s %s %s %s",
-            RETURN_PATH_HEADER RECIEVED_HEADER, size, return_path, from_domain,
-            from_tcp, by_domain, by_tcp, via, for_, date);
-        return NULL;
+        pending_count += is_write_buffer_pending(buffer);
+        buffer->size = 0;
     }
 
-    return header;
+    transaction->__fill_index = 0;
+    transaction->__pending_value = NULL;
+    transaction->__pending_size = 0;
+
+    return pending_count;
 }
 
-int transaction_init(transaction_t *transaction, const settings_t *settings,
-    log_t *log, const int sock)
+static int init_write_buffers(transaction_t *transaction);
+
+static int defer_write_buffers(transaction_t *transaction)
 {
-    transaction->settings = settings;
-    transaction->log = log;
-    transaction->__sock = sock;
-    transaction->__domain = NULL;
-    transaction->__header = NULL;
-    transaction->__reverse_path = NULL;
-    transaction->__first_recipient = NULL;
-    LIST_INIT(&transaction->__recipient_list);
-    transaction->__is_active = 0;
+    const size_t count = transaction->settings->write_buffers_count;
+    cancelled_write_t *cancelled = malloc(sizeof(cancelled_write_t));
 
-    memset(&transaction->__aiocb, 0, sizeof(transaction->__aiocb));
+    if (NULL == cancelled) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(cancelled_write_t));
+        wait_write_buffers(transaction->__write_buffers, count);
+        return -1;
+    }
 
-    transaction->__aiocb.aio_fildes = -1;
+    cancelled->buffers = transaction->__write_buffers;
+    cancelled->count = count;
+    cancelled->fd = transaction->__aiocb.aio_fildes;
+    TAILQ_INSERT_TAIL(&transaction->spool->cancelled_writes, cancelled, entry);
 
-    memset(transaction->__data_filename, 0, sizeof(transaction->__data_filename));
+    init_write_buffers(transaction);
+    update_unpersisted(transaction);
 
     return 0;
 }
 
-void transaction_destroy(transaction_t *transaction)
+static void abort_write(transaction_t *transaction)
 {
-    cancel_dump_data(transaction);
-    free_header(transaction);
-    free_domain(transaction);
-    free_reverse_path(transaction);
-    destroy_recipient_list(transaction);
-}
-
-void transaction_rollback(transaction_t *transaction)
-{
-    cancel_dump_data(transaction);
-    free_header(transaction);
-    free_reverse_path(transaction);
-    destroy_recipient_list(transaction);
+    if (-1 == transaction->__aiocb.aio_fildes) {
+        return;
+    }
 
-    LIST_INIT(&transaction->__recipient_list);
+    if ((!is_buffered_write(transaction)
+                || 0 == cancel_write_buffers(transaction)
+                || defer_write_buffers(transaction) < 0)
+            && close(transaction->__aiocb.aio_fildes) < 0) {
+        CALL_ERR("close")
+    }
 
-    transaction_reset_data(transaction);
+    transaction->__aiocb.aio_fildes = -1;
 
-    transaction->__is_active = 0;
+    if (NULL != get_storage(transaction)->rollback) {
+        get_storage(transaction)->rollback(transaction);
+    }
 }
 
-static int set_value(char **dst, const char *value, const size_t length)
+static __thread unsigned int filename_seed;
+
+static int generate_filename(transaction_t *transaction)
 {
-    assert(NULL == *dst);
+    struct timeval timeval;
 
-    char *copy = malloc(length + 1);
+    if (gettimeofday(&timeval, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return -1;
+    }
 
-    if (NULL == copy) {
-        CALL_ERR_ARGS("malloc", "%lu", length + 1);
+    const size_t max_len = sizeof(transaction->__data_filename) - 1;
+    char *name = transaction->__data_filename;
+    char hostname[256];
+
+    if (gethostname(hostname, sizeof(hostname) - 1) < 0) {
+        CALL_ERR("gethostname");
         return -1;
     }
 
-    memcpy(copy, value, length);
-    copy[length] = '\0';
-    *dst = copy;
+    if (0 == filename_seed) {
+        filename_seed = (unsigned int) timeval.tv_usec ^ (unsigned int) getpid()
+            ^ (unsigned int) (uintptr_t) &filename_seed;
+    }
+
+    if (snprintf(name, max_len, "%016lx_%016lx_%08x_%08x_%s.eml%s", timeval.tv_sec,
+            timeval.tv_usec, getpid(), rand_r(&filename_seed), hostname,
+            is_compression_enabled(transaction) ? COMPRESSOR_SUFFIX : "") < 0) {
+        CALL_ERR("snprintf");
+        return -1;
+    }
 
     return 0;
 }
 
-int transaction_set_domain(transaction_t *transaction, const char *value,
-    const size_t length)
+static int create_file(transaction_t *transaction)
 {
-    free_domain(transaction);
-    return set_value(&transaction->__domain, value, length);
+    if (generate_filename(transaction) < 0) {
+        return -1;
+    }
+
+    return get_storage(transaction)->begin(transaction);
 }
 
-int transaction_set_reverse_path(transaction_t *transaction, const char *value,
-    const size_t length)
+static ssize_t sync_dump_data(transaction_t *transaction, const char *value,
+    const size_t size)
 {
-    return set_value(&transaction->__reverse_path, value, length);
+    const off_t offset = transaction->__aiocb.aio_offset
+        + transaction->__aiocb.aio_nbytes;
+    const ssize_t written = spool_sync_write(transaction->spool,
+        transaction->__aiocb.aio_fildes, value, size, offset);
+
+    if (written < 0) {
+        return -1;
+    }
+
+    transaction->__aiocb.aio_buf = NULL;
+    transaction->__aiocb.aio_offset = offset;
+    transaction->__aiocb.aio_nbytes = written;
+
+    if (written > 0) {
+        ++transaction->__sync_writes_count;
+    }
+
+    return written;
 }
 
-int transaction_add_forward_path(transaction_t *transaction, const char *value,
-    const size_t length)
+static int submit_write_buffer(transaction_t *transaction,
+    write_buffer_t *buffer)
 {
-    recipient_list_entry_t *item = malloc(sizeof(recipient_list_entry_t));
+    const int fd = transaction->__aiocb.aio_fildes;
+    const off_t offset = transaction->__aiocb.aio_offset
+        + transaction->__aiocb.aio_nbytes;
+    size_t written = 0;
 
-    if (NULL == item) {
-        CALL_ERR_ARGS("malloc", "%lu", sizeof(recipient_list_entry_t));
+    if (spool_is_sync_write(transaction->spool, buffer->size)) {
+        const ssize_t result = spool_sync_write(transaction->spool, fd,
+            buffer->data, buffer->size, offset);
+
+        if (result < 0) {
+            return -1;
+        }
+
+        written = result;
+
+        if (written > 0) {
+            ++transaction->__sync_writes_count;
+        }
+    }
+
+    transaction->__aiocb.aio_offset = offset;
+    transaction->__aiocb.aio_nbytes = buffer->size;
+
+    if (written == buffer->size) {
+        buffer->size = 0;
+        return 0;
+    }
+
+    buffer->aiocb.aio_fildes = fd;
+    buffer->aiocb.aio_buf = buffer->data + written;
+    buffer->aiocb.aio_offset = offset + written;
+    buffer->aiocb.aio_nbytes = buffer->size - written;
+    buffer->aiocb.aio_lio_opcode = LIO_WRITE;
+
+    if (aio_write(&buffer->aiocb) < 0) {
+        CALL_ERR("aio_write")
         return -1;
     }
 
-    char *forward_path = malloc(length + 1);
+    buffer->is_pending = 1;
+    ++transaction->__async_writes_count;
+    update_unpersisted(transaction);
 
-    if (NULL == forward_path) {
-        CALL_ERR_ARGS("malloc", "%lu", length + 1);
-        free(item);
+    return 0;
+}
+
+static int submit_fill_buffer(transaction_t *transaction)
+{
+    write_buffer_t *buffer = &transaction->__write_buffers[transaction->__fill_index];
+
+    if (buffer->is_pending || 0 == buffer->size) {
+        return 0;
+    }
+
+    if (submit_write_buffer(transaction, buffer) < 0) {
         return -1;
     }
 
-    memcpy(forward_path, value, length);
-    forward_path[length] = '\0';
+    transaction->__fill_index = (transaction->__fill_index + 1)
+        % transaction->settings->write_buffers_count;
 
-    item->recipient.address = forward_path;
+    return 0;
+}
+
+static ssize_t fill_write_buffers(transaction_t *transaction, const char *value,
+    const size_t size)
+{
+    const size_t capacity = transaction->settings->write_buffer_size;
+    size_t filled = 0;
 
-    LIST_INSERT_HEAD(&transaction->__recipient_list, item, entry);
+    while (filled < size) {
+        write_buffer_t *buffer = &transaction->__write_buffers[transaction->__fill_index];
 
-    if (NULL == transaction->__first_recipient) {
-        transaction->__first_recipient = &item->recipient;
+        if (buffer->is_pending) {
+            break;
+        }
+
+        const size_t chunk = MIN(size - filled, capacity - buffer->size);
+
+        memcpy(buffer->data + buffer->size, value + filled, chunk);
+        buffer->size += chunk;
+        filled += chunk;
+
+        if (buffer->size == capacity && submit_fill_buffer(transaction) < 0) {
+            return -1;
+        }
+    }
+
+    return filled;
+}
+
+static int buffer_dump_data(transaction_t *transaction, const char *value,
+    const size_t size)
+{
+    const ssize_t filled = fill_write_buffers(transaction, value, size);
+
+    if (filled < 0) {
+        return -1;
     }
 
+    transaction->__pending_value = filled < size ? value + filled : NULL;
+    transaction->__pending_size = size - filled;
+
     return 0;
 }
 
-void transaction_reset_data(transaction_t *transaction)
+static int reap_write_buffers(transaction_t *transaction)
 {
-    if (transaction->__aiocb.aio_fildes != -1) {
-        abort_write(transaction);
+    const size_t count = transaction->settings->write_buffers_count;
+    int pending_count = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        write_buffer_t *buffer = &transaction->__write_buffers[i];
+
+        if (!buffer->is_pending) {
+            continue;
+        }
+
+        switch (aio_error(&buffer->aiocb)) {
+            case 0: {
+                const ssize_t result = aio_return(&buffer->aiocb);
+
+                if (result < buffer->aiocb.aio_nbytes) {
+                    PRINT_STDERR("written %ld of %lu bytes", result, buffer->aiocb.aio_nbytes);
+                    return -1;
+                }
+
+                buffer->is_pending = 0;
+                buffer->size = 0;
+                break;
+            }
+
+            case EINPROGRESS:
+                ++pending_count;
+                break;
+
+            default:
+                PRINT_STDERR("error in aio_error: %s", strerror(aio_error(&buffer->aiocb)));
+                return -1;
+        }
     }
 
-    transaction->__aiocb.aio_fildes = -1;
-    transaction->__aiocb.aio_buf = NULL;
-    transaction->__aiocb.aio_nbytes = 0;
-    transaction->__aiocb.aio_lio_opcode = LIO_NOP;
+    update_unpersisted(transaction);
 
-    memset(transaction->__data_filename, 0, sizeof(transaction->__data_filename));
+    return pending_count;
 }
 
-ssize_t transaction_add_data(transaction_t *transaction, const char *value,
-    const size_t size)
+static write_status_t get_buffered_write_status(transaction_t *transaction)
 {
-    switch (async_dump_data(transaction, value, size)) {
-        case TRANSACTION_DONE:
-            return size;
-        case TRANSACTION_WAIT:
-            return 0;
-        case TRANSACTION_ERROR:
-            break;
+    if (reap_write_buffers(transaction) < 0) {
+        return WRITE_ERROR;
     }
 
-    return -1;
+    if (NULL == transaction->__pending_value) {
+        return WRITE_DONE;
+    }
+
+    if (buffer_dump_data(transaction, transaction->__pending_value,
+            transaction->__pending_size) < 0) {
+        return WRITE_ERROR;
+    }
+
+    return NULL == transaction->__pending_value ? WRITE_DONE : WRITE_WAIT;
 }
 
-transaction_status_t transaction_add_data_status(transaction_t *transaction)
+static write_status_t flush_write_buffers(transaction_t *transaction)
 {
-    switch (get_write_status(transaction)) {
-        case WRITE_NOT_STARTED:
-        case WRITE_DONE:
-            return TRANSACTION_DONE;
-        case WRITE_WAIT:
-            return TRANSACTION_WAIT;
+    const write_status_t status = get_buffered_write_status(transaction);
+
+    if (status != WRITE_DONE) {
+        return status;
+    }
+
+    if (submit_fill_buffer(transaction) < 0) {
+        return WRITE_ERROR;
+    }
+
+    switch (reap_write_buffers(transaction)) {
+        case -1:
+            return WRITE_ERROR;
+        case 0:
+            return WRITE_DONE;
         default:
-            return TRANSACTION_ERROR;
+            return WRITE_WAIT;
     }
 }
 
-int transaction_add_header(transaction_t *transaction)
+static int continue_dump_data(transaction_t *transaction, const char *value,
+    const size_t size)
 {
-    char *header = generate_header(transaction);
+    size_t written = 0;
 
-    if (NULL == header) {
-        return -1;
+    if (is_buffered_write(transaction)) {
+        return buffer_dump_data(transaction, value, size);
     }
 
-    free_header(transaction);
-    transaction->__header = header;
+    if (spool_is_sync_write(transaction->spool, size)) {
+        const ssize_t result = sync_dump_data(transaction, value, size);
+
+        if (result < 0) {
+            return -1;
+        }
+
+        written = result;
+
+        if (written == size) {
+            return 0;
+        }
+    }
+
+    transaction->__aiocb.aio_buf = (void *) (value + written);
+    transaction->__aiocb.aio_offset += transaction->__aiocb.aio_nbytes;
+    transaction->__aiocb.aio_nbytes = size - written;
+    transaction->__aiocb.aio_lio_opcode = LIO_WRITE;
 
-    if (transaction_add_data(transaction, header, strlen(header)) < 0) {
+    if (aio_write(&transaction->__aiocb) < 0) {
+        CALL_ERR("aio_write")
         return -1;
     }
 
+    ++transaction->__async_writes_count;
+    update_unpersisted(transaction);
+
     return 0;
 }
 
-int transaction_begin(transaction_t *transaction)
+static int finish_create_job(transaction_t *transaction)
 {
-    assert(!transaction->__is_active);
-
-    free_header(transaction);
-    free_reverse_path(transaction);
-    destroy_recipient_list(transaction);
+    const char *value = transaction->__pending_value;
+    const size_t size = transaction->__pending_size;
 
-    LIST_INIT(&transaction->__recipient_list);
+    transaction->__is_job_submitted = 0;
+    transaction->__pending_value = NULL;
+    transaction->__pending_size = 0;
 
-    transaction_reset_data(transaction);
+    if (transaction->__job_fd < 0) {
+        return -1;
+    }
 
-    transaction->__first_recipient = NULL;
-    transaction->__is_active = 1;
+    transaction->__aiocb.aio_fildes = transaction->__job_fd;
+    transaction->__aiocb.aio_offset = 0;
+    transaction->__aiocb.aio_nbytes = 0;
 
-    return 0;
+    return continue_dump_data(transaction, value, size);
 }
 
-transaction_status_t transaction_commit(transaction_t *transaction)
+static int begin_dump_data(transaction_t *transaction, const char *value,
+    const size_t size)
 {
-    if (!transaction->__is_active) {
-        return TRANSACTION_ERROR;
+    if (helper_pool_is_enabled(&transaction->__lane->helper_pool)) {
+        transaction->__pending_value = value;
+        transaction->__pending_size = size;
+        submit_job(transaction, TRANSACTION_JOB_CREATE);
+        return 0;
     }
 
-    switch (get_write_status(transaction)) {
-        case WRITE_DONE: {
-            if (end_write(transaction) < 0) {
-                return TRANSACTION_ERROR;
-            }
+    const int fd = create_file(transaction);
 
-            struct recipient *recipient = transaction->__first_recipient;
-            maildir_t *maildir = &recipient->maildir;
+    if (fd < 0) {
+        return -1;
+    }
 
-            if (maildir_move_to_new(maildir, transaction->__data_filename) < 0) {
-                return TRANSACTION_ERROR;
-            }
+    transaction->__aiocb.aio_fildes = fd;
+    transaction->__aiocb.aio_offset = 0;
+    transaction->__aiocb.aio_nbytes = 0;
 
-            const char *maildir_path = transaction->settings->maildir;
+    return continue_dump_data(transaction, value, size);
+}
 
-            recipient_list_entry_t *item, *temp;
-            LIST_FOREACH_SAFE(item, &transaction->__recipient_list, entry, temp) {
-                recipient_t *current = &item->recipient;
-                if (current != recipient) {
-                    if (maildir_init(&current->maildir, maildir_path, current->address) < 0) {
-                        return TRANSACTION_ERROR;
-                    }
+static write_status_t get_write_status(transaction_t *transaction)
+{
+    if (transaction->__is_job_submitted
+            && TRANSACTION_JOB_CREATE == transaction->__job_kind) {
+        if (is_job_running(transaction, TRANSACTION_JOB_CREATE)) {
+            return WRITE_WAIT;
+        }
 
-                    if (maildir_clone_file(maildir, &current->maildir, transaction->__data_filename) < 0) {
-                        return TRANSACTION_ERROR;
-                    }
-                }
+        if (finish_create_job(transaction) < 0) {
+            return WRITE_ERROR;
+        }
+    }
+
+    if (-1 == transaction->__aiocb.aio_fildes) {
+        return WRITE_NOT_STARTED;
+    }
+
+    if (is_buffered_write(transaction)) {
+        return get_buffered_write_status(transaction);
+    }
+
+    if (NULL == transaction->__aiocb.aio_buf) {
+        return WRITE_DONE;
+    }
+
+    switch (aio_error(&transaction->__aiocb)) {
+        case 0: {
+            const ssize_t result = aio_return(&transaction->__aiocb);
+
+            if (result < transaction->__aiocb.aio_nbytes) {
+                PRINT_STDERR("written %ld of %lu bytes", result, transaction->__aiocb.aio_nbytes);
+                return WRITE_ERROR;
             }
 
-            transaction->__is_active = 0;
+            transaction->__aiocb.aio_buf = NULL;
+            update_unpersisted(transaction);
 
-            return TRANSACTION_DONE;
+            return WRITE_DONE;
         }
-        case WRITE_WAIT:
-            return TRANSACTION_WAIT;
+
+        case EINPROGRESS:
+            return WRITE_WAIT;
 
         default:
-            abort_write(transaction);
-            return TRANSACTION_ERROR;
+            PRINT_STDERR("error in aio_error: %s", strerror(aio_error(&transaction->__aiocb)));
+            return WRITE_ERROR;
     }
 }
 
-int transaction_is_active(const transaction_t *transaction)
+static void cancel_dump_data(transaction_t *transaction)
+{
+    wait_job(transaction);
+
+    switch (get_write_status(transaction)) {
+        case WRITE_NOT_STARTED:
+            break;
+
+        case WRITE_WAIT:
+            if (aio_cancel(transaction->__aiocb.aio_fildes, NULL) < 0) {
+                CALL_ERR("aio_cancel");
+            }
+
+        case WRITE_DONE:
+            abort_write(transaction);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static int spool_data(transaction_t *transaction, const char *value,
+    const size_t size)
+{
+    buffer_t *spooled_data = &transaction->__spooled_data;
+
+    if (is_write_mode(transaction, STORAGE_WRITE_DISCARD)) {
+        return 0;
+    }
+
+    if (is_write_mode(transaction, STORAGE_WRITE_MEMORY)
+            && size > buffer_space(spooled_data)) {
+        const size_t capacity = buffer_end(spooled_data)
+            - buffer_begin(spooled_data);
+        const size_t required = capacity - buffer_space(spooled_data) + size;
+
+        if (buffer_resize(spooled_data,
+                required > 2 * capacity ? required : 2 * capacity) < 0) {
+            return -1;
+        }
+    }
+
+    if (!is_spool_enabled(transaction) || size > buffer_space(spooled_data)) {
+        return 1;
+    }
+
+    buffer_write(spooled_data, value, size);
+
+    return 0;
+}
+
+static int begin_dump_spooled_data(transaction_t *transaction)
+{
+    buffer_t *spooled_data = &transaction->__spooled_data;
+
+    return begin_dump_data(transaction, buffer_read_begin(spooled_data),
+        buffer_left(spooled_data));
+}
+
+static int is_data_spooled(const transaction_t *transaction)
+{
+    return is_spool_enabled(transaction)
+        && buffer_left(&transaction->__spooled_data) > 0;
+}
+
+static transaction_status_t async_dump_data(transaction_t *transaction,
+    const char *value, const size_t size)
+{
+    switch (get_write_status(transaction)) {
+        case WRITE_NOT_STARTED:
+            switch (spool_data(transaction, value, size)) {
+                case 0:
+                    return TRANSACTION_DONE;
+                case 1:
+                    break;
+                default:
+                    return TRANSACTION_ERROR;
+            }
+
+            if (is_data_spooled(transaction)) {
+                if (begin_dump_spooled_data(transaction) < 0) {
+                    return TRANSACTION_ERROR;
+                }
+                return async_dump_data(transaction, value, size);
+            }
+
+            if (begin_dump_data(transaction, value, size) < 0) {
+                return TRANSACTION_ERROR;
+            }
+            return TRANSACTION_DONE;
+
+        case WRITE_DONE:
+            if (continue_dump_data(transaction, value, size) < 0) {
+                return TRANSACTION_ERROR;
+            }
+            return TRANSACTION_DONE;
+
+        case WRITE_WAIT:
+            return TRANSACTION_WAIT;
+
+        default:
+            abort_write(transaction);
+            return TRANSACTION_ERROR;
+    }
+
+    return 0;
+}
+
+static int end_write(transaction_t *transaction)
+{
+    if (close(transaction->__aiocb.aio_fildes) < 0) {
+        PRINT_STDERR("error close file: %s", transaction->__data_filename);
+        return -1;
+    }
+
+    transaction->__aiocb.aio_fildes = -1;
+
+    return 0;
+}
+
+static int get_hostname(const int sock, char *hostname, const size_t size,
+    int getname(int, struct sockaddr *, socklen_t *))
+{
+    struct sockaddr_in addr;
+    socklen_t addr_size = sizeof(addr);
+
+    if (getname(sock, (struct sockaddr *) &addr, &addr_size) < 0) {
+        CALL_ERR_ARGS("get*name", "%d", sock);
+        return -1;
+    }
+
+    if (inet_ntop(AF_INET, &addr.sin_addr, hostname, size - 1) == NULL) {
+        CALL_ERR("inet_ntop");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int get_local_hostname(const int sock, char *hostname, const size_t size)
+{
+    return get_hostname(sock, hostname, size, getsockname);
+}
+
+static int get_remote_hostname(const int sock, char *hostname, const size_t size)
+{
+    return get_hostname(sock, hostname, size, getpeername);
+}
+
+static void free_header(transaction_t *transaction)
+{
+    if (transaction->__header != NULL) {
+        free(transaction->__header);
+        transaction->__header = NULL;
+    }
+}
+
+#define RETURN_PATH_HEADER "Return-path: <%s>" CRLF
+
+#define RECIEVED_HEADER_FROM " from %s(%s)"
+#define RECIEVED_HEADER_BY " by %s(%s)"
+#define RECIEVED_HEADER_VIA " via %s"
+#define RECIEVED_HEADER_FOR " for <%s>"
+#define RECIEVED_HEADER_DATE "; %s"
+#define RECIEVED_HEADER "Received:" \
+    RECIEVED_HEADER_FROM \
+    RECIEVED_HEADER_BY \
+    RECIEVED_HEADER_VIA \
+    RECIEVED_HEADER_FOR \
+    RECIEVED_HEADER_DATE \
+    CRLF
+
+static char *generate_header(transaction_t *transaction)
+{
+    char from_tcp[100];
+    if (get_remote_hostname(transaction->__sock, from_tcp, sizeof(from_tcp)) < 0) {
+        return NULL;
+    }
+
+    char by_tcp[100];
+    if (get_local_hostname(transaction->__sock, by_tcp, sizeof(by_tcp)) < 0) {
+        return NULL;
+    }
+
+    char by_domain[256];
+    if (gethostname(by_domain, sizeof(by_domain) - 1) < 0) {
+        CALL_ERR("gethostname");
+        return NULL;
+    }
+
+    const char *from_domain = transaction->__domain ? transaction->__domain : "";
+    const char *return_path = transaction->__reverse_path;
+    static const char via[] = "SMTP";
+    const char *for_ = transaction->__first_recipient->address;
+
+    struct timeval timeval;
+
+    if (gettimeofday(&timeval, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return NULL;
+    }
+
+    struct tm *tm = localtime(&timeval.tv_sec);
+
+    if (NULL == tm) {
+        CALL_ERR("localtime");
+        return NULL;
+    }
+
+    char date[32];
+
+    if (strftime(date, sizeof(date), "%a, %d %b %Y %T %z", tm) == 0) {
+        CALL_ERR("strftime");
+        return NULL;
+    }
+
+    const size_t size = sizeof(RECIEVED_HEADER) + sizeof(RETURN_PATH_HEADER)
+        + strlen(return_path) + strlen(from_domain) + strlen(from_tcp)
+        + strlen(by_domain) + strlen(by_tcp) + sizeof(via) + strlen(for_)
+        + strlen(date);
+    char *header = malloc(size);
+
+    if (NULL == header) {
+        CALL_ERR_ARGS("malloc", "%lu", size);
+        return NULL;
+    }
+
+    if (snprintf(header, size, RETURN_PATH_HEADER RECIEVED_HEADER,
+            return_path, from_domain, from_tcp, by_domain, by_tcp, via, for_,
+            date) < 0) {
+        free(header);
+        CALL_ERR_ARGS("snprintf", "%s %lu %s %s %s %s %s %s %s %s",
+            RETURN_PATH_HEADER RECIEVED_HEADER, size, return_path, from_domain,
+            from_tcp, by_domain, by_tcp, via, for_, date);
+        return NULL;
+    }
+
+    return header;
+}
+
+static void destroy_write_buffers(transaction_t *transaction)
+{
+    if (!is_buffered_write(transaction)) {
+        return;
+    }
+
+    free_write_buffers(transaction->__write_buffers,
+        transaction->settings->write_buffers_count);
+    transaction->__write_buffers = NULL;
+}
+
+static int init_write_buffers(transaction_t *transaction)
+{
+    const settings_t *settings = transaction->settings;
+
+    transaction->__write_buffers = NULL;
+    transaction->__fill_index = 0;
+
+    if (!is_write_mode(transaction, STORAGE_WRITE_FILE)
+            || settings->write_buffers_count < 2) {
+        return 0;
+    }
+
+    write_buffer_t *buffers = calloc(settings->write_buffers_count,
+        sizeof(write_buffer_t));
+
+    if (NULL == buffers) {
+        CALL_ERR_ARGS("calloc", "%d", settings->write_buffers_count);
+        return -1;
+    }
+
+    transaction->__write_buffers = buffers;
+
+    for (size_t i = 0; i < settings->write_buffers_count; ++i) {
+        buffers[i].data = malloc(settings->write_buffer_size);
+
+        if (NULL == buffers[i].data) {
+            CALL_ERR_ARGS("malloc", "%d", settings->write_buffer_size);
+            destroy_write_buffers(transaction);
+            return -1;
+        }
+
+        buffers[i].aiocb.aio_fildes = -1;
+        buffers[i].aiocb.aio_sigevent = transaction->__aiocb.aio_sigevent;
+    }
+
+    return 0;
+}
+
+int transaction_init(transaction_t *transaction, const settings_t *settings,
+    log_t *log, spool_t *spool, const int sock)
+{
+    transaction->settings = settings;
+    transaction->log = log;
+    transaction->spool = spool;
+    transaction->__lane = &spool->lanes[0];
+    transaction->__sock = sock;
+    transaction->__domain = NULL;
+    transaction->__header = NULL;
+    transaction->__reverse_path = NULL;
+    transaction->__first_recipient = NULL;
+    RB_INIT(&transaction->__recipients);
+    transaction->__fan_out_next = NULL;
+    transaction->__copy_source = NULL;
+    transaction->__delivered_count = 0;
+    transaction->__failed_count = 0;
+    transaction->__is_active = 0;
+    transaction->__commit_stage = COMMIT_WRITE;
+    transaction->__commit_queue = NULL;
+    transaction->__is_commit_failed = 0;
+    transaction->__is_job_submitted = 0;
+    transaction->__pending_value = NULL;
+    transaction->__pending_size = 0;
+    transaction->__job.run = run_job;
+    transaction->__job.signum = TRANSACTION_AIO_SIGNAL;
+    transaction->__job.value.sival_int = sock;
+    transaction->__is_tmpfile = 0;
+    transaction->__intent_slot = -1;
+    transaction->__sync_writes_count = 0;
+    transaction->__async_writes_count = 0;
+    transaction->__declared_size = 0;
+    transaction->__data_size = 0;
+    transaction->__body_hash = BODY_HASH_OFFSET;
+    transaction->__deduplicated_size = 0;
+    transaction->__is_spliced = 0;
+    transaction->__compressor = NULL;
+    transaction->__is_compression_ended = 0;
+    transaction->__is_compressed_pending = 0;
+    transaction->__compressed_size = 0;
+    transaction->__is_oversized = 0;
+    transaction->__is_committing = 0;
+    transaction->__unpersisted_size = 0;
+
+    if (is_spool_enabled(transaction)) {
+        const size_t spool_size = settings->memory_spool_size > 0
+            ? settings->memory_spool_size : INITIAL_SPOOL_SIZE;
+
+        if (buffer_init(&transaction->__spooled_data, spool_size) < 0) {
+            return -1;
+        }
+    }
+
+    memset(&transaction->__aiocb, 0, sizeof(transaction->__aiocb));
+
+    transaction->__aiocb.aio_fildes = -1;
+    transaction->__aiocb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+    transaction->__aiocb.aio_sigevent.sigev_signo = TRANSACTION_AIO_SIGNAL;
+    transaction->__aiocb.aio_sigevent.sigev_value.sival_int = sock;
+
+    memset(transaction->__data_filename, 0, sizeof(transaction->__data_filename));
+
+    if (init_write_buffers(transaction) < 0) {
+        if (is_spool_enabled(transaction)) {
+            buffer_destroy(&transaction->__spooled_data);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+void transaction_destroy(transaction_t *transaction)
+{
+    dequeue_commit(transaction);
+    cancel_dump_data(transaction);
+    free_header(transaction);
+    free_domain(transaction);
+    free_reverse_path(transaction);
+    destroy_recipient_list(transaction);
+
+    if (is_spool_enabled(transaction)) {
+        buffer_destroy(&transaction->__spooled_data);
+    }
+
+    transaction->__is_committing = 0;
+    update_unpersisted(transaction);
+    destroy_write_buffers(transaction);
+    release_compressor(transaction);
+}
+
+void transaction_rollback(transaction_t *transaction)
+{
+    cancel_dump_data(transaction);
+    free_header(transaction);
+    free_reverse_path(transaction);
+    destroy_recipient_list(transaction);
+
+    transaction_reset_data(transaction);
+
+    transaction->__first_recipient = NULL;
+    transaction->__is_active = 0;
+}
+
+static int set_value(char **dst, const char *value, const size_t length)
+{
+    assert(NULL == *dst);
+
+    char *copy = malloc(length + 1);
+
+    if (NULL == copy) {
+        CALL_ERR_ARGS("malloc", "%lu", length + 1);
+        return -1;
+    }
+
+    memcpy(copy, value, length);
+    copy[length] = '\0';
+    *dst = copy;
+
+    return 0;
+}
+
+int transaction_set_domain(transaction_t *transaction, const char *value,
+    const size_t length)
+{
+    free_domain(transaction);
+    return set_value(&transaction->__domain, value, length);
+}
+
+int transaction_set_reverse_path(transaction_t *transaction, const char *value,
+    const size_t length)
+{
+    return set_value(&transaction->__reverse_path, value, length);
+}
+
+static void place_first_recipient(transaction_t *transaction,
+    recipient_t *recipient)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+    spool_lane_t *lane = &transaction->spool->lanes[NULL == storage->place
+        ? 0 : storage->place(transaction, recipient)];
+
+    transaction->__lane->queued_size -= transaction->__unpersisted_size;
+    lane->queued_size += transaction->__unpersisted_size;
+    transaction->__lane = lane;
+}
+
+int transaction_add_forward_path(transaction_t *transaction, const char *value,
+    const size_t length)
+{
+    recipient_tree_entry_t *item = malloc(sizeof(recipient_tree_entry_t));
+
+    if (NULL == item) {
+        CALL_ERR_ARGS("malloc", "%lu", sizeof(recipient_tree_entry_t));
+        return -1;
+    }
+
+    char *forward_path = malloc(length + 1);
+
+    if (NULL == forward_path) {
+        CALL_ERR_ARGS("malloc", "%lu", length + 1);
+        free(item);
+        return -1;
+    }
+
+    memcpy(forward_path, value, length);
+    forward_path[length] = '\0';
+
+    item->recipient.address = forward_path;
+    item->recipient.maildir = NULL;
+    item->recipient.status = RECIPIENT_PENDING;
+    item->recipient.clone_method = MAILDIR_CLONE_LINK;
+    item->recipient.root = -1;
+
+    if (NULL != RB_INSERT(recipient_tree, &transaction->__recipients, item)) {
+        free(forward_path);
+        free(item);
+        return 0;
+    }
+
+    if (NULL == transaction->__first_recipient) {
+        transaction->__first_recipient = &item->recipient;
+        place_first_recipient(transaction, &item->recipient);
+    }
+
+    return 0;
+}
+
+quota_status_t transaction_check_quota(transaction_t *transaction,
+    const char *value, const size_t length)
+{
+    if (NULL == transaction->spool->quota_table) {
+        return QUOTA_WITHIN;
+    }
+
+    return quota_table_check(transaction->spool->quota_table, value, length,
+        transaction->__declared_size);
+}
+
+void transaction_reset_data(transaction_t *transaction)
+{
+    dequeue_commit(transaction);
+    wait_job(transaction);
+
+    if (transaction->__aiocb.aio_fildes != -1) {
+        abort_write(transaction);
+    }
+
+    transaction->__aiocb.aio_fildes = -1;
+    transaction->__aiocb.aio_buf = NULL;
+    transaction->__aiocb.aio_nbytes = 0;
+    transaction->__aiocb.aio_lio_opcode = LIO_NOP;
+    transaction->__sync_writes_count = 0;
+    transaction->__async_writes_count = 0;
+    transaction->__commit_stage = COMMIT_WRITE;
+    transaction->__is_commit_failed = 0;
+    transaction->__fan_out_next = NULL;
+    transaction->__copy_source = NULL;
+    transaction->__delivered_count = 0;
+    transaction->__failed_count = 0;
+    transaction->__declared_size = 0;
+    transaction->__data_size = 0;
+    transaction->__body_hash = BODY_HASH_OFFSET;
+    transaction->__deduplicated_size = 0;
+    transaction->__is_spliced = 0;
+    release_compressor(transaction);
+    transaction->__is_compression_ended = 0;
+    transaction->__is_compressed_pending = 0;
+    transaction->__compressed_size = 0;
+    transaction->__is_oversized = 0;
+    transaction->__is_committing = 0;
+
+    if (is_spool_enabled(transaction)) {
+        buffer_reset(&transaction->__spooled_data);
+    }
+
+    memset(transaction->__data_filename, 0, sizeof(transaction->__data_filename));
+    update_unpersisted(transaction);
+}
+
+static transaction_status_t compress_data(transaction_t *transaction,
+    const char *value, const size_t size, const int is_end)
+{
+    if (WRITE_WAIT == get_write_status(transaction)) {
+        return TRANSACTION_WAIT;
+    }
+
+    if (NULL == transaction->__compressor) {
+        transaction->__compressor = compressor_pool_acquire(
+            transaction->spool->compressor_pool);
+    }
+
+    if (NULL == transaction->__compressor) {
+        return TRANSACTION_ERROR;
+    }
+
+    const compressor_t *compressor = transaction->__compressor;
+
+    if (!transaction->__is_compressed_pending) {
+        if (compressor_compress(transaction->__compressor, value, size,
+                is_end) < 0) {
+            return TRANSACTION_ERROR;
+        }
+
+        if (0 == compressor_size(compressor)) {
+            return TRANSACTION_DONE;
+        }
+    }
+
+    const transaction_status_t status = async_dump_data(transaction,
+        compressor_data(compressor), compressor_size(compressor));
+
+    transaction->__is_compressed_pending = TRANSACTION_WAIT == status;
+
+    if (TRANSACTION_DONE == status) {
+        transaction->__compressed_size += compressor_size(compressor);
+    }
+
+    return status;
+}
+
+static ssize_t add_data(transaction_t *transaction, const char *value,
+    const size_t size)
+{
+    const transaction_status_t status = is_compression_enabled(transaction)
+        ? compress_data(transaction, value, size, 0)
+        : async_dump_data(transaction, value, size);
+
+    switch (status) {
+        case TRANSACTION_DONE:
+            return size;
+        case TRANSACTION_WAIT:
+            return 0;
+        case TRANSACTION_ERROR:
+            break;
+    }
+
+    return -1;
+}
+
+static int exceeds_max_size(const transaction_t *transaction,
+    const size_t size)
+{
+    const int max_size = transaction->settings->max_message_size;
+
+    return max_size > 0 && size > (size_t) max_size;
+}
+
+ssize_t transaction_add_data(transaction_t *transaction, const char *value,
+    const size_t size)
+{
+    if (!transaction->__is_oversized
+            && exceeds_max_size(transaction, transaction->__data_size + size)) {
+        transaction->__is_oversized = 1;
+    }
+
+    if (transaction->__is_oversized) {
+        return size;
+    }
+
+    const ssize_t added = add_data(transaction, value, size);
+
+    if (added > 0) {
+        transaction->__data_size += added;
+
+        if (is_dedup_enabled(transaction)) {
+            transaction->__body_hash = hash_body(transaction->__body_hash,
+                value, added);
+        }
+    }
+
+    return added;
+}
+
+static int is_dedup_candidate(const transaction_t *transaction)
+{
+    const size_t declared_size = transaction->__declared_size;
+
+    return is_dedup_enabled(transaction)
+        && dedup_index_is_supported(transaction->spool->dedup_index)
+        && (0 == declared_size
+            || declared_size >= (size_t) transaction->settings->dedup_min_size);
+}
+
+int transaction_can_splice(transaction_t *transaction, const size_t size)
+{
+    const size_t splice_size = spool_splice_size(transaction->spool, size);
+
+    if (0 == splice_size
+            || !is_write_mode(transaction, STORAGE_WRITE_FILE)
+            || is_dedup_candidate(transaction)
+            || is_compression_enabled(transaction)
+            || transaction->__is_oversized
+            || exceeds_max_size(transaction, transaction->__data_size + size)
+            || WRITE_DONE != get_write_status(transaction)
+            || !spool_is_sync_write(transaction->spool, splice_size)) {
+        return 0;
+    }
+
+    return !is_buffered_write(transaction) || submit_fill_buffer(transaction) == 0;
+}
+
+ssize_t transaction_splice_data(transaction_t *transaction, const int sock,
+    const size_t size)
+{
+    const off_t offset = transaction->__aiocb.aio_offset
+        + transaction->__aiocb.aio_nbytes;
+    const ssize_t spliced = spool_splice(transaction->spool, sock,
+        transaction->__aiocb.aio_fildes,
+        spool_splice_size(transaction->spool, size), offset);
+
+    if (spliced <= 0) {
+        return spliced;
+    }
+
+    transaction->__aiocb.aio_buf = NULL;
+    transaction->__aiocb.aio_offset = offset;
+    transaction->__aiocb.aio_nbytes = spliced;
+    transaction->__data_size += spliced;
+    transaction->__is_spliced = 1;
+    ++transaction->__sync_writes_count;
+
+    return spliced;
+}
+
+int transaction_is_oversized(const transaction_t *transaction)
+{
+    return transaction->__is_oversized;
+}
+
+int transaction_set_declared_size(transaction_t *transaction,
+    const size_t size)
+{
+    buffer_t *spooled_data = &transaction->__spooled_data;
+
+    transaction->__declared_size = size;
+
+    if (!is_write_mode(transaction, STORAGE_WRITE_MEMORY)
+            || exceeds_max_size(transaction, size)
+            || 0 == transaction->settings->max_message_size) {
+        return 0;
+    }
+
+    const size_t capacity = buffer_end(spooled_data) - buffer_begin(spooled_data);
+    const size_t required = MIN(size + INITIAL_SPOOL_SIZE, DECLARED_SPOOL_SIZE_MAX);
+
+    if (required > capacity && buffer_resize(spooled_data, required) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+size_t transaction_expected_size(const transaction_t *transaction)
+{
+    if (0 == transaction->__declared_size
+            || is_compression_enabled(transaction)) {
+        return 0;
+    }
+
+    return transaction->__declared_size
+        + (NULL == transaction->__header ? 0 : strlen(transaction->__header));
+}
+
+transaction_status_t transaction_add_data_status(transaction_t *transaction)
+{
+    switch (get_write_status(transaction)) {
+        case WRITE_NOT_STARTED:
+        case WRITE_DONE:
+            return TRANSACTION_DONE;
+        case WRITE_WAIT:
+            return TRANSACTION_WAIT;
+        default:
+            return TRANSACTION_ERROR;
+    }
+}
+
+int transaction_add_header(transaction_t *transaction)
+{
+    char *header = generate_header(transaction);
+
+    if (NULL == header) {
+        return -1;
+    }
+
+    free_header(transaction);
+    transaction->__header = header;
+
+    if (add_data(transaction, header, strlen(header)) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int transaction_begin(transaction_t *transaction)
+{
+    assert(!transaction->__is_active);
+
+    free_header(transaction);
+    free_reverse_path(transaction);
+    destroy_recipient_list(transaction);
+
+    transaction_reset_data(transaction);
+
+    transaction->__first_recipient = NULL;
+    transaction->__is_active = 1;
+
+    return 0;
+}
+
+static transaction_status_t fan_out(transaction_t *transaction,
+    const size_t batch_size)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+    const recipient_t *first = transaction->__first_recipient;
+    size_t count = 0;
+
+    while (NULL != transaction->__fan_out_next) {
+        if (batch_size > 0 && count == batch_size) {
+            return TRANSACTION_WAIT;
+        }
+
+        recipient_t *current = &transaction->__fan_out_next->recipient;
+
+        transaction->__fan_out_next = RB_NEXT(recipient_tree,
+            &transaction->__recipients, transaction->__fan_out_next);
+
+        if (current == first) {
+            continue;
+        }
+
+        if (NULL == storage->clone || storage->clone(transaction, current) < 0) {
+            current->status = RECIPIENT_FAILED;
+            ++transaction->__failed_count;
+        } else {
+            current->status = RECIPIENT_DELIVERED;
+            ++transaction->__delivered_count;
+
+            if (MAILDIR_CLONE_LINK != current->clone_method) {
+                transaction->__copy_source = current;
+            }
+        }
+
+        ++count;
+    }
+
+    return TRANSACTION_DONE;
+}
+
+static int sync_data(transaction_t *transaction,
+    const unsigned long generation)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+
+    if (NULL == storage->sync) {
+        return 0;
+    }
+
+    return storage->sync(transaction, generation);
+}
+
+static int sync_dirs(transaction_t *transaction, const unsigned long generation)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+    recipient_tree_entry_t *item;
+
+    if (NULL == storage->sync_recipient) {
+        return 0;
+    }
+
+    RB_FOREACH(item, recipient_tree, &transaction->__recipients) {
+        recipient_t *recipient = &item->recipient;
+
+        if (RECIPIENT_DELIVERED == recipient->status
+                && storage->sync_recipient(transaction, recipient,
+                    generation) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int publish_to_all(transaction_t *transaction)
+{
+    recipient_tree_entry_t *item;
+
+    RB_FOREACH(item, recipient_tree, &transaction->__recipients) {
+        item->recipient.status = RECIPIENT_DELIVERED;
+        ++transaction->__delivered_count;
+    }
+
+    transaction->__fan_out_next = NULL;
+
+    return 0;
+}
+
+static void retract_deliveries(transaction_t *transaction)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+    recipient_tree_entry_t *entry;
+
+    if (NULL == storage->retract) {
+        return;
+    }
+
+    RB_FOREACH(entry, recipient_tree, &transaction->__recipients) {
+        if (RECIPIENT_DELIVERED == entry->recipient.status) {
+            storage->retract(transaction, &entry->recipient);
+        }
+    }
+}
+
+static void drop_cache(transaction_t *transaction)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+
+    if (NULL != storage->drop_cache) {
+        storage->drop_cache(transaction, transaction->__data_size);
+    }
+}
+
+static void deduplicate(transaction_t *transaction)
+{
+    const int min_size = transaction->settings->dedup_min_size;
+
+    if (!is_dedup_enabled(transaction) || transaction->__is_spliced
+            || NULL == transaction->__header
+            || transaction->__data_size < (size_t) min_size) {
+        return;
+    }
+
+    const off_t shared = dedup_index_share(transaction->spool->dedup_index,
+        transaction->__aiocb.aio_fildes, strlen(transaction->__header),
+        transaction->__body_hash);
+
+    if (shared > 0) {
+        transaction->__deduplicated_size = shared;
+    }
+}
+
+static int publish_data(transaction_t *transaction)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+
+    deduplicate(transaction);
+
+    if (NULL != storage->commit && storage->commit(transaction) < 0) {
+        return -1;
+    }
+
+    if (!is_write_mode(transaction, STORAGE_WRITE_FILE)) {
+        return publish_to_all(transaction);
+    }
+
+    drop_cache(transaction);
+
+    if (end_write(transaction) < 0) {
+        return -1;
+    }
+
+    transaction->__first_recipient->status = RECIPIENT_DELIVERED;
+    transaction->__delivered_count = 1;
+    transaction->__fan_out_next = RB_MIN(recipient_tree,
+        &transaction->__recipients);
+
+    return 0;
+}
+
+static int append_data(transaction_t *transaction)
+{
+    const storage_backend_t *storage = get_storage(transaction);
+
+    if (generate_filename(transaction) < 0) {
+        return -1;
+    }
+
+    if (NULL == storage->append) {
+        return 0;
+    }
+
+    if (!is_spool_enabled(transaction)) {
+        return storage->append(transaction, NULL, 0);
+    }
+
+    const buffer_t *spooled_data = &transaction->__spooled_data;
+
+    return storage->append(transaction, buffer_read_begin(spooled_data),
+        buffer_left(spooled_data));
+}
+
+static transaction_status_t finish_append(transaction_t *transaction)
+{
+    if (transaction->__is_job_submitted
+            && TRANSACTION_JOB_APPEND == transaction->__job_kind) {
+        transaction->__is_job_submitted = 0;
+        return transaction->__job_status;
+    }
+
+    if (is_write_mode(transaction, STORAGE_WRITE_MEMORY)
+            && helper_pool_is_enabled(&transaction->__lane->helper_pool)) {
+        submit_job(transaction, TRANSACTION_JOB_APPEND);
+        return TRANSACTION_WAIT;
+    }
+
+    return append_data(transaction) < 0 ? TRANSACTION_ERROR : TRANSACTION_DONE;
+}
+
+static transaction_status_t finish_write(transaction_t *transaction)
+{
+    if (!is_write_mode(transaction, STORAGE_WRITE_FILE)) {
+        return finish_append(transaction);
+    }
+
+    if (is_compression_enabled(transaction)
+            && !transaction->__is_compression_ended) {
+        const transaction_status_t status = compress_data(transaction, NULL, 0,
+            1);
+
+        if (TRANSACTION_DONE != status) {
+            return status;
+        }
+
+        transaction->__is_compression_ended = 1;
+    }
+
+    if (WRITE_NOT_STARTED == get_write_status(transaction)
+            && is_data_spooled(transaction)) {
+        if (begin_dump_spooled_data(transaction) < 0) {
+            return TRANSACTION_ERROR;
+        }
+    }
+
+    write_status_t status = get_write_status(transaction);
+
+    if (WRITE_DONE == status && is_buffered_write(transaction)) {
+        status = flush_write_buffers(transaction);
+    }
+
+    switch (status) {
+        case WRITE_DONE:
+            release_compressor(transaction);
+            return TRANSACTION_DONE;
+        case WRITE_WAIT:
+            return TRANSACTION_WAIT;
+
+        default:
+            abort_write(transaction);
+            return TRANSACTION_ERROR;
+    }
+}
+
+static transaction_status_t advance_commit(transaction_t *transaction,
+    const size_t batch_size)
+{
+    const durability_t durability = transaction->settings->durability;
+
+    if (COMMIT_DATA_SYNC == transaction->__commit_stage) {
+        if (DURABILITY_FDATASYNC == durability
+                && sync_data(transaction, 0) < 0) {
+            return TRANSACTION_ERROR;
+        }
+
+        if (publish_data(transaction) < 0) {
+            return TRANSACTION_ERROR;
+        }
+
+        transaction->__commit_stage = COMMIT_FAN_OUT;
+    }
+
+    if (COMMIT_FAN_OUT == transaction->__commit_stage) {
+        const transaction_status_t status = fan_out(transaction, batch_size);
+
+        if (status != TRANSACTION_DONE) {
+            return status;
+        }
+
+        transaction->__commit_stage = COMMIT_DIR_SYNC;
+
+        if (transaction->__failed_count > 0) {
+            retract_deliveries(transaction);
+            return TRANSACTION_DONE;
+        }
+
+        if (NULL == get_storage(transaction)->sync_recipient) {
+            return TRANSACTION_DONE;
+        }
+
+        if (DURABILITY_GROUP == durability) {
+            return TRANSACTION_WAIT;
+        }
+
+        if (DURABILITY_FDATASYNC == durability && sync_dirs(transaction, 0) < 0) {
+            retract_deliveries(transaction);
+            return TRANSACTION_ERROR;
+        }
+    }
+
+    return TRANSACTION_DONE;
+}
+
+static void run_job(helper_job_t *job)
+{
+    transaction_t *transaction = (transaction_t *) ((char *) job
+        - offsetof(transaction_t, __job));
+
+    switch (transaction->__job_kind) {
+        case TRANSACTION_JOB_CREATE:
+            transaction->__job_fd = create_file(transaction);
+            break;
+        case TRANSACTION_JOB_APPEND:
+            transaction->__job_status = append_data(transaction) < 0
+                ? TRANSACTION_ERROR : TRANSACTION_DONE;
+            break;
+        case TRANSACTION_JOB_COMMIT:
+            transaction->__job_status = advance_commit(transaction, 0);
+            break;
+    }
+}
+
+static transaction_status_t continue_commit(transaction_t *transaction)
+{
+    if (transaction->__is_job_submitted
+            && TRANSACTION_JOB_COMMIT == transaction->__job_kind) {
+        transaction->__is_job_submitted = 0;
+        return transaction->__job_status;
+    }
+
+    if (COMMIT_DIR_SYNC != transaction->__commit_stage
+            && !is_write_mode(transaction, STORAGE_WRITE_DISCARD)
+            && helper_pool_is_enabled(&transaction->__lane->helper_pool)) {
+        submit_job(transaction, TRANSACTION_JOB_COMMIT);
+        return TRANSACTION_WAIT;
+    }
+
+    return advance_commit(transaction,
+        transaction->settings->fan_out_batch_size);
+}
+
+static size_t stored_size(const transaction_t *transaction)
+{
+    if (is_compression_enabled(transaction)) {
+        return transaction->__compressed_size;
+    }
+
+    return transaction->__data_size
+        + (NULL == transaction->__header ? 0 : strlen(transaction->__header));
+}
+
+static void report_delivery(transaction_t *transaction,
+    const recipient_t *recipient, const struct timeval *time)
+{
+    delivery_record_t record;
+
+    memset(&record, 0, sizeof(record));
+    record.magic = DELIVERY_RECORD_MAGIC;
+    record.recipients_count = transaction->__delivered_count
+        + transaction->__failed_count;
+    record.time_sec = time->tv_sec;
+    record.time_usec = time->tv_usec;
+    record.size = stored_size(transaction);
+    snprintf(record.mailbox, sizeof(record.mailbox), "%s",
+        maildir_path(recipient->maildir));
+    snprintf(record.filename, sizeof(record.filename), "%s",
+        transaction->__data_filename);
+    snprintf(record.sender, sizeof(record.sender), "%s",
+        NULL == transaction->__reverse_path ? "" : transaction->__reverse_path);
+
+    if (NULL != transaction->spool->delivery_index) {
+        delivery_index_append(transaction->spool->delivery_index, &record);
+    }
+
+    if (NULL != transaction->spool->notifier) {
+        notifier_publish(transaction->spool->notifier, record.mailbox,
+            record.filename, record.size);
+    }
+
+    if (NULL != transaction->spool->quota_table) {
+        quota_table_charge(transaction->spool->quota_table, recipient->address,
+            record.mailbox, record.size);
+    }
+}
+
+static void report_deliveries(transaction_t *transaction)
+{
+    struct timeval current_time;
+    recipient_tree_entry_t *entry;
+
+    if (NULL == transaction->spool->delivery_index
+            && NULL == transaction->spool->notifier
+            && NULL == transaction->spool->quota_table) {
+        return;
+    }
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return;
+    }
+
+    RB_FOREACH(entry, recipient_tree, &transaction->__recipients) {
+        if (RECIPIENT_DELIVERED == entry->recipient.status) {
+            report_delivery(transaction, &entry->recipient, &current_time);
+        }
+    }
+}
+
+transaction_status_t transaction_commit(transaction_t *transaction)
+{
+    if (!transaction->__is_active) {
+        return TRANSACTION_ERROR;
+    }
+
+    if (is_commit_queued(transaction)
+            || is_job_running(transaction, TRANSACTION_JOB_APPEND)
+            || is_job_running(transaction, TRANSACTION_JOB_COMMIT)) {
+        return TRANSACTION_WAIT;
+    }
+
+    if (transaction->__is_commit_failed) {
+        return TRANSACTION_ERROR;
+    }
+
+    if (!transaction->__is_committing) {
+        transaction->__is_committing = 1;
+        update_unpersisted(transaction);
+    }
+
+    if (COMMIT_WRITE == transaction->__commit_stage) {
+        const transaction_status_t status = finish_write(transaction);
+
+        if (status != TRANSACTION_DONE) {
+            return status;
+        }
+
+        transaction->__commit_stage = COMMIT_DATA_SYNC;
+
+        if (DURABILITY_GROUP == transaction->settings->durability) {
+            enqueue_commit(transaction);
+            return TRANSACTION_WAIT;
+        }
+    }
+
+    const int is_job = transaction->__is_job_submitted;
+
+    switch (continue_commit(transaction)) {
+        case TRANSACTION_DONE:
+            if (0 == transaction->__failed_count) {
+                report_deliveries(transaction);
+            }
+            transaction->__is_active = 0;
+            transaction->__is_committing = 0;
+            update_unpersisted(transaction);
+            return TRANSACTION_DONE;
+
+        case TRANSACTION_WAIT:
+            if (!is_job && transaction->__is_job_submitted) {
+                return TRANSACTION_WAIT;
+            }
+
+            yield(transaction);
+            return TRANSACTION_WAIT;
+
+        default:
+            return TRANSACTION_ERROR;
+    }
+}
+
+static void run_commit_flush(helper_job_t *job)
+{
+    spool_lane_t *lane = (spool_lane_t *) ((char *) job
+        - offsetof(spool_lane_t, commit_flush_job));
+
+    transaction_t *transaction;
+
+    TAILQ_FOREACH(transaction, &lane->flushing_queue, __commit_entry) {
+        if (COMMIT_DATA_SYNC == transaction->__commit_stage
+                && (sync_data(transaction, lane->commit_flush_generation) < 0
+                    || advance_commit(transaction, 0) == TRANSACTION_ERROR)) {
+            transaction->__is_commit_failed = 1;
+        }
+    }
+
+    TAILQ_FOREACH(transaction, &lane->flushing_queue, __commit_entry) {
+        if (COMMIT_DIR_SYNC == transaction->__commit_stage
+                && !transaction->__is_commit_failed
+                && 0 == transaction->__failed_count
+                && sync_dirs(transaction, lane->commit_flush_generation) < 0) {
+            retract_deliveries(transaction);
+            transaction->__is_commit_failed = 1;
+        }
+    }
+}
+
+static void flush_lane_commit_queue(spool_t *spool, spool_lane_t *lane)
+{
+    transaction_t *transaction;
+
+    TAILQ_FOREACH(transaction, &lane->commit_queue, __commit_entry) {
+        transaction->__commit_queue = &lane->flushing_queue;
+    }
+
+    TAILQ_CONCAT(&lane->flushing_queue, &lane->commit_queue, __commit_entry);
+
+    lane->commit_flush_generation = spool_next_commit_generation(spool);
+    lane->commit_flush_job.run = run_commit_flush;
+    lane->commit_flush_job.signum = TRANSACTION_AIO_SIGNAL;
+    lane->commit_flush_job.value = TAILQ_FIRST(&lane->flushing_queue)
+        ->__aiocb.aio_sigevent.sigev_value;
+
+    helper_pool_submit(&lane->helper_pool, &lane->commit_flush_job);
+
+    if (!helper_pool_is_enabled(&lane->helper_pool)) {
+        complete_commit_flush(lane);
+    }
+}
+
+void transaction_flush_commit_queue(spool_t *spool, const int tick_interval)
+{
+    for (size_t i = 0; i < spool->lanes_count; ++i) {
+        spool_lane_t *lane = &spool->lanes[i];
+
+        if (!TAILQ_EMPTY(&lane->commit_queue)
+                && spool_lane_commit_timeout(spool, lane, tick_interval) == 0) {
+            flush_lane_commit_queue(spool, lane);
+        }
+    }
+}
+
+void transaction_reap_cancelled_writes(spool_t *spool, const int is_blocking)
+{
+    cancelled_write_t *cancelled, *temp;
+
+    TAILQ_FOREACH_SAFE(cancelled, &spool->cancelled_writes, entry, temp) {
+        size_t pending_count = 0;
+
+        if (is_blocking) {
+            wait_write_buffers(cancelled->buffers, cancelled->count);
+        }
+
+        for (size_t i = 0; i < cancelled->count; ++i) {
+            pending_count += is_write_buffer_pending(&cancelled->buffers[i]);
+        }
+
+        if (pending_count > 0) {
+            continue;
+        }
+
+        TAILQ_REMOVE(&spool->cancelled_writes, cancelled, entry);
+
+        if (close(cancelled->fd) < 0) {
+            CALL_ERR("close");
+        }
+
+        free_write_buffers(cancelled->buffers, cancelled->count);
+        free(cancelled);
+    }
+}
+
+int transaction_is_active(const transaction_t *transaction)
 {
     return transaction->__is_active;
 }
 
+int transaction_is_busy(transaction_t *transaction)
+{
+    spool_lane_t *lane = transaction->__lane;
+
+    if (transaction->__is_job_submitted
+            && helper_pool_is_pending(&lane->helper_pool, &transaction->__job)) {
+        return 1;
+    }
+
+    return NULL != transaction->__commit_queue
+        && &lane->commit_queue != transaction->__commit_queue
+        && helper_pool_is_pending(&lane->helper_pool, &lane->commit_flush_job);
+}
+
 const char *transaction_data_filename(const transaction_t *transaction)
 {
     return transaction->__data_filename;
 }
+
+int transaction_data_fd(const transaction_t *transaction)
+{
+    return transaction->__aiocb.aio_fildes;
+}
+
+recipient_t *transaction_first_recipient(const transaction_t *transaction)
+{
+    return transaction->__first_recipient;
+}
+
+int transaction_lane_root(const transaction_t *transaction)
+{
+    return transaction->__lane - transaction->spool->lanes;
+}
+
+const recipient_t *transaction_copy_source(const transaction_t *transaction)
+{
+    return transaction->__copy_source;
+}
+
+int transaction_is_tmpfile(const transaction_t *transaction)
+{
+    return transaction->__is_tmpfile;
+}
+
+void transaction_set_tmpfile(transaction_t *transaction, const int value)
+{
+    transaction->__is_tmpfile = value;
+}
+
+int *transaction_intent_slot(transaction_t *transaction)
+{
+    return &transaction->__intent_slot;
+}
+
+size_t transaction_delivered_count(const transaction_t *transaction)
+{
+    return transaction->__delivered_count;
+}
+
+size_t transaction_failed_count(const transaction_t *transaction)
+{
+    return transaction->__failed_count;
+}
+
+off_t transaction_deduplicated_size(const transaction_t *transaction)
+{
+    return transaction->__deduplicated_size;
+}
+
+size_t transaction_clone_count(const transaction_t *transaction,
+    const maildir_clone_method_t method)
+{
+    size_t count = 0;
+    recipient_tree_entry_t *item;
+
+    if (NULL == get_storage(transaction)->clone) {
+        return 0;
+    }
+
+    RB_FOREACH(item, recipient_tree, (recipient_tree_t *) &transaction->__recipients) {
+        const recipient_t *current = &item->recipient;
+
+        if (current != transaction->__first_recipient
+                && RECIPIENT_DELIVERED == current->status
+                && method == current->clone_method) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+const recipient_t *transaction_next_failed_recipient(
+    const transaction_t *transaction, const recipient_t *recipient)
+{
+    recipient_tree_entry_t *item = NULL == recipient
+        ? RB_MIN(recipient_tree, (recipient_tree_t *) &transaction->__recipients)
+        : RB_NEXT(recipient_tree, NULL, (recipient_tree_entry_t *) recipient);
+
+    while (NULL != item && item->recipient.status != RECIPIENT_FAILED) {
+        item = RB_NEXT(recipient_tree, NULL, item);
+    }
+
+    return NULL == item ? NULL : &item->recipient;
+}
+
+char *transaction_pack_recipients(const transaction_t *transaction,
+    size_t *count, size_t *size)
+{
+    recipient_tree_entry_t *item;
+
+    *count = 0;
+    *size = 0;
+
+    RB_FOREACH(item, recipient_tree, (recipient_tree_t *) &transaction->__recipients) {
+        *size += strlen(item->recipient.address) + 1;
+        ++*count;
+    }
+
+    char *recipients = malloc(*size);
+
+    if (NULL == recipients) {
+        CALL_ERR_ARGS("malloc", "%lu", *size);
+        return NULL;
+    }
+
+    char *position = recipients;
+
+    RB_FOREACH(item, recipient_tree, (recipient_tree_t *) &transaction->__recipients) {
+        const size_t address_size = strlen(item->recipient.address) + 1;
+
+        memcpy(position, item->recipient.address, address_size);
+        position += address_size;
+    }
+
+    return recipients;
+}
+
+const char *transaction_write_path(const transaction_t *transaction)
+{
+    if (0 == transaction->__async_writes_count) {
+        return 0 == transaction->__sync_writes_count ? "none" : "sync";
+    }
+
+    return 0 == transaction->__sync_writes_count ? "async" : "mixed";
+}
@@ -2,46 +2,125 @@
 #define SMTP_SERVER_TRANSACTION_H
 
 #include <aio.h>
+#include <bsd/sys/queue.h>
+#include <bsd/sys/tree.h>
+#include <signal.h>
 
 #include "buffer.h"
+#include "helper_pool.h"
 #include "log.h"
 #include "maildir.h"
 #include "settings.h"
+#include "spool.h"
 
-typedef LIST_HEAD(recipient_list, recipient_list_entry) recipient_list_t;
+#define TRANSACTION_AIO_SIGNAL SIGRTMIN
+
+typedef enum recipient_status {
+    RECIPIENT_PENDING,
+    RECIPIENT_DELIVERED,
+    RECIPIENT_FAILED
+} recipient_status_t;
 
 typedef struct recipient {
     char *address;
-    maildir_t maildir;
+    maildir_t *maildir;
+    recipient_status_t status;
+    maildir_clone_method_t clone_method;
+    int root;
 } recipient_t;
 
-typedef struct recipient_list_entry {
+typedef enum commit_stage {
+    COMMIT_WRITE,
+    COMMIT_DATA_SYNC,
+    COMMIT_FAN_OUT,
+    COMMIT_DIR_SYNC
+} commit_stage_t;
+
+typedef enum transaction_status {
+    TRANSACTION_DONE,
+    TRANSACTION_WAIT,
+    TRANSACTION_ERROR
+} transaction_status_t;
+
+typedef enum transaction_job_kind {
+    TRANSACTION_JOB_CREATE,
+    TRANSACTION_JOB_APPEND,
+    TRANSACTION_JOB_COMMIT
+} transaction_job_kind_t;
+
+typedef struct write_buffer {
+    struct aiocb aiocb;
+    char *data;
+    size_t size;
+    int is_pending;
+} write_buffer_t;
+
+typedef struct cancelled_write {
+    write_buffer_t *buffers;
+    size_t count;
+    int fd;
+    TAILQ_ENTRY(cancelled_write) entry;
+} cancelled_write_t;
+
+typedef struct recipient_tree_entry {
    recipient_t recipient;
-   LIST_ENTRY(recipient_list_entry) entry;
-} recipient_list_entry_t;
+   RB_ENTRY(recipient_tree_entry) entry;
+} recipient_tree_entry_t;
+
+typedef RB_HEAD(recipient_tree, recipient_tree_entry) recipient_tree_t;
 
 typedef struct transaction {
     const settings_t *settings;
     log_t *log;
+    spool_t *spool;
+    spool_lane_t *__lane;
     char __data_filename[PATH_SIZE];
     char *__domain;
     char *__header;
     char *__reverse_path;
     int __is_active;
+    commit_stage_t __commit_stage;
+    commit_queue_t *__commit_queue;
+    int __is_commit_failed;
+    int __is_tmpfile;
+    int __intent_slot;
     int __sock;
-    recipient_list_t __recipient_list;
+    size_t __sync_writes_count;
+    size_t __async_writes_count;
+    recipient_tree_t __recipients;
+    recipient_tree_entry_t *__fan_out_next;
+    const recipient_t *__copy_source;
+    size_t __delivered_count;
+    size_t __failed_count;
     struct aiocb __aiocb;
+    buffer_t __spooled_data;
     struct recipient *__first_recipient;
+    TAILQ_ENTRY(transaction) __commit_entry;
+    helper_job_t __job;
+    transaction_job_kind_t __job_kind;
+    int __is_job_submitted;
+    int __job_fd;
+    transaction_status_t __job_status;
+    const char *__pending_value;
+    size_t __pending_size;
+    size_t __declared_size;
+    size_t __data_size;
+    uint64_t __body_hash;
+    off_t __deduplicated_size;
+    compressor_t *__compressor;
+    int __is_compression_ended;
+    int __is_compressed_pending;
+    size_t __compressed_size;
+    int __is_oversized;
+    int __is_spliced;
+    int __is_committing;
+    size_t __unpersisted_size;
+    write_buffer_t *__write_buffers;
+    size_t __fill_index;
 } transaction_t;
 
-typedef enum transaction_status {
-    TRANSACTION_DONE,
-    TRANSACTION_WAIT,
-    TRANSACTION_ERROR
-} transaction_status_t;
-
 int transaction_init(transaction_t *transaction, const settings_t *settings,
-    log_t *log, const int sock);
+    log_t *log, spool_t *spool, const int sock);
 void transaction_destroy(transaction_t *transaction);
 void transaction_rollback(transaction_t *transaction);
 int transaction_set_domain(transaction_t *transaction, const char *value,
@@ -50,14 +129,44 @@ int transaction_set_reverse_path(transaction_t *transaction, const char *value,
     const size_t length);
 int transaction_add_forward_path(transaction_t *transaction, const char *value,
     const size_t length);
+quota_status_t transaction_check_quota(transaction_t *transaction,
+    const char *value, const size_t length);
 void transaction_reset_data(transaction_t *transaction);
 ssize_t transaction_add_data(transaction_t *transaction,
     const char *value, const size_t size);
+int transaction_can_splice(transaction_t *transaction, const size_t size);
+ssize_t transaction_splice_data(transaction_t *transaction, const int sock,
+    const size_t size);
+int transaction_is_oversized(const transaction_t *transaction);
+int transaction_set_declared_size(transaction_t *transaction,
+    const size_t size);
+size_t transaction_expected_size(const transaction_t *transaction);
 transaction_status_t transaction_add_data_status(transaction_t *transaction);
 int transaction_add_header(transaction_t *transaction);
 int transaction_begin(transaction_t *transaction);
 transaction_status_t transaction_commit(transaction_t *transaction);
+void transaction_flush_commit_queue(spool_t *spool, const int tick_interval);
+void transaction_reap_cancelled_writes(spool_t *spool, const int is_blocking);
 int transaction_is_active(const transaction_t *transaction);
+int transaction_is_busy(transaction_t *transaction);
 const char *transaction_data_filename(const transaction_t *transaction);
+int transaction_data_fd(const transaction_t *transaction);
+recipient_t *transaction_first_recipient(const transaction_t *transaction);
+int transaction_lane_root(const transaction_t *transaction);
+const recipient_t *transaction_copy_source(const transaction_t *transaction);
+int transaction_is_tmpfile(const transaction_t *transaction);
+void transaction_set_tmpfile(transaction_t *transaction, const int value);
+int *transaction_intent_slot(transaction_t *transaction);
+const char *transaction_write_path(const transaction_t *transaction);
+size_t transaction_delivered_count(const transaction_t *transaction);
+size_t transaction_failed_count(const transaction_t *transaction);
+off_t transaction_deduplicated_size(const transaction_t *transaction);
+size_t transaction_clone_count(const transaction_t *transaction,
+    const maildir_clone_method_t method);
+const recipient_t *transaction_next_failed_recipient(
+    const transaction_t *transaction, const recipient_t *recipient);
+char *transaction_pack_recipients(const transaction_t *transaction,
+    size_t *count, size_t *size);
+const char *transaction_recipient_domain(const recipient_t *recipient);
 
 #endif
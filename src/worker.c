@@ -1,12 +1,18 @@
 #include <arpa/inet.h>
+#include <bsd/sys/queue.h>
 #include <bsd/sys/tree.h>
 #include <poll.h>
+#include <sys/param.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 
 #include "protocol.h"
 #include "signal_handle.h"
+#include "time.h"
 #include "worker.h"
 
+#define TICK_INTERVAL 1000
+
 static void do_nothing(int signum) {}
 
 static int set_worker_signals_handle()
@@ -77,6 +83,7 @@ typedef struct client_node {
     int sock;
     context_t context;
     RB_ENTRY(client_node) entry;
+    TAILQ_ENTRY(client_node) retired_entry;
 } client_node_t;
 
 static int client_node_cmp(client_node_t *first, client_node_t *second)
@@ -87,26 +94,65 @@ static int client_node_cmp(client_node_t *first, client_node_t *second)
 RB_HEAD(client_tree, client_node);
 RB_GENERATE(client_tree, client_node, entry, client_node_cmp)
 
+TAILQ_HEAD(client_queue, client_node);
+
 typedef struct server {
     server_status_t status;
     int pipe_fd;
+    int aio_fd;
+    int tick_interval;
+    struct timeval last_tick_time;
     struct client_tree clients;
+    struct client_queue retired_clients;
     size_t clients_count;
     const settings_t *settings;
     log_t *log;
+    spool_t spool;
+    int is_flow_stopped;
+    size_t notifier_pollfds_begin;
+    size_t notifier_pollfds_end;
 } server_t;
 
-static void server_init(server_t *server, const int pipe_fd,
+static int server_init(server_t *server, const int pipe_fd,
     const settings_t *settings, log_t *log)
 {
     struct client_tree client_tree = RB_INITIALIZER(&client_tree);
 
+    const int aio_fd = open_signal_fd(TRANSACTION_AIO_SIGNAL);
+
+    if (aio_fd < 0) {
+        return -1;
+    }
+
+    if (gettimeofday(&server->last_tick_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        if (close(aio_fd) < 0) {
+            CALL_ERR("close");
+        }
+        return -1;
+    }
+
+    if (spool_init(&server->spool, settings) < 0) {
+        if (close(aio_fd) < 0) {
+            CALL_ERR("close");
+        }
+        return -1;
+    }
+
     server->status = SERVER_RUNNING;
     server->pipe_fd = pipe_fd;
+    server->aio_fd = aio_fd;
+    server->tick_interval = MIN(TICK_INTERVAL, settings->timeout);
     server->clients = client_tree;
+    TAILQ_INIT(&server->retired_clients);
     server->clients_count = 0;
     server->settings = settings;
     server->log = log;
+    server->is_flow_stopped = 0;
+    server->notifier_pollfds_begin = 0;
+    server->notifier_pollfds_end = 0;
+
+    return 0;
 }
 
 static void server_destroy(server_t *server)
@@ -115,6 +161,7 @@ static void server_destroy(server_t *server)
 
     RB_FOREACH_SAFE(node, client_tree, &server->clients, temp) {
         RB_REMOVE(client_tree, &server->clients, node);
+        context_destroy(&node->context);
 
         if (close(node->sock) < 0) {
             CALL_ERR("close");
@@ -123,6 +170,19 @@ static void server_destroy(server_t *server)
         free(node);
     }
 
+    TAILQ_FOREACH_SAFE(node, &server->retired_clients, retired_entry, temp) {
+        TAILQ_REMOVE(&server->retired_clients, node, retired_entry);
+        context_destroy(&node->context);
+        free(node);
+    }
+
+    if (close(server->aio_fd) < 0) {
+        CALL_ERR("close");
+    }
+
+    transaction_reap_cancelled_writes(&server->spool, 1);
+    spool_destroy(&server->spool);
+
     if (server->pipe_fd < 0) {
         return;
     }
@@ -134,6 +194,158 @@ static void server_destroy(server_t *server)
     log_close(server->log);
 }
 
+static int serve_client_in(context_t *context)
+{
+    buffer_t *in_buf = &context->in_message;
+
+    while (1) {
+        const size_t space = buffer_space(in_buf);
+
+        if (0 == space) {
+            break;
+        }
+
+        const ssize_t received = recv(context->socket, buffer_write_begin(in_buf),
+            space, 0);
+
+        if (received < 0) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                break;
+            }
+            CALL_ERR("recv");
+            return -1;
+        }
+
+        if (0 == received) {
+            return 1;
+        }
+
+        buffer_shift_write(in_buf, received);
+
+        if (received <= space) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int is_chunk_spliced(context_t *context)
+{
+    return context->is_wait_transition && context->chunk_left > 0
+        && buffer_left(&context->in_message) == 0
+        && transaction_can_splice(&context->transaction, context->chunk_left);
+}
+
+static int splice_client_in(context_t *context)
+{
+    const ssize_t spliced = transaction_splice_data(&context->transaction,
+        context->socket, context->chunk_left);
+
+    if (spliced < 0) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno) {
+            return 0;
+        }
+
+        context->is_closing = 1;
+        BUFFER_TAILQ_PUSH_BACK_STRING(&context->out_message_queue,
+            "421 Service not available, closing transmission channel" CRLF);
+
+        return -1;
+    }
+
+    if (0 == spliced) {
+        return 1;
+    }
+
+    context->chunk_left -= spliced;
+
+    if (gettimeofday(&context->last_action_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+    }
+
+    return 0;
+}
+
+static int serve_client_out(context_t *context)
+{
+    while (!buffer_tailq_empty(&context->out_message_queue)) {
+        buffer_t *out_buf = buffer_tailq_front(&context->out_message_queue);
+
+        if (buffer_left(out_buf) > 0) {
+            const ssize_t sent = send(context->socket, buffer_read_begin(out_buf),
+                buffer_left(out_buf), 0);
+
+            if (sent < 0) {
+                if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                    break;
+                }
+                CALL_ERR("send");
+                return -1;
+            }
+
+            buffer_shift_read(out_buf, sent);
+        }
+
+        if (buffer_left(out_buf) == 0) {
+            buffer_tailq_pop_front(&context->out_message_queue);
+        }
+    }
+
+    return 0;
+}
+
+static int is_client_closing(const context_t *context)
+{
+    return context->is_closing
+        || SMTP_SERVER_ST_DONE == context->state
+        || SMTP_SERVER_ST_INVALID == context->state;
+}
+
+static void process_client_input(context_t *context)
+{
+    while (!is_client_closing(context)) {
+        const te_smtp_server_state state = context->state;
+        const size_t left = buffer_left(&context->in_message);
+        const int is_wait_transition = context->is_wait_transition;
+
+        if (process_client(context) < 0) {
+            log_write(context->log, "[%s] process client error: %s",
+                context->uuid, strerror(errno));
+        }
+
+        if (context->is_wait_transition
+                || (state == context->state
+                    && left == buffer_left(&context->in_message)
+                    && is_wait_transition == context->is_wait_transition)) {
+            break;
+        }
+    }
+
+    if (!context->is_wait_transition && buffer_space(&context->in_message) == 0) {
+        buffer_drop_read(&context->in_message);
+    }
+}
+
+static void flush_client(context_t *context)
+{
+    if (serve_client_out(context) < 0) {
+        log_write(context->log, "[%s] send command error: %s",
+            context->uuid, strerror(errno));
+    }
+
+    if (is_client_closing(context)) {
+        if (shutdown(context->socket, SHUT_RD) < 0) {
+            CALL_ERR("shutdown");
+        }
+        if (buffer_tailq_empty(&context->out_message_queue)) {
+            if (shutdown(context->socket, SHUT_RDWR) < 0) {
+                CALL_ERR("shutdown");
+            }
+        }
+    }
+}
+
 static int add_client(server_t *server, const int sock)
 {
     client_node_t *node = malloc(sizeof(client_node_t));
@@ -145,7 +357,8 @@ static int add_client(server_t *server, const int sock)
 
     node->sock = sock;
 
-    if (context_init(&node->context, sock, server->settings, server->log) < 0) {
+    if (context_init(&node->context, sock, server->settings, server->log,
+            &server->spool) < 0) {
         free(node);
         return -1;
     }
@@ -172,6 +385,9 @@ static int add_client(server_t *server, const int sock)
     log_write(server->log, "[%s] process connection from %s:%d",
         node->context.uuid, hostname, addr.sin_port);
 
+    process_client_input(&node->context);
+    flush_client(&node->context);
+
     return 0;
 }
 
@@ -181,15 +397,35 @@ static void remove_client_node(server_t *server, client_node_t *node)
         return;
     }
 
-    context_destroy(&node->context);
-
     --server->clients_count;
 
     RB_REMOVE(client_tree, &server->clients, node);
 
+    if (transaction_is_busy(&node->context.transaction)) {
+        TAILQ_INSERT_TAIL(&server->retired_clients, node, retired_entry);
+        return;
+    }
+
+    context_destroy(&node->context);
+
     free(node);
 }
 
+static void reap_retired_clients(server_t *server)
+{
+    client_node_t *node, *temp;
+
+    TAILQ_FOREACH_SAFE(node, &server->retired_clients, retired_entry, temp) {
+        if (transaction_is_busy(&node->context.transaction)) {
+            continue;
+        }
+
+        TAILQ_REMOVE(&server->retired_clients, node, retired_entry);
+        context_destroy(&node->context);
+        free(node);
+    }
+}
+
 static void remove_client(server_t *server, context_t *context)
 {
     const int sock = context->socket;
@@ -247,64 +483,6 @@ static int process_pipe(server_t *server, struct pollfd *pollfd)
     return 0;
 }
 
-static int serve_client_in(context_t *context)
-{
-    buffer_t *in_buf = &context->in_message;
-
-    while (1) {
-        const size_t space = buffer_space(in_buf);
-
-        if (0 == space) {
-            break;
-        }
-
-        const ssize_t received = recv(context->socket, buffer_write_begin(in_buf),
-            space, 0);
-
-        if (received < 0) {
-            CALL_ERR("recv");
-            return -1;
-        }
-
-        if (0 == received) {
-            break;
-        }
-
-        buffer_shift_write(in_buf, received);
-
-        if (received <= space) {
-            break;
-        }
-    }
-
-    return 0;
-}
-
-static int serve_client_out(context_t *context)
-{
-    while (!buffer_tailq_empty(&context->out_message_queue)) {
-        buffer_t *out_buf = buffer_tailq_front(&context->out_message_queue);
-
-        if (buffer_left(out_buf) > 0) {
-            const ssize_t sent = send(context->socket, buffer_read_begin(out_buf),
-                buffer_left(out_buf), 0);
-
-            if (sent < 0) {
-                CALL_ERR("send");
-                return -1;
-            }
-
-            buffer_shift_read(out_buf, sent);
-        }
-
-        if (buffer_left(out_buf) == 0) {
-            buffer_tailq_pop_front(&context->out_message_queue);
-        }
-    }
-
-    return 0;
-}
-
 static context_t *find_client_context(server_t *server, const int sock)
 {
     client_node_t what = { .sock = sock };
@@ -345,51 +523,165 @@ static int serve_client(server_t *server, struct pollfd *pollfd)
     }
 
     if ((pollfd->revents & POLLIN) != 0) {
-        if (serve_client_in(context) < 0) {
-            log_write(context->log, "[%s] receive command error: %s",
-                context->uuid, strerror(errno));
+        const int result = is_chunk_spliced(context)
+            ? splice_client_in(context) : serve_client_in(context);
+
+        switch (result) {
+            case -1:
+                log_write(context->log, "[%s] receive command error: %s",
+                    context->uuid, strerror(errno));
+                break;
+            case 1:
+                log_write(context->log, "[%s] remote socket closed", context->uuid);
+                remove_client(server, context);
+                return 0;
+            default:
+                break;
         }
     }
 
-    if (process_client(context) < 0) {
-        log_write(context->log, "[%s] process client error: %s",
-            context->uuid, strerror(errno));
+    if (!context->is_wait_transition || context->chunk_left > 0) {
+        process_client_input(context);
     }
 
-    if ((pollfd->revents & POLLOUT) != 0) {
-        if (serve_client_out(context) < 0) {
-            log_write(context->log, "[%s] send command error: %s",
-                context->uuid, strerror(errno));
-        }
+    flush_client(context);
+
+    return 0;
+}
+
+static void resume_client(server_t *server, const int sock)
+{
+    client_node_t what = { .sock = sock };
+    client_node_t *node = RB_FIND(client_tree, &server->clients, &what);
+
+    if (NULL == node || !node->context.is_wait_transition) {
+        return;
     }
 
-    if (SMTP_SERVER_ST_DONE == context->state
-            || SMTP_SERVER_ST_INVALID == context->state) {
-        if (shutdown(context->socket, SHUT_RD) < 0) {
-            CALL_ERR("shutdown");
-        }
-        if (buffer_tailq_empty(&context->out_message_queue)) {
-            if (shutdown(context->socket, SHUT_RDWR) < 0) {
-                CALL_ERR("shutdown");
+    process_client_input(&node->context);
+    flush_client(&node->context);
+}
+
+static int process_aio(server_t *server)
+{
+    struct signalfd_siginfo info;
+
+    while (1) {
+        const ssize_t size = read(server->aio_fd, &info, sizeof(info));
+
+        if (size < 0) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                break;
             }
+            CALL_ERR("read");
+            return -1;
         }
+
+        if (size != sizeof(info)) {
+            PRINT_STDERR("error: bad signalfd_siginfo size: %ld", size);
+            return -1;
+        }
+
+        resume_client(server, info.ssi_int);
     }
 
+    reap_retired_clients(server);
+    transaction_reap_cancelled_writes(&server->spool, 0);
+
     return 0;
 }
 
-static int serve_socket(server_t *server, struct pollfd *pollfd)
+static int is_tick_client(context_t *context, struct timeval *current_time)
+{
+    return context->is_wait_transition
+        || mtimeval_diff(&context->last_action_time, current_time)
+            > context->settings->timeout;
+}
+
+static void process_tick(server_t *server)
+{
+    struct timeval current_time;
+
+    if (gettimeofday(&current_time, NULL) < 0) {
+        CALL_ERR("gettimeofday");
+        return;
+    }
+
+    if (mtimeval_diff(&server->last_tick_time, &current_time) < server->tick_interval) {
+        return;
+    }
+
+    server->last_tick_time = current_time;
+
+    spool_tick(&server->spool);
+    reap_retired_clients(server);
+    transaction_reap_cancelled_writes(&server->spool, 0);
+
+    client_node_t *node, *temp;
+
+    RB_FOREACH_SAFE(node, client_tree, &server->clients, temp) {
+        if (is_tick_client(&node->context, &current_time)) {
+            process_client_input(&node->context);
+            flush_client(&node->context);
+        }
+    }
+}
+
+static void process_commit_queue(server_t *server)
+{
+    transaction_flush_commit_queue(&server->spool, server->tick_interval);
+}
+
+static int is_notifier_pollfd(const server_t *server, const size_t index)
+{
+    return index >= server->notifier_pollfds_begin
+        && index < server->notifier_pollfds_end;
+}
+
+static int serve_socket(server_t *server, struct pollfd *pollfd,
+    const size_t index)
 {
     if (pollfd->fd == server->pipe_fd) {
         return process_pipe(server, pollfd);
+    } else if (pollfd->fd == server->aio_fd) {
+        return process_aio(server);
+    } else if (is_notifier_pollfd(server, index)) {
+        notifier_serve(server->spool.notifier, pollfd,
+            index - server->notifier_pollfds_begin);
+        return 0;
     } else {
         return serve_client(server, pollfd);
     }
 }
 
+static int is_data_session(const context_t *context)
+{
+    return SMTP_SERVER_ST_WAIT_MORE_DATA == context->state
+        || context->chunk_left > 0;
+}
+
+static short client_events(server_t *server, context_t *context)
+{
+    short events = POLLERR | POLLHUP;
+
+    if (!is_client_closing(context) && buffer_space(&context->in_message) > 0
+            && !(server->is_flow_stopped && is_data_session(context))) {
+        events |= POLLIN;
+    }
+
+    if (!buffer_tailq_empty(&context->out_message_queue)) {
+        events |= POLLOUT;
+    }
+
+    return events;
+}
+
 static struct pollfd *alloc_pollfds(server_t *server, size_t *count)
 {
-    const size_t pollfds_count = (server->pipe_fd < 0 ? 0 : 1) + server->clients_count;
+    notifier_t *notifier = server->spool.notifier;
+    const size_t pollfds_count = (server->pipe_fd < 0 ? 0 : 1) + 1
+        + server->clients_count
+        + (NULL == notifier ? 0 : notifier_pollfds_count(notifier));
 
     if (NULL != count) {
         *count = pollfds_count;
@@ -410,11 +702,24 @@ static struct pollfd *alloc_pollfds(server_t *server, size_t *count)
 
     RB_FOREACH_SAFE(node, client_tree, &server->clients, temp) {
         pollfds[pollfds_index].fd = node->sock;
-        pollfds[pollfds_index].events = POLLIN | POLLOUT | POLLERR| POLLHUP;
+        pollfds[pollfds_index].events = client_events(server, &node->context);
         pollfds[pollfds_index].revents = 0;
         ++pollfds_index;
     }
 
+    pollfds[pollfds_index].fd = server->aio_fd;
+    pollfds[pollfds_index].events = POLLIN;
+    pollfds[pollfds_index].revents = 0;
+    ++pollfds_index;
+
+    server->notifier_pollfds_begin = pollfds_index;
+
+    if (NULL != notifier) {
+        pollfds_index += notifier_fill_pollfds(notifier, &pollfds[pollfds_index]);
+    }
+
+    server->notifier_pollfds_end = pollfds_index;
+
     if (server->pipe_fd >= 0) {
         pollfds[pollfds_count - 1].fd = server->pipe_fd;
         pollfds[pollfds_count - 1].events = POLLIN | POLLERR| POLLHUP;
@@ -424,8 +729,28 @@ static struct pollfd *alloc_pollfds(server_t *server, size_t *count)
     return pollfds;
 }
 
+static void update_flow_control(server_t *server)
+{
+    const int is_flow_stopped = spool_is_flow_stopped(&server->spool);
+
+    if (is_flow_stopped == server->is_flow_stopped) {
+        return;
+    }
+
+    server->is_flow_stopped = is_flow_stopped;
+
+    log_write(server->log, "flow control: %s reading data sessions, unpersisted bytes: %lu",
+        is_flow_stopped ? "stop" : "resume", server->spool.unpersisted_size);
+}
+
 static int single_serve(server_t *server)
 {
+    update_flow_control(server);
+
+    if (NULL != server->spool.notifier) {
+        notifier_remove_closed(server->spool.notifier);
+    }
+
     size_t pollfds_count;
     struct pollfd *pollfds = alloc_pollfds(server, &pollfds_count);
 
@@ -433,12 +758,17 @@ static int single_serve(server_t *server)
         return 0;
     }
 
-    const int poll_result = poll(pollfds, pollfds_count, 1000);
+    const int timeout = spool_commit_queue_timeout(&server->spool,
+        server->tick_interval);
+    const int poll_result = poll(pollfds, pollfds_count, timeout);
     int result = 0;
 
     if (poll_result > 0) {
         for (size_t i = 0; 0 == result && i < pollfds_count; ++i) {
-            if (serve_socket(server, &pollfds[i]) < 0) {
+            if (0 == pollfds[i].revents) {
+                continue;
+            }
+            if (serve_socket(server, &pollfds[i], i) < 0) {
                 result = -1;
             }
         }
@@ -448,6 +778,11 @@ static int single_serve(server_t *server)
 
     free(pollfds);
 
+    if (0 == result) {
+        process_commit_queue(server);
+        process_tick(server);
+    }
+
     return result;
 }
 
@@ -475,7 +810,9 @@ static int worker_run(const int pipe_fd, const settings_t *settings, log_t *log)
 
     server_t server;
 
-    server_init(&server, pipe_fd, settings, log);
+    if (server_init(&server, pipe_fd, settings, log) < 0) {
+        return -1;
+    }
 
     const int result = serve(&server);
 
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+CONFIG=${1:-etc/test_memory.cfg}
+PARALLEL_COUNT=${2:-4}
+COUNT=${3:-10}
+LARGE_SIZE=${4:-1048576}
+
+MAILDIR=$(sed -n 's/^maildir = "\(.*\)";$/\1/p' $CONFIG)
+CLOCK_TICKS=$(getconf CLK_TCK)
+
+workers_cpu() {
+    for pid in $(pgrep -P $1); do
+        awk '{print $14 + $15}' /proc/$pid/stat
+    done | awk -v ticks=$CLOCK_TICKS '{sum += $1} END {printf "%.2f", sum / ticks}'
+}
+
+stored_size() {
+    find $MAILDIR -path '*/new/*' -type f -printf '%s\n' | awk '{sum += $1} END {print sum + 0}'
+}
+
+run() {
+    local compression=$1
+    local config=var/loadtest_compression_$compression.cfg
+
+    sed "s/^compression = .*;$/compression = \"$compression\";/" $CONFIG > $config
+    rm -rf $MAILDIR
+
+    bin/smtp-server $config > /dev/null 2>&1 &
+
+    local pid=$!
+
+    sleep 1
+
+    local start=$(date +%s.%N)
+
+    test/loadtest_large.bash $PARALLEL_COUNT $COUNT $LARGE_SIZE > /dev/null 2>&1
+
+    local end=$(date +%s.%N)
+
+    CPU[$compression]=$(workers_cpu $pid)
+
+    kill -SIGINT $pid
+    wait $pid
+
+    STORED[$compression]=$(stored_size)
+    rm -f $config
+
+    awk -v start=$start -v end=$end 'BEGIN {printf "%.2f", end - start}' \
+        | xargs printf "$compression: elapsed %s s, worker cpu ${CPU[$compression]} s, stored ${STORED[$compression]} bytes\n"
+}
+
+declare -A CPU STORED
+
+run none
+run zstd
+
+awk -v cpu_none=${CPU[none]} -v cpu_zstd=${CPU[zstd]} \
+    -v stored_none=${STORED[none]} -v stored_zstd=${STORED[zstd]} 'BEGIN {
+    saved = stored_none - stored_zstd
+    cpu = cpu_zstd - cpu_none
+    printf "saved: %d bytes (%.1f%%), extra cpu: %.2f s",
+        saved, (stored_none > 0 ? 100 * saved / stored_none : 0), cpu
+    if (saved > 0) {
+        printf ", %.2f ms per saved MiB", 1000 * cpu / (saved / 1048576)
+    }
+    printf "\n"
+}'
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+CONFIG=${1:-etc/test_memory.cfg}
+PARALLEL_COUNT=${2:-4}
+COUNT=${3:-10}
+LARGE_SIZE=${4:-8388608}
+MIN_SIZE=${5:-1048576}
+
+EML_FILE=var/loadtest.eml
+LARGE_EML_FILE=var/loadtest_drop_cache.eml
+
+MAILDIR=$(sed -n 's/^maildir = "\(.*\)";$/\1/p' $CONFIG)
+
+cached_kib() {
+    awk '/^Cached:/ {print $2}' /proc/meminfo
+}
+
+run() {
+    local min_size=$1
+    local config=var/loadtest_drop_cache_$min_size.cfg
+
+    sed -e "s/^maildir_drop_cache_min_size = .*;$/maildir_drop_cache_min_size = $min_size;/" \
+        -e 's/^durability = .*;$/durability = "fdatasync";/' $CONFIG > $config
+    rm -rf $MAILDIR
+    sync
+
+    bin/smtp-server $config > /dev/null 2>&1 &
+
+    local pid=$!
+    local large_pids=()
+
+    sleep 1
+
+    local cached=$(cached_kib)
+
+    for i in $(seq 1 $PARALLEL_COUNT); do
+        test/loadtest_request.py $COUNT < $LARGE_EML_FILE > /dev/null 2>&1 &
+        large_pids+=($!)
+    done
+
+    local start=$(date +%s.%N)
+
+    test/loadtest_request.py $((COUNT * 10)) < $EML_FILE > /dev/null 2>&1
+
+    local end=$(date +%s.%N)
+
+    wait ${large_pids[@]}
+
+    CACHED[$min_size]=$(($(cached_kib) - cached))
+
+    kill -SIGINT $pid
+    wait $pid
+
+    rm -f $config
+
+    awk -v start=$start -v end=$end -v count=$((COUNT * 10)) 'BEGIN {printf "%.2f", 1000 * (end - start) / count}' \
+        | xargs printf "maildir_drop_cache_min_size = $min_size: small message %s ms, page cache growth $((CACHED[$min_size] / 1024)) MiB\n"
+}
+
+declare -A CACHED
+
+base64 -w 76 /dev/urandom | head -c $LARGE_SIZE > $LARGE_EML_FILE
+
+run 0
+run $MIN_SIZE
+
+rm -f $LARGE_EML_FILE
@@ -0,0 +1,20 @@
+#!/bin/bash
+
+EML_FILE=var/loadtest.eml
+LARGE_EML_FILE=var/loadtest_large.eml
+
+PARALLEL_COUNT=$1
+COUNT=$2
+LARGE_SIZE=${3:-8388608}
+
+base64 -w 76 /dev/urandom | head -c $LARGE_SIZE > $LARGE_EML_FILE
+
+for i in $(seq 1 $PARALLEL_COUNT); do
+    test/loadtest_request.py $COUNT < $LARGE_EML_FILE &
+done
+
+time test/loadtest_request.py $((COUNT * 10)) < $EML_FILE
+
+wait
+
+rm -f $LARGE_EML_FILE
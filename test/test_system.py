@@ -1,8 +1,14 @@
 #!/usr/bin/env python3
 # coding: utf-8
 
+import math
 import os
 import os.path
+import shutil
+import signal
+import socket
+import struct
+import subprocess
 import uuid
 
 from time import sleep
@@ -14,6 +20,183 @@ HOST = 'localhost'
 PORT = 25251
 TIMEOUT = 0.2
 COUNT = 3
+MAX_MESSAGE_SIZE = 1048576
+EHLO_REPLY = (250, b'Ok\nCHUNKING\nSIZE %d' % MAX_MESSAGE_SIZE)
+MAILDIR = 'var/mail/test_system'
+MAILDIR_SHARD_WIDTH = 2
+DELIVERY_INDEX_DIR = 'var/mail/test_system.index'
+DELIVERY_RECORD = struct.Struct('<IIqqQ256s256s480s')
+DELIVERY_RECORD_MAGIC = 0x31584944
+NOTIFY_DIR = 'var/mail/test_system.notify'
+QUOTA_SIZE = 524288
+SERVER = 'bin/smtp-server'
+MAILDIR_CAT = 'bin/smtp-maildir-cat'
+MAILDIR_SHARD = 'bin/smtp-maildir-shard'
+SHARD_MAILDIR = 'var/mail/test_shard'
+WAIT_COUNT = 100
+SEGMENT_ENTRY = struct.Struct('<IIQQII')
+SEGMENT_ENTRY_MAGIC = 0x31474553
+JOURNAL_CONFIG = 'etc/test_journal.cfg'
+JOURNAL_PORT = 25253
+JOURNAL_MAILDIR = 'var/mail/test_journal'
+JOURNAL_DIR = 'var/mail/test_journal.journal'
+QUOTA_CONFIG = 'etc/test_quota.cfg'
+QUOTA_PORT = 25254
+QUOTA_MAILDIR = 'var/mail/test_quota'
+QUOTA_TABLE_PATH = 'var/mail/test_quota.quota/table'
+QUOTA_TABLE_HEADER = struct.Struct('<II')
+QUOTA_TABLE_MAGIC = 0x32544f51
+QUOTA_SLOT = struct.Struct('<IIQqq256s256s')
+QUOTA_SLOTS = 2
+QUOTA_SLOT_BUSY = 1
+QUOTA_SLOT_READY = 2
+ROOTS_CONFIG = 'etc/test_roots.cfg'
+ROOTS_PORT = 25255
+ROOTS = ['var/mail/test_roots.0', 'var/mail/test_roots.1']
+INTENT_LOG_DIR = 'var/mail/test_roots.intent'
+INTENT_SLOT = struct.Struct('<I256s256s')
+INTENT_WRITING = 1
+INTENT_COMMITTING = 2
+FLOW_CONTROL_CONFIG = 'etc/test_flow_control.cfg'
+FLOW_CONTROL_PORT = 25257
+FLOW_CONTROL_MAILDIR = 'var/mail/test_flow_control'
+COMPRESSION_CONFIG = 'etc/test_compression.cfg'
+COMPRESSION_PORT = 25258
+COMPRESSION_MAILDIR = 'var/mail/test_compression'
+LEAST_LOADED_CONFIG = 'etc/test_roots_least_loaded.cfg'
+LEAST_LOADED_PORT = 25256
+LEAST_LOADED_ROOTS = ['var/mail/test_roots_least_loaded.0', 'var/mail/test_roots_least_loaded.1']
+
+def mailbox_new_path(domain, local, maildir=MAILDIR):
+    hash = 2166136261
+    for byte in local.encode():
+        hash = ((hash ^ byte) * 16777619) & 0xffffffff
+    digits = '%08x' % hash
+    width = MAILDIR_SHARD_WIDTH
+    return os.path.join(maildir, domain, digits[:width], digits[width:2 * width],
+        local, 'Maildir/new')
+
+def hash_root(key, roots_count):
+    hash = 14695981039346656037
+    for byte in key.encode():
+        hash = ((hash ^ byte) * 1099511628211) & 0xffffffffffffffff
+    best_score = 0
+    best_root = 0
+    for root in range(roots_count):
+        mixed = hash ^ (((root + 1) * 0x9e3779b97f4a7c15) & 0xffffffffffffffff)
+        mixed = ((mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9) & 0xffffffffffffffff
+        mixed = ((mixed ^ (mixed >> 27)) * 0x94d049bb133111eb) & 0xffffffffffffffff
+        mixed ^= mixed >> 31
+        score = -1 / math.log(((mixed >> 11) + 0.5) / 9007199254740992.0)
+        if score > best_score:
+            best_score = score
+            best_root = root
+    return best_root
+
+def start_server(config, port):
+    server = subprocess.Popen([SERVER, config], stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL)
+    for _ in range(WAIT_COUNT):
+        try:
+            socket.create_connection((HOST, port), TIMEOUT).close()
+            break
+        except OSError:
+            sleep(TIMEOUT)
+    return server
+
+def stop_server(server):
+    server.send_signal(signal.SIGINT)
+    server.wait()
+
+def wait_files(dir_path, count):
+    for _ in range(WAIT_COUNT):
+        if os.path.isdir(dir_path) and len(os.listdir(dir_path)) >= count:
+            return sorted(os.listdir(dir_path))
+        sleep(TIMEOUT)
+    return sorted(os.listdir(dir_path)) if os.path.isdir(dir_path) else []
+
+def write_segment(dir_path, name, entries):
+    os.makedirs(dir_path)
+    path = os.path.join(dir_path, name)
+    with open(path + '.seg', 'wb') as data, open(path + '.idx', 'wb') as index:
+        for id, recipients, message in entries:
+            packed_id = id.encode() + b'\0'
+            packed_recipients = b''.join(recipient.encode() + b'\0' for recipient in recipients)
+            index.write(SEGMENT_ENTRY.pack(SEGMENT_ENTRY_MAGIC, len(packed_id), data.tell(),
+                len(message), len(recipients), len(packed_recipients)))
+            index.write(packed_id + packed_recipients)
+            data.write(message)
+
+def read_segment_ids(dir_path):
+    ids = []
+    for name in sorted(os.listdir(dir_path)):
+        if not name.endswith('.idx'):
+            continue
+        with open(os.path.join(dir_path, name), 'rb') as f:
+            data = f.read()
+        offset = 0
+        while offset + SEGMENT_ENTRY.size <= len(data):
+            magic, id_size, _, _, _, recipients_size = SEGMENT_ENTRY.unpack_from(data, offset)
+            offset += SEGMENT_ENTRY.size
+            ids.append(data[offset:offset + id_size - 1].decode())
+            offset += id_size + recipients_size
+    return ids
+
+def write_quota_table(owner):
+    os.makedirs(os.path.dirname(QUOTA_TABLE_PATH))
+    with open(QUOTA_TABLE_PATH, 'wb') as f:
+        f.write(QUOTA_TABLE_HEADER.pack(QUOTA_TABLE_MAGIC, QUOTA_SLOTS))
+        for _ in range(QUOTA_SLOTS):
+            f.write(QUOTA_SLOT.pack(QUOTA_SLOT_BUSY | owner << 2, 0, 0, 0, 0, b'', b''))
+
+def quota_slot_states():
+    with open(QUOTA_TABLE_PATH, 'rb') as f:
+        data = f.read()
+    return [QUOTA_SLOT.unpack_from(data, QUOTA_TABLE_HEADER.size + n * QUOTA_SLOT.size)[0] & 3
+        for n in range(QUOTA_SLOTS)]
+
+def delivery_records():
+    for name in sorted(os.listdir(DELIVERY_INDEX_DIR)):
+        with open(os.path.join(DELIVERY_INDEX_DIR, name), 'rb') as f:
+            data = f.read()
+        for offset in range(0, len(data) - DELIVERY_RECORD.size + 1, DELIVERY_RECORD.size):
+            record = DELIVERY_RECORD.unpack_from(data, offset)
+            if record[0] == DELIVERY_RECORD_MAGIC:
+                yield tuple(field.rstrip(b'\0').decode() if isinstance(field, bytes) else field
+                    for field in record)
+
+def wait_delivery_records(domain, count):
+    for _ in range(WAIT_COUNT):
+        records = [record for record in delivery_records() if domain in record[5]]
+        if len(records) >= count:
+            return records
+        sleep(TIMEOUT)
+    return records
+
+def subscribe():
+    subscribers = []
+    for name in os.listdir(NOTIFY_DIR):
+        if name.startswith('.') or not name.endswith('.sock'):
+            continue
+        subscriber = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        subscriber.connect(os.path.join(NOTIFY_DIR, name))
+        subscriber.settimeout(TIMEOUT)
+        subscribers.append(subscriber)
+    return subscribers
+
+def receive_events(subscribers):
+    data = b''
+    for subscriber in subscribers:
+        try:
+            while True:
+                chunk = subscriber.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+        except socket.timeout:
+            pass
+        subscriber.close()
+    return [line.split('\t') for line in data.decode().splitlines()]
 
 class HeloTest(TestCase):
     def test_one_should_succeed(self):
@@ -26,34 +209,34 @@ class EhloTest(TestCase):
     def test_one_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
     def test_one_with_domain_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo('domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo('domain'), equal_to(EHLO_REPLY))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
     def test_many_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
             for _ in range(COUNT):
-                assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+                assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
 class NoopTest(TestCase):
     def test_after_ehlo_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.noop(), equal_to((250, b'Ok')))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
     def test_after_mail_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             assert_that(smtp.noop(), equal_to((250, b'Ok')))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
@@ -61,7 +244,7 @@ class NoopTest(TestCase):
     def test_after_rcpt_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
             assert_that(smtp.noop(), equal_to((250, b'Ok')))
@@ -70,7 +253,7 @@ class NoopTest(TestCase):
     def test_after_data_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
             assert_that(smtp.data('message'), equal_to((250, b'Ok')))
@@ -81,7 +264,7 @@ class MailTest(TestCase):
     def test_one_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
             assert_that(smtp.data('message'), equal_to((250, b'Ok')))
@@ -90,7 +273,7 @@ class MailTest(TestCase):
     def test_many_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             for _ in range(COUNT):
                 assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
                 assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
@@ -100,7 +283,7 @@ class MailTest(TestCase):
     def test_no_reverse_path_should_return_error(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             smtp.putcmd('mail to:')
             assert_that(smtp.getreply(), equal_to((555, b'Syntax error in reverse-path or not present')))
 
@@ -122,11 +305,125 @@ class MailTest(TestCase):
 
         assert_that(calling(run), raises(SMTPResponseException))
 
+class SizeTest(TestCase):
+    def test_ehlo_should_advertise_size(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.has_extn('size'), equal_to(True))
+            assert_that(smtp.esmtp_features['size'], equal_to(str(MAX_MESSAGE_SIZE)))
+
+    def test_declared_size_within_limit_should_succeed(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.mail('from@domain', ['SIZE=7']), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
+            assert_that(smtp.data('message'), equal_to((250, b'Ok')))
+
+    def test_declared_size_over_limit_should_return_error(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.mail('from@domain', ['SIZE=%d' % (MAX_MESSAGE_SIZE + 1)]),
+                equal_to((552, b'Message size exceeds fixed maximum message size')))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
+
+    def test_undeclared_data_over_limit_should_return_error(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
+            assert_that(smtp.data(('x' * 1000 + '\r\n') * (MAX_MESSAGE_SIZE // 1000)),
+                equal_to((552, b'Message size exceeds fixed maximum message size')))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
+
+class BdatTest(TestCase):
+    def send_chunks(self, chunks, last):
+        domain = uuid.uuid4().hex
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt(['to@%s' % domain]), equal_to((250, b'Ok')))
+            for chunk in chunks:
+                smtp.send(b'BDAT %d\r\n' % len(chunk) + chunk)
+                assert_that(smtp.getreply(), equal_to((250, b'Ok')))
+            smtp.send(b'BDAT %d LAST\r\n' % len(last) + last)
+            reply = smtp.getreply()
+            assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
+        return domain, reply
+
+    def read_message(self, domain):
+        dir_path = mailbox_new_path(domain, 'to')
+        with open(os.path.join(dir_path, os.listdir(dir_path)[0]), 'rb') as f:
+            return b'\n'.join(f.read().split(b'\n')[2:])
+
+    def test_ehlo_should_advertise_chunking(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.has_extn('chunking'), equal_to(True))
+
+    def test_last_chunk_should_deliver(self):
+        domain, reply = self.send_chunks([], b'message\r\n')
+        assert_that(reply, equal_to((250, b'Ok')))
+        assert_that(self.read_message(domain), equal_to(b'message\r\n'))
+
+    def test_many_chunks_should_deliver_concatenated(self):
+        domain, reply = self.send_chunks([b'mes', b'sa', b''], b'ge\r\n.\r\n')
+        assert_that(reply, equal_to((250, b'Ok')))
+        assert_that(self.read_message(domain), equal_to(b'message\r\n.\r\n'))
+
+    def test_large_chunks_should_deliver(self):
+        chunk = b''.join(b'%07d\r\n' % n for n in range(50000))
+        domain, reply = self.send_chunks([chunk], chunk)
+        assert_that(reply, equal_to((250, b'Ok')))
+        assert_that(self.read_message(domain), equal_to(chunk + chunk))
+
+    def test_chunk_size_over_limit_should_return_error_and_close(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt(['to@%s' % uuid.uuid4().hex]), equal_to((250, b'Ok')))
+            smtp.send(b'BDAT 99999999999999\r\n')
+            assert_that(smtp.getreply(),
+                equal_to((552, b'Message size exceeds fixed maximum message size')))
+            assert_that(calling(smtp.getreply), raises(SMTPServerDisconnected))
+
+    def test_chunks_over_limit_should_return_error(self):
+        chunk = b'x' * (MAX_MESSAGE_SIZE // 2 + 1)
+        domain, reply = self.send_chunks([chunk], chunk)
+        assert_that(reply, equal_to((552, b'Message size exceeds fixed maximum message size')))
+
+    def test_without_size_should_return_error(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
+            smtp.putcmd('bdat last')
+            assert_that(smtp.getreply(), equal_to((501, b'Syntax error in parameters or arguments')))
+            assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
+
+    def test_before_rcpt_should_return_error(self):
+        with SMTP() as smtp:
+            assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            smtp.putcmd('bdat 0 last')
+            assert_that(smtp.getreply(), equal_to((503, b'Bad sequence of commands')))
+            assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
+
 class RcptTest(TestCase):
     def test_many_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             for n in range(COUNT):
                 assert_that(smtp.rcpt(['to%d@domain' % n]), equal_to((250, b'Ok')))
@@ -136,7 +433,7 @@ class RcptTest(TestCase):
     def test_no_forward_path_should_return_error(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             smtp.putcmd('rcpt to:')
             assert_that(smtp.getreply(), equal_to((555, b'Syntax error in forward-path or not present')))
@@ -152,14 +449,14 @@ class RsetTest(TestCase):
     def test_after_ehlo_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.rset(), equal_to((250, b'Ok')))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
     def test_after_mail_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             assert_that(smtp.rset(), equal_to((250, b'Ok')))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
@@ -167,7 +464,7 @@ class RsetTest(TestCase):
     def test_after_rcpt_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
             assert_that(smtp.rcpt(['to@domain']), equal_to((250, b'Ok')))
             assert_that(smtp.rset(), equal_to((250, b'Ok')))
@@ -177,7 +474,7 @@ class VrfyTest(TestCase):
     def test_should_return_error(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
-            assert_that(smtp.ehlo(), equal_to((250, b'Ok')))
+            assert_that(smtp.ehlo(), equal_to(EHLO_REPLY))
             assert_that(smtp.vrfy('some@domain'), equal_to((502, b'Command not implemented')))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
@@ -212,14 +509,14 @@ class SpecificCommandTest(TestCase):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
             smtp.putcmd('EhLo')
-            assert_that(smtp.getreply(), equal_to((250, b'Ok')))
+            assert_that(smtp.getreply(), equal_to(EHLO_REPLY))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
     def test_leading_spaces_should_succeed(self):
         with SMTP() as smtp:
             assert_that(smtp.connect(HOST, PORT), equal_to((220, b'Service ready')))
             smtp.putcmd(' \t\n \rehlo')
-            assert_that(smtp.getreply(), equal_to((250, b'Ok')))
+            assert_that(smtp.getreply(), equal_to(EHLO_REPLY))
             assert_that(smtp.quit(), equal_to((221, b'Service closing transmission channel')))
 
 class SystemTest(TestCase):
@@ -232,10 +529,414 @@ class SystemTest(TestCase):
             smtp.ehlo()
             smtp.sendmail('from@domain', ['to@%s' % domain], message)
             smtp.quit()
-        dir_path = os.path.join('var/mail/test_system', domain, 'to/Maildir/new')
+        dir_path = mailbox_new_path(domain, 'to')
         message_file_path = os.path.join(dir_path, os.listdir(dir_path)[0])
         with open(message_file_path) as f:
             assert_that(f.read().split('\n')[2:], equal_to(message.split('\n')))
 
+    def test_send_message_larger_than_write_buffers_should_deliver_intact(self):
+        domain = uuid.uuid4().hex
+        message = ''.join('line %06d %s\n' % (n, uuid.uuid4().hex) for n in range(4096))
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            smtp.sendmail('from@domain', ['to@%s' % domain], message)
+            smtp.quit()
+        dir_path = mailbox_new_path(domain, 'to')
+        message_file_path = os.path.join(dir_path, os.listdir(dir_path)[0])
+        with open(message_file_path) as f:
+            assert_that(f.read().split('\n')[2:], equal_to(message.split('\n')))
+
+    def test_send_to_duplicate_recipients_should_deliver_once(self):
+        domain = uuid.uuid4().hex
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            smtp.sendmail('from@domain', ['to@%s' % domain] * COUNT, 'message')
+            smtp.quit()
+        dir_path = mailbox_new_path(domain, 'to')
+        assert_that(len(os.listdir(dir_path)), equal_to(1))
+
+    def test_send_to_many_recipients_should_deliver_to_all(self):
+        domains = [uuid.uuid4().hex for _ in range(COUNT)]
+        recipients = ['to%d@%s' % (n, domain) for domain in domains for n in range(100)]
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            smtp.sendmail('from@domain', recipients, 'message')
+            smtp.quit()
+        for recipient in recipients:
+            local, domain = recipient.split('@')
+            dir_path = mailbox_new_path(domain, local)
+            assert_that(len(os.listdir(dir_path)), equal_to(1))
+
+    def test_send_with_failed_recipient_should_retract_delivered_copies(self):
+        domain = uuid.uuid4().hex
+        failed_path = os.path.dirname(mailbox_new_path(domain, 'failed'))
+        os.makedirs(os.path.join(failed_path, 'tmp'))
+        os.makedirs(os.path.join(failed_path, 'cur'))
+        open(os.path.join(failed_path, 'new'), 'w').close()
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt('to@%s' % domain), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt('failed@%s' % domain), equal_to((250, b'Ok')))
+            assert_that(smtp.data('message'),
+                equal_to((451, b'Requested action aborted: local error in processing')))
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            smtp.quit()
+        assert_that(os.listdir(mailbox_new_path(domain, 'to')), equal_to([]))
+
+    def test_send_same_large_body_twice_should_deliver_intact_copies(self):
+        domain = uuid.uuid4().hex
+        body = ''.join('line %06d %s\n' % (n, uuid.uuid4().hex) for n in range(4096))
+        messages = {'first': body, 'second': body, 'changed': body[:-2] + 'x\n'}
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            for local, message in messages.items():
+                assert_that(smtp.sendmail('from@domain', ['%s@%s' % (local, domain)], message),
+                    equal_to({}))
+            smtp.quit()
+        for local, message in messages.items():
+            dir_path = mailbox_new_path(domain, local)
+            with open(os.path.join(dir_path, os.listdir(dir_path)[0])) as f:
+                assert_that(f.read().split('\n')[2:], equal_to(message.split('\n')))
+
+    def test_send_message_should_append_delivery_records(self):
+        domain = uuid.uuid4().hex
+        recipients = ['to%d@%s' % (n, domain) for n in range(COUNT)]
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            smtp.sendmail('from@domain', recipients, 'message')
+            smtp.quit()
+        records = wait_delivery_records(domain, COUNT)
+        assert_that(len(records), equal_to(COUNT))
+        for record in records:
+            mailbox, filename, size, sender, count = record[5], record[6], record[4], record[7], record[1]
+            file_path = os.path.join(mailbox, 'new', filename)
+            assert_that(os.path.getsize(file_path), equal_to(size))
+            assert_that(sender, equal_to('from@domain'))
+            assert_that(count, equal_to(COUNT))
+
+    def test_send_message_should_notify_subscribers(self):
+        subscribers = subscribe()
+        domain = uuid.uuid4().hex
+        recipients = ['to%d@%s' % (n, domain) for n in range(COUNT)]
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            smtp.sendmail('from@domain', recipients, 'message')
+            smtp.quit()
+        events = [event for event in receive_events(subscribers) if domain in event[2]]
+        assert_that(len(events), equal_to(COUNT))
+        for kind, size, mailbox, filename in events:
+            assert_that(kind, equal_to('D'))
+            file_path = os.path.join(mailbox, 'new', filename)
+            assert_that(os.path.getsize(file_path), equal_to(int(size)))
+
+    def test_send_over_quota_should_reject_recipient(self):
+        domain = uuid.uuid4().hex
+        message = ('x' * 1000 + '\r\n') * (QUOTA_SIZE // 3 // 1002 + 1)
+        with SMTP() as smtp:
+            smtp.connect(HOST, PORT)
+            smtp.ehlo()
+            for _ in range(2):
+                assert_that(smtp.sendmail('from@domain', ['to@%s' % domain], message), equal_to({}))
+            assert_that(smtp.mail('from@domain', ['SIZE=%d' % len(message)]), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt('to@%s' % domain), equal_to((452, b'Mailbox quota exceeded')))
+            assert_that(smtp.rcpt('other@%s' % domain), equal_to((250, b'Ok')))
+            assert_that(smtp.rset(), equal_to((250, b'Ok')))
+            assert_that(smtp.mail('from@domain', ['SIZE=%d' % (QUOTA_SIZE + 1)]), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt('other@%s' % domain),
+                equal_to((552, b'Message size exceeds mailbox quota')))
+            smtp.quit()
+        assert_that(len(os.listdir(mailbox_new_path(domain, 'to'))), equal_to(2))
+
+class JournalTest(TestCase):
+    @classmethod
+    def setUpClass(cls):
+        shutil.rmtree(JOURNAL_MAILDIR, ignore_errors=True)
+        shutil.rmtree(JOURNAL_DIR, ignore_errors=True)
+        cls.domain = uuid.uuid4().hex
+        os.makedirs(JOURNAL_MAILDIR)
+        with open(os.path.join(JOURNAL_MAILDIR, 'poisoned-%s' % cls.domain), 'w'):
+            pass
+        write_segment(os.path.join(JOURNAL_DIR, '0000000001-1'), '0000000001-1-000000', [
+            ('poisoned-id', ['to@poisoned-%s' % cls.domain], b'poisoned message\r\n'),
+            ('replayed-id', ['replayed@%s' % cls.domain, 'other@%s' % cls.domain],
+                b'replayed message\r\n'),
+        ])
+        cls.server = start_server(JOURNAL_CONFIG, JOURNAL_PORT)
+
+    @classmethod
+    def tearDownClass(cls):
+        stop_server(cls.server)
+
+    def test_send_message_should_deliver_in_background(self):
+        domain = uuid.uuid4().hex
+        recipients = ['to%d@%s' % (n, domain) for n in range(COUNT)]
+        with SMTP() as smtp:
+            smtp.connect(HOST, JOURNAL_PORT)
+            smtp.ehlo()
+            assert_that(smtp.sendmail('from@domain', recipients, 'message'), equal_to({}))
+            smtp.quit()
+        for n in range(COUNT):
+            dir_path = mailbox_new_path(domain, 'to%d' % n, JOURNAL_MAILDIR)
+            files = wait_files(dir_path, 1)
+            assert_that(len(files), equal_to(1))
+            with open(os.path.join(dir_path, files[0])) as f:
+                assert_that(f.read().split('\n')[2:], equal_to(['message', '']))
+
+    def test_replay_should_deliver_dead_worker_journal(self):
+        for local in ('replayed', 'other'):
+            dir_path = mailbox_new_path(self.domain, local, JOURNAL_MAILDIR)
+            assert_that(wait_files(dir_path, 1), equal_to(['replayed-id']))
+            with open(os.path.join(dir_path, 'replayed-id'), 'rb') as f:
+                assert_that(f.read(), equal_to(b'replayed message\r\n'))
+
+    def test_replay_should_quarantine_poisoned_entry(self):
+        quarantine_path = os.path.join(JOURNAL_DIR, '.quarantine')
+        wait_files(quarantine_path, 2)
+        assert_that(read_segment_ids(quarantine_path), equal_to(['poisoned-id']))
+        for _ in range(WAIT_COUNT):
+            if not os.path.exists(os.path.join(JOURNAL_DIR, '0000000001-1')):
+                break
+            sleep(TIMEOUT)
+        assert_that(os.path.exists(os.path.join(JOURNAL_DIR, '0000000001-1')), equal_to(False))
+
+class QuotaTest(TestCase):
+    @classmethod
+    def setUpClass(cls):
+        shutil.rmtree(QUOTA_MAILDIR, ignore_errors=True)
+        shutil.rmtree(os.path.dirname(QUOTA_TABLE_PATH), ignore_errors=True)
+        dead = subprocess.Popen(['true'])
+        dead.wait()
+        write_quota_table(dead.pid)
+        cls.server = start_server(QUOTA_CONFIG, QUOTA_PORT)
+
+    @classmethod
+    def tearDownClass(cls):
+        stop_server(cls.server)
+
+    def check_quota(self, recipient, message, reply):
+        with SMTP() as smtp:
+            smtp.connect(HOST, QUOTA_PORT)
+            smtp.ehlo()
+            assert_that(smtp.mail('from@domain', ['SIZE=%d' % len(message)]), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt(recipient), equal_to(reply))
+            smtp.quit()
+
+    def test_full_table_should_reuse_slots_of_emptied_mailboxes(self):
+        domain = uuid.uuid4().hex
+        message = ('x' * 98 + '\r\n') * 15
+        for n in range(QUOTA_SLOTS + 1):
+            recipient = 'to%d@%s' % (n, domain)
+            with SMTP() as smtp:
+                smtp.connect(HOST, QUOTA_PORT)
+                smtp.ehlo()
+                for _ in range(2):
+                    assert_that(smtp.sendmail('from@domain', [recipient], message), equal_to({}))
+                smtp.quit()
+            self.check_quota(recipient, message, (452, b'Mailbox quota exceeded'))
+            dir_path = mailbox_new_path(domain, 'to%d' % n, QUOTA_MAILDIR)
+            for name in os.listdir(dir_path):
+                os.remove(os.path.join(dir_path, name))
+            for _ in range(WAIT_COUNT):
+                if QUOTA_SLOT_READY not in quota_slot_states():
+                    break
+                sleep(TIMEOUT)
+            assert_that(QUOTA_SLOT_READY in quota_slot_states(), equal_to(False))
+            self.check_quota(recipient, message, (250, b'Ok'))
+
+class RootsTest(TestCase):
+    @classmethod
+    def setUpClass(cls):
+        for root in ROOTS + LEAST_LOADED_ROOTS:
+            shutil.rmtree(root, ignore_errors=True)
+        cls.servers = [start_server(ROOTS_CONFIG, ROOTS_PORT),
+            start_server(LEAST_LOADED_CONFIG, LEAST_LOADED_PORT)]
+
+    @classmethod
+    def tearDownClass(cls):
+        for server in cls.servers:
+            stop_server(server)
+
+    def send(self, port, recipients):
+        with SMTP() as smtp:
+            smtp.connect(HOST, port)
+            smtp.ehlo()
+            assert_that(smtp.sendmail('from@domain', recipients, 'message'), equal_to({}))
+            smtp.quit()
+
+    def test_domain_placement_should_keep_domain_in_hashed_root(self):
+        domains = [uuid.uuid4().hex for _ in range(COUNT * 2)]
+        self.send(ROOTS_PORT, ['to%d@%s' % (n, domain) for domain in domains for n in range(COUNT)])
+        for domain in domains:
+            root = hash_root(domain, len(ROOTS))
+            for n in range(COUNT):
+                assert_that(len(os.listdir(mailbox_new_path(domain, 'to%d' % n, ROOTS[root]))),
+                    equal_to(1))
+            assert_that(os.path.exists(os.path.join(ROOTS[1 - root], domain)), equal_to(False))
+
+    def test_least_loaded_placement_should_keep_existing_mailbox_root(self):
+        domain = uuid.uuid4().hex
+        address = 'existing@%s' % domain
+        root = 1 - hash_root(address, len(LEAST_LOADED_ROOTS))
+        dir_path = mailbox_new_path(domain, 'existing', LEAST_LOADED_ROOTS[root])
+        for name in ('tmp', 'new', 'cur'):
+            os.makedirs(os.path.join(os.path.dirname(dir_path), name))
+        self.send(LEAST_LOADED_PORT, [address])
+        assert_that(len(os.listdir(dir_path)), equal_to(1))
+        assert_that(os.path.exists(os.path.join(LEAST_LOADED_ROOTS[1 - root], domain)),
+            equal_to(False))
+
+    def test_least_loaded_placement_should_create_idle_mailbox_in_hashed_root(self):
+        domain = uuid.uuid4().hex
+        address = 'created@%s' % domain
+        root = hash_root(address, len(LEAST_LOADED_ROOTS))
+        self.send(LEAST_LOADED_PORT, [address])
+        assert_that(len(os.listdir(mailbox_new_path(domain, 'created', LEAST_LOADED_ROOTS[root]))),
+            equal_to(1))
+
+class FlowControlTest(TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.server = start_server(FLOW_CONTROL_CONFIG, FLOW_CONTROL_PORT)
+
+    @classmethod
+    def tearDownClass(cls):
+        stop_server(cls.server)
+
+    def read_message(self, domain):
+        dir_path = mailbox_new_path(domain, 'to', FLOW_CONTROL_MAILDIR)
+        with open(os.path.join(dir_path, os.listdir(dir_path)[0]), 'rb') as f:
+            return b'\n'.join(f.read().split(b'\n')[2:])
+
+    def test_send_chunks_over_high_watermark_should_deliver(self):
+        domain = uuid.uuid4().hex
+        chunks = [(b'%d' % n) * 100 + b'\r\n' for n in range(COUNT)]
+        with SMTP() as smtp:
+            smtp.connect(HOST, FLOW_CONTROL_PORT)
+            smtp.ehlo()
+            assert_that(smtp.mail('from@domain'), equal_to((250, b'Ok')))
+            assert_that(smtp.rcpt(['to@%s' % domain]), equal_to((250, b'Ok')))
+            for chunk in chunks:
+                smtp.send(b'BDAT %d\r\n' % len(chunk) + chunk)
+                assert_that(smtp.getreply(), equal_to((250, b'Ok')))
+                assert_that(smtp.noop(), equal_to((250, b'Ok')))
+            smtp.send(b'BDAT 0 LAST\r\n')
+            assert_that(smtp.getreply()[0], equal_to(250))
+            smtp.quit()
+        assert_that(self.read_message(domain), equal_to(b''.join(chunks)))
+
+    def test_send_data_over_high_watermark_should_deliver(self):
+        domain = uuid.uuid4().hex
+        message = ('x' * 1000 + '\r\n') * 64
+        with SMTP() as smtp:
+            smtp.connect(HOST, FLOW_CONTROL_PORT)
+            smtp.ehlo()
+            assert_that(smtp.sendmail('from@domain', ['to@%s' % domain], message), equal_to({}))
+            smtp.quit()
+        assert_that(self.read_message(domain), equal_to(message.encode()))
+
+    def test_start_with_low_watermark_not_below_high_should_fail(self):
+        with open(FLOW_CONTROL_CONFIG) as f:
+            config = f.read().replace('flow_control_low_watermark = 0;',
+                'flow_control_low_watermark = 1;')
+        path = 'var/test_flow_control_invalid.cfg'
+        with open(path, 'w') as f:
+            f.write(config)
+        assert_that(subprocess.run([SERVER, path], stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL, timeout=WAIT_COUNT * TIMEOUT).returncode != 0, equal_to(True))
+
+class CompressionTest(TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.server = start_server(COMPRESSION_CONFIG, COMPRESSION_PORT)
+
+    @classmethod
+    def tearDownClass(cls):
+        stop_server(cls.server)
+
+    def send_and_read(self, message):
+        domain = uuid.uuid4().hex
+        recipients = ['to%d@%s' % (n, domain) for n in range(COUNT)]
+        with SMTP() as smtp:
+            smtp.connect(HOST, COMPRESSION_PORT)
+            smtp.ehlo()
+            assert_that(smtp.sendmail('from@domain', recipients, message), equal_to({}))
+            smtp.quit()
+        contents = []
+        for n in range(COUNT):
+            dir_path = mailbox_new_path(domain, 'to%d' % n, COMPRESSION_MAILDIR)
+            files = os.listdir(dir_path)
+            assert_that(len(files), equal_to(1))
+            assert_that(files[0].endswith('.zst'), equal_to(True))
+            path = os.path.join(dir_path, files[0])
+            output = subprocess.run([MAILDIR_CAT, path], stdout=subprocess.PIPE, check=True).stdout
+            assert_that(os.path.getsize(path) < len(output), equal_to(True))
+            contents.append(b'\n'.join(output.split(b'\n')[2:]))
+        return contents
+
+    def test_send_message_should_round_trip_through_maildir_cat(self):
+        message = ('line of compressible text\r\n' * 64)
+        assert_that(self.send_and_read(message), equal_to([message.encode()] * COUNT))
+
+    def test_send_message_over_spool_size_should_round_trip_through_maildir_cat(self):
+        message = ''.join('%s %s\r\n' % (os.urandom(8).hex(), 'compressible text ' * 4) for _ in range(8192))
+        assert_that(self.send_and_read(message), equal_to([message.encode()] * COUNT))
+
+class IntentLogTest(TestCase):
+    def test_start_should_remove_files_of_dead_worker(self):
+        shutil.rmtree(INTENT_LOG_DIR, ignore_errors=True)
+        domain = uuid.uuid4().hex
+        maildirs = [os.path.dirname(mailbox_new_path(domain, local, ROOTS[0]))
+            for local in ('writing', 'committing')]
+        for maildir in maildirs:
+            for name in ('tmp', 'new', 'cur'):
+                os.makedirs(os.path.join(maildir, name))
+            with open(os.path.join(maildir, 'tmp', 'message.eml'), 'w') as f:
+                f.write('message')
+        os.makedirs(INTENT_LOG_DIR)
+        with open(os.path.join(INTENT_LOG_DIR, 'dead-worker'), 'wb') as f:
+            for maildir, state in zip(maildirs, (INTENT_WRITING, INTENT_COMMITTING)):
+                f.write(INTENT_SLOT.pack(state, maildir.encode(), b'message.eml'))
+        server = start_server(ROOTS_CONFIG, ROOTS_PORT)
+        stop_server(server)
+        for maildir in maildirs:
+            assert_that(os.listdir(os.path.join(maildir, 'tmp')), equal_to([]))
+            assert_that(os.listdir(os.path.join(maildir, 'new')), equal_to([]))
+        assert_that(os.path.exists(os.path.join(INTENT_LOG_DIR, 'dead-worker')), equal_to(False))
+
+class MaildirShardTest(TestCase):
+    def make_mailbox(self, maildir, name):
+        for sub_dir in ('tmp', 'new', 'cur'):
+            os.makedirs(os.path.join(maildir, sub_dir), exist_ok=True)
+        with open(os.path.join(maildir, 'new', name), 'w') as f:
+            f.write(name)
+
+    def shard(self):
+        return subprocess.run([MAILDIR_SHARD, SHARD_MAILDIR, str(MAILDIR_SHARD_WIDTH)],
+            stdout=subprocess.PIPE, check=True).stdout
+
+    def test_shard_flat_tree_should_move_and_merge_mailboxes(self):
+        shutil.rmtree(SHARD_MAILDIR, ignore_errors=True)
+        domain = uuid.uuid4().hex
+        local_parts = ['moved', 'merged']
+        for local in local_parts:
+            self.make_mailbox(os.path.join(SHARD_MAILDIR, domain, local, 'Maildir'), 'flat')
+        self.make_mailbox(os.path.dirname(mailbox_new_path(domain, 'merged', SHARD_MAILDIR)), 'sharded')
+        assert_that(self.shard(), equal_to(b'kept: 1, moved: 1, merged: 1, failed: 0\n'))
+        assert_that(sorted(os.listdir(mailbox_new_path(domain, 'moved', SHARD_MAILDIR))),
+            equal_to(['flat']))
+        assert_that(sorted(os.listdir(mailbox_new_path(domain, 'merged', SHARD_MAILDIR))),
+            equal_to(['flat', 'sharded']))
+        for local in local_parts:
+            assert_that(os.path.exists(os.path.join(SHARD_MAILDIR, domain, local)), equal_to(False))
+        assert_that(self.shard(), equal_to(b'kept: 2, moved: 0, merged: 0, failed: 0\n'))
+
 if __name__ == '__main__':
     main()